@@ -0,0 +1,50 @@
+/* ****************************************************************************
+   Clock.c
+
+	 Keeps time since startup in milliseconds, counted from Timer0 overflowing.
+	 With a /64 prescaler that's every 1024us on a 16MHz board (the same as
+	 Arduino's millis()), so each overflow carries the extra microseconds over
+	 to the next
+***************************************************************************** */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "Clock.h"
+
+#define CLOCK_PRESCALER 64
+// Microseconds between overflows of the 8 bit timer
+#define OVERFLOW_MICROS (CLOCK_PRESCALER * 256UL / (F_CPU / 1000000UL))
+
+static volatile uint32_t Millis;
+// Microseconds past Millis
+static volatile uint16_t Micros;
+
+void ClockInit(void) {
+	Millis = 0;
+	Micros = 0;
+
+	// Normal mode, counting up to 0xFF and overflowing
+	TCCR0A &= ~(_BV(WGM01) | _BV(WGM00));
+	TCCR0B = (TCCR0B & ~(_BV(WGM02) | _BV(CS02))) | _BV(CS01) | _BV(CS00);
+	TCNT0 = 0;
+	TIMSK0 |= _BV(TOIE0);
+}
+
+// Milliseconds since ClockInit (wrapping after 49 days)
+uint32_t ClockMillis(void) {
+	cli();
+	uint32_t millis = Millis;
+	sei();
+	return millis;
+}
+
+ISR(TIMER0_OVF_vect) {
+	uint16_t micros = Micros + OVERFLOW_MICROS;
+	uint32_t millis = Millis;
+	while (micros >= 1000) {
+		micros -= 1000;
+		millis++;
+	}
+	Micros = micros;
+	Millis = millis;
+}
@@ -0,0 +1,4 @@
+#include <stdint.h>
+
+void ClockInit(void);
+uint32_t ClockMillis(void);
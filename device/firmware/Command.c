@@ -5,9 +5,14 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 
+#include "Clock.h"
+#include "Config.h"
 #include "UART.h"
 #include "Move.h"
 #include "Motor.h"
+#include "Path.h"
+#include "Planner.h"
+#include "Units.h"
 
 #define MOVE_ABS 0x01
 #define MOVE_REL 0x02
@@ -24,17 +29,76 @@
 #define MOVE_ABS_RETURN 0x0E
 #define GET_TARGET 0x0F
 #define MOVE_REL_RETURN 0x10
+#define PROTOCOL_RETURN 0x12
+#define MOVE_BATCH 0x15
+#define MOVE_BATCH_RETURN 0x16
+#define SUBSCRIBE 0x17
+#define POS_UPDATE 0x18
+#define QUEUE_SPACE 0x19
+#define GET_PARAM 0x1A
+#define SET_PARAM 0x1B
+#define PARAM_RETURN 0x1C
+#define PATH_CLEAR 0x1D
+#define PATH_ADD 0x1E
+#define PATH_RUN 0x1F
+#define PATH_RETURN 0x20
+#define TIME 0x21
+#define TIME_RETURN 0x22
+#define MOVE_AT 0x23
+#define HOME_RETURN 0x24
+
+// MOVE_BATCH starts with the number of segments (up to 15, so half the
+// movement queue in Move.c) in the top four bits, so it's never LINE_END, and
+// flags in the bottom ones. Segments are all absolute unless
+// MOVE_BATCH_RELATIVE is set
+#define MOVE_BATCH_COUNT_SHIFT 4
+#define MOVE_BATCH_RELATIVE 0x01
+
+// Position updates pushed to the host (see SUBSCRIBE): milliseconds between
+// them (0 if it hasn't subscribed), and when we sent the last one and what
+// position it had
+static uint16_t UpdatePeriod;
+static uint32_t LastUpdate;
+static position UpdateX, UpdateY, UpdateTheta, UpdatePhi;
+static bool UpdateNow;
+static void PushPosition(void);
+
+// Flow control, with frames: replies to movements say how many more
+// movements there's room for in the queue, and whenever that changes we tell
+// the host with QUEUE_SPACE, so it never has to send a movement that won't fit
+// (or wait once there's room). The space we last told it about, or
+// SPACE_UNKNOWN if it's never been told
+#define SPACE_UNKNOWN 0xFF
+static byte AdvertisedSpace;
+static void WriteQueueSpace(void);
+static void PushQueueSpace(void);
+
+// Positions in commands and replies: steps, or with PROTOCOL_UNITS,
+// millimetres and degrees (see Units.c)
+static bool ReadPositions(position positions[AXES], bool relative);
+static void WritePositions(position x, position y, position theta, position phi);
+
+// Bring everything to a stop (STOP and ABORT)
+static void StopMoving(void);
 
 // Initial setup of the command interface
 void CommandInit(void) {
 	UARTInit();
+	UnitsInit();
+	UpdatePeriod = 0;
+	AdvertisedSpace = SPACE_UNKNOWN;
 }
 
 // Parse and act upon a command on each run of the main loop
 void CommandSpin(void) {
+	PushPosition();
+	PushQueueSpace();
+
 	// Check we have a sequence of characters available up to the newline,
 	// becuase we don't want any of our read operations to block
 	if (UARTLineAvailable()) {
+		// Corrupted or repeated frames have already been dealt with
+		if (!UARTReadStart()) { return; }
 		byte command = UARTReadByte();
 
 		// TODO: Code here is very duplicated. Is there a way we can reduce it without losing speed?
@@ -42,64 +106,124 @@ void CommandSpin(void) {
 			// Move to a absolutely-specified position
 			case MOVE_ABS: {
 				// Read positions
-				position xPos = UARTReadPosition();
-				position yPos = UARTReadPosition();
-				position thetaPos = UARTReadPosition();
-				position phiPos = UARTReadPosition();
+				position pos[AXES];
+				bool valid = ReadPositions(pos, false);
 
 				// Try and move there
 				UARTWriteByte(MOVE_ABS_RETURN);
-				if (!MoveAddAbsolute(xPos, yPos, thetaPos, phiPos)) {
+				if (valid && !PathRunning() && !MoveAddAbsolute(pos[AXIS_X], pos[AXIS_Y], pos[AXIS_THETA], pos[AXIS_PHI])) {
+					UnitsCommit();
+					UARTWriteByte(SUCCESS);
+				} else {
+					UARTWriteByte(FAILURE);
+				}
+				WriteQueueSpace();
+				UARTWriteEnd();
+				break;
+			}
+
+			// Move to an absolutely-specified position, starting at a time on the
+			// device clock (see TIME). Frames only, like TIME
+			case MOVE_AT: {
+				uint32_t time = UARTReadLong();
+				position pos[AXES];
+				bool valid = ReadPositions(pos, false) && UARTProtocol() != PROTOCOL_LINES;
+
+				UARTWriteByte(MOVE_ABS_RETURN);
+				if (valid && !PathRunning() && !MoveAddAt(pos[AXIS_X], pos[AXIS_Y], pos[AXIS_THETA], pos[AXIS_PHI], time)) {
+					UnitsCommit();
 					UARTWriteByte(SUCCESS);
 				} else {
 					UARTWriteByte(FAILURE);
 				}
-				UARTWriteByte(LINE_END);
+				WriteQueueSpace();
+				UARTWriteEnd();
 				break;
 			}
 
 			// move to a position specified relative to the current position
 			case MOVE_REL: {
 				// Read positions
-				position xPos = UARTReadPosition();
-				position yPos = UARTReadPosition();
-				position thetaPos = UARTReadPosition();
-				position phiPos = UARTReadPosition();
+				position pos[AXES];
+				bool valid = ReadPositions(pos, true);
 
 				// Try and move there
 				UARTWriteByte(MOVE_REL_RETURN);
-				if (!MoveAddRelative(xPos, yPos, thetaPos, phiPos)) {
+				if (valid && !PathRunning() && !MoveAddRelative(pos[AXIS_X], pos[AXIS_Y], pos[AXIS_THETA], pos[AXIS_PHI])) {
+					UnitsCommit();
 					UARTWriteByte(SUCCESS);
 				} else {
 					UARTWriteByte(FAILURE);
 				}
-				UARTWriteByte(LINE_END);
+				WriteQueueSpace();
+				UARTWriteEnd();
 				break;
 			}
 
-			// Home (move until the endstop is hit) the X axis
-			case HOME_X:
-				MoveHomeX();
+			// Move through up to 15 positions in one go. Replies with the
+			// number that were queued (in the top four bits again): once the
+			// queue's full the rest are dropped, and the host has to send them again
+			case MOVE_BATCH: {
+				byte header = UARTReadByte();
+				byte count = header >> MOVE_BATCH_COUNT_SHIFT;
+				byte accepted = 0;
+				bool relative = header & MOVE_BATCH_RELATIVE;
+				for (byte i = 0; i < count; i++) {
+					position pos[AXES];
+					bool valid = ReadPositions(pos, relative);
+					if (accepted < i || !valid || PathRunning()) { continue; }
+					int error = relative
+						? MoveAddRelative(pos[AXIS_X], pos[AXIS_Y], pos[AXIS_THETA], pos[AXIS_PHI])
+						: MoveAddAbsolute(pos[AXIS_X], pos[AXIS_Y], pos[AXIS_THETA], pos[AXIS_PHI]);
+					if (!error) {
+						UnitsCommit();
+						accepted++;
+					}
+				}
+
+				UARTWriteByte(MOVE_BATCH_RETURN);
+				UARTWriteByte(accepted << MOVE_BATCH_COUNT_SHIFT);
+				WriteQueueSpace();
+				UARTWriteEnd();
 				break;
+			}
 
-			// Home (move until the endstop is hit) the Y axis
-			case HOME_Y:
-				MoveHomeX();
+			// Home (move until the endstop is hit) the X or Y axis, once the
+			// movements already queued are done. Replies with the axis and
+			// whether it'll be homed: not if the other axis is already waiting
+			// to home after different movements (see MoveHome), or while a
+			// path's running, like movements (the rest of the path would be
+			// followed from wherever homing left us)
+			case HOME_X:
+			case HOME_Y: {
+				byte axis = (command == HOME_X) ? AXIS_X : AXIS_Y;
+				UARTWriteByte(HOME_RETURN);
+				UARTWriteByte(axis);
+				if (!PathRunning() && !MoveHome(_BV(axis))) {
+					// Homing leaves the end of the queue on a whole step
+					UnitsClearRemainders();
+					UARTWriteByte(SUCCESS);
+				} else {
+					UARTWriteByte(FAILURE);
+				}
+				UARTWriteEnd();
 				break;
+			}
 
 			// Power up all motors
 			case START:
 				MotorStart();
 				break;
 
-			// Cancel any future moves, and power down all motors	
+			// Cancel any future moves, and power down all motors
 			case STOP:
+				StopMoving();
 				MotorStop();
 				break;
 
-			// Power down all motors
+			// Cancel any future moves, leaving the motors powered
 			case ABORT:
-				MoveAbort();
+				StopMoving();
 				break;
 
 			// Send back the current platform position coordinates
@@ -110,11 +234,8 @@ void CommandSpin(void) {
 
 				// Output
 				UARTWriteByte(POS_RETURN);
-				UARTWritePosition(xPos);
-				UARTWritePosition(yPos);
-				UARTWritePosition(thetaPos);
-				UARTWritePosition(phiPos);
-				UARTWriteByte(LINE_END);
+				WritePositions(xPos, yPos, thetaPos, phiPos);
+				UARTWriteEnd();
 				break;
 			}
 
@@ -127,19 +248,178 @@ void CommandSpin(void) {
 
 				// Output
 				UARTWriteByte(TARGET_RETURN);
-				UARTWritePosition(xPos);
-				UARTWritePosition(yPos);
-				UARTWritePosition(thetaPos);
-				UARTWritePosition(phiPos);
-				UARTWriteByte(LINE_END);
+				WritePositions(xPos, yPos, thetaPos, phiPos);
+				UARTWriteEnd();
+				break;
+			}
+
+			// Push the position to the host whenever it changes, at most once every
+			// period (milliseconds, as a position), until it asks again with 0
+			case SUBSCRIBE: {
+				position period = UARTReadPosition();
+				UpdatePeriod = (period > 0) ? period : 0;
+				UpdateNow = true;
+				break;
+			}
+
+			// Send back the device clock (milliseconds since startup), so the host
+			// can work out how it lines up with its own (see rpi/api/clocksync.js).
+			// Frames only: the time can contain the end of a line
+			case TIME: {
+				bool ok = UARTProtocol() != PROTOCOL_LINES;
+				UARTWriteByte(TIME_RETURN);
+				UARTWriteByte(ok ? SUCCESS : FAILURE);
+				UARTWriteLong(ok ? ClockMillis() : 0);
+				UARTWriteEnd();
+				break;
+			}
+
+			// Read or change a setting (see Config.c). Replies with the setting,
+			// whether that worked, and its value (now). Frames only: settings and
+			// values can contain the end of a line
+			case GET_PARAM:
+			case SET_PARAM: {
+				byte param = UARTReadByte();
+				int32_t set = (command == SET_PARAM) ? UARTReadLong() : 0;
+				uint32_t value = 0;
+				bool ok = false;
+				if (UARTProtocol() != PROTOCOL_LINES) {
+					ok = (command == GET_PARAM) || ConfigSet(param, set);
+					// The scales might have changed
+					if (ok && command == SET_PARAM) { UnitsInit(); }
+					ok = ConfigGet(param, &value) && ok;
+				}
+				UARTWriteByte(PARAM_RETURN);
+				UARTWriteByte(param);
+				UARTWriteByte(ok ? SUCCESS : FAILURE);
+				UARTWriteLong(value);
+				UARTWriteEnd();
+				break;
+			}
+
+			// Paths through keyframes (see Path.c). Each replies with whether it
+			// worked, and how many keyframes there are now. Movements fail while
+			// a path's running, because it's filling the queue
+			case PATH_CLEAR:
+			case PATH_ADD:
+			case PATH_RUN: {
+				bool ok = true;
+				if (command == PATH_CLEAR) {
+					PathClear();
+				} else if (command == PATH_ADD) {
+					// Milliseconds after the keyframe before
+					position duration = UARTReadPosition();
+					position pos[AXES];
+					ok = ReadPositions(pos, false) && PathAdd(pos, (duration > 0) ? duration : 0);
+				} else {
+					ok = PathRun();
+					// The path ends on a whole step
+					if (ok) { UnitsClearRemainders(); }
+				}
+				UARTWriteByte(PATH_RETURN);
+				UARTWriteByte(ok ? SUCCESS : FAILURE);
+				UARTWriteByte(PathKeyframes());
+				UARTWriteEnd();
+				break;
+			}
+
+			// Switch to the newest protocol we both speak, after replying with
+			// its version in the one we're speaking now
+			case PROTOCOL: {
+				byte version = UARTReadByte();
+				if (version > PROTOCOL_VERSION) { version = PROTOCOL_VERSION; }
+				UARTWriteByte(PROTOCOL_RETURN);
+				UARTWriteByte(version);
+				UARTWriteEnd();
+				UARTSetProtocol(version);
+				AdvertisedSpace = SPACE_UNKNOWN;
+				UnitsClearRemainders();
 				break;
 			}
 		}
 
-		// Read until the end of line to ensure we didn't miss any characters
-		byte b = 0x00;
-		do {
-			b = UARTReadByte();
-		} while (b != LINE_END);
+		// Read until the end of the command to ensure we didn't miss any characters
+		UARTReadEnd();
+	}
+}
+
+// Cancel the path, any queued movements and homing, and slow the current
+// movement to a stop. Where it stops is a whole step, so nothing's left to
+// carry into the next relative movement
+static void StopMoving(void) {
+	PathStop();
+	MoveAbort();
+	UnitsClearRemainders();
+}
+
+// Read a movement's positions, converting them to steps. Returns false if
+// they're out of range, having still read them all
+static bool ReadPositions(position positions[AXES], bool relative) {
+	if (UARTProtocol() != PROTOCOL_UNITS) {
+		for (byte axis = 0; axis < AXES; axis++) { positions[axis] = UARTReadPosition(); }
+		return true;
+	}
+	bool valid = true;
+	for (byte axis = 0; axis < AXES; axis++) {
+		if (!UnitsToSteps(axis, UARTReadLong(), relative, &positions[axis])) { valid = false; }
+	}
+	return valid;
+}
+
+static void WritePositions(position x, position y, position theta, position phi) {
+	if (UARTProtocol() != PROTOCOL_UNITS) {
+		UARTWritePosition(x);
+		UARTWritePosition(y);
+		UARTWritePosition(theta);
+		UARTWritePosition(phi);
+		return;
 	}
+	UARTWriteLong(UnitsFromSteps(AXIS_X, x));
+	UARTWriteLong(UnitsFromSteps(AXIS_Y, y));
+	UARTWriteLong(UnitsFromSteps(AXIS_THETA, theta));
+	UARTWriteLong(UnitsFromSteps(AXIS_PHI, phi));
+}
+
+// Push the current position to the host if it's subscribed, it's been long
+// enough since the last update, and the position's changed since then
+static void PushPosition(void) {
+	if (UpdatePeriod == 0) { return; }
+	uint32_t now = ClockMillis();
+	if (!UpdateNow && now - LastUpdate < UpdatePeriod) { return; }
+
+	position xPos, yPos, thetaPos, phiPos;
+	MoveGetCurrentPosition(&xPos, &yPos, &thetaPos, &phiPos);
+	if (!UpdateNow && xPos == UpdateX && yPos == UpdateY && thetaPos == UpdateTheta && phiPos == UpdatePhi) { return; }
+	UpdateNow = false;
+	LastUpdate = now;
+	UpdateX = xPos;
+	UpdateY = yPos;
+	UpdateTheta = thetaPos;
+	UpdatePhi = phiPos;
+
+	UARTPushStart();
+	UARTWriteByte(POS_UPDATE);
+	WritePositions(xPos, yPos, thetaPos, phiPos);
+	UARTPushEnd();
+}
+
+// Add the space left in the queue to a reply to a movement (not in lines, so
+// old hosts get the replies they expect)
+static void WriteQueueSpace(void) {
+	if (UARTProtocol() == PROTOCOL_LINES) { return; }
+	AdvertisedSpace = MoveQueueSpace();
+	UARTWriteByte(AdvertisedSpace);
+}
+
+// Tell the host if the space in the queue has changed since we last did
+static void PushQueueSpace(void) {
+	if (UARTProtocol() == PROTOCOL_LINES) { return; }
+	byte space = MoveQueueSpace();
+	if (space == AdvertisedSpace) { return; }
+	AdvertisedSpace = space;
+
+	UARTPushStart();
+	UARTWriteByte(QUEUE_SPACE);
+	UARTWriteByte(space);
+	UARTPushEnd();
 }
@@ -0,0 +1,200 @@
+/* ****************************************************************************
+   Config.c
+
+	 Keeps the settings in Config, which everything else reads directly, and
+	 saves them in the EEPROM so they survive a reset. The EEPROM holds a
+	 version number, the settings and a CRC over both: if either doesn't
+	 match (a new board, or firmware that's changed what's stored) we start
+	 from the defaults below instead.
+
+	 Each change is saved as it's made. EEPROM writes take a few milliseconds
+	 a byte, but only bytes that have changed are written, and the step
+	 interrupt carries on meanwhile.
+***************************************************************************** */
+
+#include <stddef.h>
+#include <avr/eeprom.h>
+#include <avr/io.h>
+#include "Config.h"
+#include "Global.h"
+#include "Planner.h"
+
+// Bump whenever config changes, so old settings aren't read as new ones
+#define CONFIG_VERSION 2
+
+// Defaults. Maximum velocity (steps/s) and acceleration (steps/s^2) of each
+// axis
+#define X_MAX_VELOCITY 2000
+#define X_ACCELERATION 4000
+#define Y_MAX_VELOCITY 2000
+#define Y_ACCELERATION 4000
+#define THETA_MAX_VELOCITY 1000
+#define THETA_ACCELERATION 2000
+#define PHI_MAX_VELOCITY 1000
+#define PHI_ACCELERATION 2000
+// Steps per mm or degree. Steppers with 1/16 microstepping on a 20 tooth GT2
+// pulley make 80 steps/mm. Servo steps are microseconds of pulse (see
+// Servo.c), about 10 a degree
+#define X_STEPS_PER_UNIT 80
+#define Y_STEPS_PER_UNIT 80
+#define THETA_STEPS_PER_UNIT 10
+#define PHI_STEPS_PER_UNIT 10
+// Homing speeds (steps/s), and how far to back off the endstop between the
+// two seeks (steps). See Move.c
+#define HOME_FAST_VELOCITY 1000
+#define HOME_SLOW_VELOCITY 100
+#define HOME_BACK_OFF 100
+// Position of each axis once it's homed (steps)
+#define HOME_X_LATCH 0
+#define HOME_Y_LATCH 0
+
+// Limits on what the settings can be changed to. The step interrupt can't
+// keep up with much more than 10000 steps/s (see 'make bench'), and only X
+// and Y have direction pins
+#define VELOCITY_LIMIT 10000
+#define BACK_OFF_LIMIT 1000
+#define LATCH_LIMIT 20000
+#define SCALE_MIN (((uint32_t) 1 << 16) + 1)
+#define SCALE_MAX ((uint32_t) UINT16_MAX << 16)
+#define DIR_REVERSE_AXES (_BV(AXIS_X) | _BV(AXIS_Y))
+
+config Config;
+
+// What's kept in the EEPROM
+typedef struct {
+	uint8_t Version;
+	config Config;
+	uint16_t CRC;
+} config_block;
+static config_block EEMEM Stored;
+
+static void ConfigDefaults(void);
+static uint16_t ConfigCRC(config_block *block);
+static void *Param(uint8_t param, uint8_t *size, bool *sign, uint32_t *min, uint32_t *max);
+
+// Load the settings from the EEPROM, or the defaults if they're not there
+void ConfigInit(void) {
+	config_block block;
+	eeprom_read_block(&block, &Stored, sizeof(block));
+	if (block.Version == CONFIG_VERSION && block.CRC == ConfigCRC(&block)) {
+		Config = block.Config;
+	} else {
+		ConfigDefaults();
+	}
+}
+
+static void ConfigDefaults(void) {
+	Config.MaxVelocity[AXIS_X] = X_MAX_VELOCITY;
+	Config.MaxVelocity[AXIS_Y] = Y_MAX_VELOCITY;
+	Config.MaxVelocity[AXIS_THETA] = THETA_MAX_VELOCITY;
+	Config.MaxVelocity[AXIS_PHI] = PHI_MAX_VELOCITY;
+	Config.Acceleration[AXIS_X] = X_ACCELERATION;
+	Config.Acceleration[AXIS_Y] = Y_ACCELERATION;
+	Config.Acceleration[AXIS_THETA] = THETA_ACCELERATION;
+	Config.Acceleration[AXIS_PHI] = PHI_ACCELERATION;
+	Config.Scale[AXIS_X] = (uint32_t) X_STEPS_PER_UNIT << 16;
+	Config.Scale[AXIS_Y] = (uint32_t) Y_STEPS_PER_UNIT << 16;
+	Config.Scale[AXIS_THETA] = (uint32_t) THETA_STEPS_PER_UNIT << 16;
+	Config.Scale[AXIS_PHI] = (uint32_t) PHI_STEPS_PER_UNIT << 16;
+	Config.DirReverse = 0;
+	Config.HomeFastVelocity = HOME_FAST_VELOCITY;
+	Config.HomeSlowVelocity = HOME_SLOW_VELOCITY;
+	Config.HomeBackOff = HOME_BACK_OFF;
+	Config.HomeLatch[AXIS_X] = HOME_X_LATCH;
+	Config.HomeLatch[AXIS_Y] = HOME_Y_LATCH;
+}
+
+// CRC of the version and settings
+static uint16_t ConfigCRC(config_block *block) {
+	uint16_t crc = 0xFFFF;
+	uint8_t *data = (uint8_t *) block;
+	for (uint8_t i = 0; i < offsetof(config_block, CRC); i++) { crc = CRCUpdate(crc, data[i]); }
+	return crc;
+}
+
+// Read a parameter into value. Returns false if there's no such parameter
+bool ConfigGet(uint8_t param, uint32_t *value) {
+	uint8_t size;
+	bool sign;
+	uint32_t min, max;
+	void *p = Param(param, &size, &sign, &min, &max);
+	if (!p) { return false; }
+	if (sign) {
+		*value = (uint32_t) (int32_t) *(int16_t *) p;
+	} else {
+		*value = (size == 1) ? *(uint8_t *) p : (size == 2) ? *(uint16_t *) p : *(uint32_t *) p;
+	}
+	return true;
+}
+
+// Change a parameter, and save it. Returns false (changing nothing) if
+// there's no such parameter, or it can't be set to value
+bool ConfigSet(uint8_t param, uint32_t value) {
+	uint8_t size;
+	bool sign;
+	uint32_t min, max;
+	void *p = Param(param, &size, &sign, &min, &max);
+	if (!p) { return false; }
+	if (sign ? ((int32_t) value < (int32_t) min || (int32_t) value > (int32_t) max) : (value < min || value > max)) {
+		return false;
+	}
+	if (size == 1) {
+		*(uint8_t *) p = (uint8_t) value;
+	} else if (size == 2) {
+		*(uint16_t *) p = (uint16_t) value;
+	} else {
+		*(uint32_t *) p = value;
+	}
+
+	config_block block;
+	block.Version = CONFIG_VERSION;
+	block.Config = Config;
+	block.CRC = ConfigCRC(&block);
+	eeprom_update_block(&block, &Stored, sizeof(block));
+	return true;
+}
+
+// Where a parameter is kept in Config, its size in bytes, whether it's signed,
+// and the values it can take (as int32s if it's signed). Returns NULL if
+// there's no such parameter
+static void *Param(uint8_t param, uint8_t *size, bool *sign, uint32_t *min, uint32_t *max) {
+	uint8_t axis = param & 0x03;
+	*size = 2;
+	*sign = false;
+	*min = 1;
+	if (param < PARAM_ACCELERATION) {
+		*max = VELOCITY_LIMIT;
+		return &Config.MaxVelocity[axis];
+	} else if (param < PARAM_SCALE) {
+		*max = UINT16_MAX;
+		return &Config.Acceleration[axis];
+	} else if (param < PARAM_DIR_REVERSE) {
+		*size = 4;
+		*min = SCALE_MIN;
+		*max = SCALE_MAX;
+		return &Config.Scale[axis];
+	}
+	switch (param) {
+		case PARAM_DIR_REVERSE:
+			*size = 1;
+			*min = 0;
+			*max = DIR_REVERSE_AXES;
+			return &Config.DirReverse;
+		case PARAM_HOME_FAST_VELOCITY:
+			*max = VELOCITY_LIMIT;
+			return &Config.HomeFastVelocity;
+		case PARAM_HOME_SLOW_VELOCITY:
+			*max = VELOCITY_LIMIT;
+			return &Config.HomeSlowVelocity;
+		case PARAM_HOME_BACK_OFF:
+			*max = BACK_OFF_LIMIT;
+			return &Config.HomeBackOff;
+		case PARAM_HOME_LATCH + AXIS_X:
+		case PARAM_HOME_LATCH + AXIS_Y:
+			*sign = true;
+			*min = (uint32_t) -LATCH_LIMIT;
+			*max = LATCH_LIMIT;
+			return &Config.HomeLatch[axis];
+	}
+	return NULL;
+}
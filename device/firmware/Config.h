@@ -0,0 +1,32 @@
+#include "stdbool.h"
+#include <stdint.h>
+
+// Settings that can be changed while we're running, without reflashing (see
+// Config.c). Arrays are indexed by axis (AXIS_* in Planner.h)
+typedef struct {
+	uint16_t MaxVelocity[4];    // steps/s
+	uint16_t Acceleration[4];   // steps/s^2
+	uint32_t Scale[4];          // Steps per mm or degree, in Q16.16 (see Units.c)
+	uint8_t DirReverse;         // Axes whose direction pins are reversed (a bitmask)
+	uint16_t HomeFastVelocity;  // steps/s
+	uint16_t HomeSlowVelocity;  // steps/s
+	uint16_t HomeBackOff;       // steps
+	int16_t HomeLatch[2];       // Position of X and Y once they're homed (steps)
+} config;
+extern config Config;
+
+// Parameters, as GET_PARAM and SET_PARAM number them (see Command.c). The
+// first three add the axis
+#define PARAM_MAX_VELOCITY 0x00
+#define PARAM_ACCELERATION 0x04
+#define PARAM_SCALE 0x08
+#define PARAM_DIR_REVERSE 0x0C
+#define PARAM_HOME_FAST_VELOCITY 0x0D
+#define PARAM_HOME_SLOW_VELOCITY 0x0E
+#define PARAM_HOME_BACK_OFF 0x0F
+// Adds the axis, X or Y only. Signed: sent as the uint32 of an int32
+#define PARAM_HOME_LATCH 0x10
+
+void ConfigInit(void);
+bool ConfigGet(uint8_t param, uint32_t *value);
+bool ConfigSet(uint8_t param, uint32_t value);
@@ -0,0 +1,15 @@
+/* ****************************************************************************
+   Global.c
+***************************************************************************** */
+
+#include "Global.h"
+
+// CRC-16/CCITT (polynomial 0x1021), a bit at a time: it only ever runs over a
+// frame (see UART.c) or the configuration (see Config.c)
+uint16_t CRCUpdate(uint16_t crc, byte data) {
+	crc ^= (uint16_t) data << 8;
+	for (byte i = 0; i < 8; i++) {
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
@@ -1,3 +1,5 @@
 // Byte used to represent fastest integer type with at least 8 bits available
 #include <stdint.h>
 typedef uint8_t byte;
+
+uint16_t CRCUpdate(uint16_t crc, byte data);
@@ -1,49 +1,65 @@
 /* ****************************************************************************
    Motor.c
 
-	 X and Y are steppers. The stubs for Theta and Phi assume they're steppers,
-	 but once implemented they'll probably actualy be servos instead.
+	 X and Y are steppers. Theta and phi are servos, on another board (see
+	 Servo.c).
+
+	 All the step and direction pins are on the same port, so that each step
+	 (and each change of direction) is a single port write. Step pulses are
+	 started here, and ended by Move.c from the step timer (see MotorStepEnd),
+	 so we never have to busy-wait for them. Drivers step as the pulse ends, so
+	 a change of direction waits for the start of the next pulse: changing it
+	 during one would send that step the wrong way
+
+	 X and Y each have an endstop at their minimum end, wired to close to
+	 ground, so they read low when hit. Any change on them raises a pin change
+	 interrupt, which Move.c uses while homing
 ***************************************************************************** */
 
 #include "stdbool.h"
-#include <util/delay.h>
 #include <avr/io.h>
+#include "Config.h"
 #include "Move.h"
 #include "Motor.h"
+#include "Planner.h"
 
-#define X_DIR_REVERSE 0
-#define Y_DIR_REVERSE 0
-#define THETA_DIR_REVERSE 0
-#define PHI_DIR_REVERSE 0
-
-// Pins
-#define X_DIR_PIN 0
-#define X_DIR_PORT PORTB
-#define X_DIR_DDR DDRB
-#define Y_DIR_PIN 0
-#define Y_DIR_PORT PORTB
-#define Y_DIR_DDR DDRB
+// Pins (Arduino digital pins 8-11)
+#define MOTOR_PORT PORTB
+#define MOTOR_DDR DDRB
 #define X_STEP_PIN 0
-#define X_STEP_PORT PORTB
-#define X_STEP_DDR DDRB
-#define Y_STEP_PIN 0
-#define Y_STEP_PORT PORTB
-#define Y_STEP_DDR DDRB
-
-
-static volatile bool X_IN_STEP = false;
-static volatile bool Y_IN_STEP = false;
+#define X_DIR_PIN 1
+#define Y_STEP_PIN 2
+#define Y_DIR_PIN 3
+#define STEP_PINS (_BV(X_STEP_PIN) | _BV(Y_STEP_PIN))
+#define DIR_PINS (_BV(X_DIR_PIN) | _BV(Y_DIR_PIN))
+
+// Endstops (Arduino analog pins 0-1), on pin change interrupt 1
+#define ENDSTOP_PORT PORTC
+#define ENDSTOP_DDR DDRC
+#define ENDSTOP_PIN PINC
+#define ENDSTOP_PCMSK PCMSK1
+#define ENDSTOP_PCIE PCIE1
+#define X_ENDSTOP_PIN 0
+#define Y_ENDSTOP_PIN 1
+#define ENDSTOP_PINS (_BV(X_ENDSTOP_PIN) | _BV(Y_ENDSTOP_PIN))
+
+// Step pins to pull low on the next MotorStep. Only used from the step ISR
+static byte StepPins = 0;
+// Direction pins to set on the next MotorStep
+static volatile byte DirPins = DIR_PINS;
 
 void MotorInit(void) {
 	// Set all our driver pins to be outputs, and pull them high initially
-	X_DIR_DDR |= _BV(X_DIR_PIN);
-	Y_DIR_DDR |= _BV(Y_DIR_PIN);
-	X_STEP_DDR |= _BV(X_STEP_PIN);
-	Y_STEP_DDR |= _BV(Y_STEP_PIN);
-	X_DIR_PORT |= _BV(X_DIR_PIN);
-	Y_DIR_PORT |= _BV(Y_DIR_PIN);
-	X_STEP_PORT |= _BV(X_STEP_PIN);
-	Y_STEP_PORT |= _BV(Y_STEP_PIN);
+	MOTOR_DDR |= STEP_PINS | DIR_PINS;
+	MOTOR_PORT |= STEP_PINS | DIR_PINS;
+	StepPins = 0;
+	DirPins = DIR_PINS;
+
+	// Endstops are inputs, pulled up until they're hit
+	ENDSTOP_DDR &= ~ENDSTOP_PINS;
+	ENDSTOP_PORT |= ENDSTOP_PINS;
+	ENDSTOP_PCMSK |= ENDSTOP_PINS;
+	PCICR |= _BV(ENDSTOP_PCIE);
 
 	MotorStart();
 }
@@ -55,52 +71,44 @@ void MotorStart(void) {
 	// on/off in MotorStart and MotorStop
 }
 
+// Movements are stopped first, by the caller (see STOP in Command.c)
 void MotorStop(void) {
-	MoveAbort();
 	// If we had a FET controlling VMOT, we'd want to turn that
-	// off as well
+	// off here
 }
 
-void MotorXSetDirection(bool dir) {
-#if(X_DIR_REVERSE == 1)
-	dir = !dir;
-#endif
-	if (dir) {
-		// Pull dir high
-		X_DIR_PORT |= _BV(X_DIR_PIN);
-	} else {
-		// Pull dir low
-		X_DIR_PORT &= ~_BV(X_DIR_PIN);
-	}
+// Set the direction of both X and Y at once (dir high for true, unless the
+// axis is reversed in Config.DirReverse), from the next MotorStep on
+void MotorSetDirection(bool x, bool y) {
+	if (Config.DirReverse & _BV(AXIS_X)) { x = !x; }
+	if (Config.DirReverse & _BV(AXIS_Y)) { y = !y; }
+	byte pins = 0;
+	if (x) { pins |= _BV(X_DIR_PIN); }
+	if (y) { pins |= _BV(Y_DIR_PIN); }
+	DirPins = pins;
 }
 
-void MotorYSetDirection(bool dir) {
-#if(Y_DIR_REVERSE == 1)
-	dir = !dir;
-#endif
-	if (dir) {
-		// Pull dir high
-		Y_DIR_PORT |= _BV(Y_DIR_PIN);
-	} else {
-		// Pull dir low
-		Y_DIR_PORT &= ~_BV(Y_DIR_PIN);
-	}
+void MotorXSetStep(void) { StepPins |= _BV(X_STEP_PIN); }
+void MotorYSetStep(void) { StepPins |= _BV(Y_STEP_PIN); }
+
+// Start a step on the axes set with MotorXSetStep/MotorYSetStep by pulling
+// their step pins low, and set the direction. MotorStepEnd has to be called at
+// least 2us later
+void MotorStep(void) {
+	MOTOR_PORT = (MOTOR_PORT & ~(StepPins | DIR_PINS)) | DirPins;
+	StepPins = 0;
 }
 
-void MotorXSetStep(void) { X_IN_STEP = true; }
-void MotorYSetStep(void) { Y_IN_STEP = true; }
+// Finish any step in progress by pulling the step pins back high
+void MotorStepEnd(void) {
+	MOTOR_PORT |= STEP_PINS;
+}
 
-void MotorStep(void) {
-	// Step start by pulling low
-	if (X_IN_STEP) { X_STEP_PORT &= ~_BV(X_STEP_PIN); }
-	if (Y_IN_STEP) { Y_STEP_PORT &= ~_BV(Y_STEP_PIN); }
-
-	// Delay
-	_delay_us(2);
-
-	// Step stop by pulling back high
-	if (X_IN_STEP) { X_STEP_PORT |= _BV(X_STEP_PIN); }
-	if (Y_IN_STEP) { Y_STEP_PORT |= _BV(Y_STEP_PIN); }
-	X_IN_STEP = false;
-	Y_IN_STEP = false;
+// Which endstops are hit, as a bitmask of axes (see Planner.h)
+uint8_t MotorEndstops(void) {
+	byte pins = ~ENDSTOP_PIN;
+	byte axes = 0;
+	if (pins & _BV(X_ENDSTOP_PIN)) { axes |= _BV(AXIS_X); }
+	if (pins & _BV(Y_ENDSTOP_PIN)) { axes |= _BV(AXIS_Y); }
+	return axes;
 }
@@ -1,10 +1,14 @@
 #include "stdbool.h"
+#include <stdint.h>
 
 void MotorInit(void);
 void MotorStart(void);
 void MotorStop(void);
-void MotorXSetDirection(bool dir);
-void MotorYSetDirection(bool dir);
+void MotorSetDirection(bool x, bool y);
 void MotorXSetStep(void);
 void MotorYSetStep(void);
 void MotorStep(void);
+void MotorStepEnd(void);
+uint8_t MotorEndstops(void);
+// Pin change interrupt the endstops raise
+#define ENDSTOP_vect PCINT1_vect
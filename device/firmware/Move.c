@@ -2,31 +2,88 @@
    Move.c
 
 	 Handles movements (stored in a FIFO implemented as a ring buffer), and then
-	 steps them (very rudimentarily at the moment --- no speed control)
+	 steps them. Each movement accelerates, cruises and decelerates following a
+	 velocity profile from Planner.c, with Timer2 (in CTC mode) firing once for
+	 each step after the interval the profile asks for
+
+	 Movements in the ring are planned ahead (again by Planner.c) so that we
+	 only slow down as much as the corner between two movements needs, rather
+	 than stopping after each one. The next movement is taken off the ring
+	 before the current one finishes, so the step interrupt can carry straight
+	 on into it
+
+	 Homing happens in between movements in the ring, at the point it was asked
+	 for (see MoveHome). Each axis seeks its endstop quickly, backs off, then
+	 seeks it again slowly, and whatever position it's hit at on the way back in
+	 becomes its latch position (a setting: see Config.c). The endstop
+	 interrupt stops the seeks, and MoveSpin starts each part once the one
+	 before is done, so nothing ever waits
+
+	 A movement can also be held in the ring until a time on the clock (see
+	 MoveAddAt). The movements before it finish at rest, and it starts from
+	 rest as soon as MoveSpin sees the time's come, so within a millisecond
 
 	 All position in here stored as an integer (of type position, defined in
-	 Move.h, at the moment as a signed int8)
+	 Move.h, at the moment as a signed int16)
 ***************************************************************************** */
 
 #include "stdbool.h"
+#include <math.h>
+#include <stddef.h>
 #include <avr/interrupt.h>
+#include "Clock.h"
 #include "Move.h"
+#include "Config.h"
 #include "Motor.h"
+#include "Planner.h"
+
+// Settings (see Config.c): each axis' maximum velocity and acceleration, the
+// homing speeds, and the positions X and Y latch to once homed. They're read
+// as each movement is queued, so changing them doesn't affect movements
+// already in the ring
+
+// How far to look for an endstop before giving up (steps). Endstops are at
+// the minimum end of each axis
+#define HOME_MAX_TRAVEL 20000
 
 // Current position. Should be updated by the thing that is calling RingRemove,
 // not RingRemove itself
 static volatile position CurrentX, CurrentY, CurrentTheta, CurrentPhi;
-// Target position: the position at the end of the movement we're currently 
-// completing. Again, should be updated by the thing calling RingRemove, not
-// RingRemove itself. After a movement has been completed, these target
-// variables should not be modified until the start of a new movement.
-static position TargetX, TargetY, TargetTheta, TargetPhi;
+
+// Everything the step interrupt needs to carry out one movement
+typedef struct {
+	// Target position: the position at the end of the movement
+	position TargetX, TargetY, TargetTheta, TargetPhi;
+	// Which direction each axis needs to move in
+	bool XDir, YDir, ThetaDir, PhiDir;
+	// Straight line followed by the movement, and its velocity profile
+	line Line;
+	profile Profile;
+	// Limits the profile was prepared with (on the dominant axis), in case we
+	// have to prepare it again
+	uint16_t MaxVelocity, ExitVelocity, Acceleration;
+} movement;
+// The movement we're currently completing, and the one after it. Again, should
+// be updated by the thing calling RingRemove, not RingRemove itself. After a
+// movement has been completed, Current should not be modified until the start
+// of a new movement.
+static movement Movements[2];
+static movement * volatile Current;
+static movement * volatile Next;
+// Whether Next holds a movement, ready for the step interrupt to swap in
+static volatile bool NextReady;
+static void SwapMovements(void);
+static void StartMovement(void);
+static void PrepareLine(movement *m, movement *previous, uint16_t distance[AXES]);
+static void StopTarget(movement *m);
 // Endgoal position: the element at tail in the ring
 static void ReadEndgoalPosition(position *x, position *y, position *theta, position *phi);
 
 // Three ring buffers to store (x,y,theta,phi) in. However we only keep one]
 // head/tail, because all are updated/read simultaneously
-#define RING_SIZE 64 // Make a power of 2 to make modular arithmetic a lot faster
+// Each movement takes 22 bytes with its plan and speed, so 32 of them is as
+// much of the ATMega328's 2kB of RAM as we can afford
+#define RING_SIZE 32 // Make a power of 2 to make modular arithmetic a lot faster
 // Ring buffer code based on that from
 // http://www.downtowndougbrown.com/2014/08/microcontrollers-uarts/
 static byte RingHead;
@@ -35,10 +92,25 @@ static position RingDataX[RING_SIZE];
 static position RingDataY[RING_SIZE];
 static position RingDataTheta[RING_SIZE];
 static position RingDataPhi[RING_SIZE];
-static int RingAdd(position x, position y, position theta, position phi);
+// Look-ahead plan for each movement in the ring. The movement at RingTail
+// never changes its entry speed: the movement before it has already been told
+// how fast to finish. Everything up to RingPlanned is as fast as it can be
+static plan_block RingPlan[RING_SIZE];
+static byte RingPlanned;
+// Fastest each movement can go along its path (steps/s), so that it takes as
+// long as MoveAddTimed was asked for. 0 if it's as fast as the axes allow
+static uint16_t RingSpeed[RING_SIZE];
+// Direction and speed limit of the last movement added, for planning the
+// corner into the next one
+static float LastUnit[AXES];
+static uint32_t LastNominalSpeedSqr;
+static uint16_t PlanMovement(plan_block *block, bool first, int32_t delta[AXES], uint16_t duration);
+static uint32_t FloatToSqr(float value);
+static int RingAdd(position x, position y, position theta, position phi, uint16_t duration);
 static int RingRemove(position *x, position *y, position *theta, position *phi);
 inline static bool BufferFull(void);
 inline static bool BufferEmpty(void);
+inline static byte BufferCount(void);
 
 // Safely add two positions avoiding integer overflow
 static position SafeAdd(position a, position b);
@@ -47,13 +119,47 @@ static position SafeAdd(position a, position b);
 // need to start one in MoveSpin
 static volatile bool CurrentMovement;
 
-// Which direction each axis needs to move in
-static bool XDir, YDir, ThetaDir, PhiDir;
+// Axes waiting to home (a bitmask, see Planner.h), once the ring gets to
+// HomeAt. Movements from HomeAt on wait for homing to finish
+static byte HomeAxes;
+static byte HomeAt;
+// Part of homing HomeAxis is at, and whether the endstop interrupt stopped
+// its last seek
+typedef enum { HOME_START, HOME_SEEK_FAST, HOME_BACKING_OFF, HOME_SEEK_SLOW } home_phase;
+static volatile home_phase HomePhase;
+static byte HomeAxis;
+static volatile bool HomeHit;
+static void HomeSpin(void);
+static bool HomeMove(int32_t distance, uint16_t velocity);
+inline static bool Homing(void);
+inline static bool RingReady(void);
+
+// Whether a movement's waiting to start at StartTime (ms, see Clock.c), once
+// the ring gets to StartAt
+static bool StartPending;
+static byte StartAt;
+static uint32_t StartTime;
+static bool WaitingToStart(void);
+
+// Timer2 is only 8 bit, so intervals longer than 256 ticks are split up over
+// several compare matches. Number of ticks left in the current interval after
+// the compare match we're waiting on
+static volatile interval TicksRemaining;
+static void StepTimerSchedule(interval ticks);
+inline static void StepTimerReload(void);
+// Step pulses are ended by Timer2's B compare this many ticks (4us each) after
+// they start, so they last 4-8us (drivers need at least ~2us). If the next
+// step's compare match comes first, that ends the pulse instead
+#define STEP_PULSE_TICKS 1
+inline static void StepPulseStart(void);
+// Tighten a velocity/acceleration limit (of the dominant axis, which moves
+// steps) so that an axis moving distance steps stays within its own limit
+static void ApplyAxisLimit(uint16_t *limit, uint16_t axisLimit, uint16_t distance, uint16_t steps);
 
 // Each motor step
 static void MoveStep(void);
 // Calculations before the first MoveStep of each movement
-static void PrecalculateMovement(void);
+static void PrecalculateMovement(movement *m, movement *previous, bool fromRest);
 // When movement is finished
 static void FinishMovement(void);
 
@@ -61,18 +167,18 @@ void MoveInit(void) {
 	// Setup ring buffer
 	RingHead = 0;
 	RingTail = 0;
+	RingPlanned = 0;
 
-	// Disable timer til we need it later
-	TIMSK2 &= ~_BV(TOIE2);
-	// Configure timer in normal mode (no CTC)
-	TCCR2A &= ~(_BV(WGM21) | _BV(WGM20));
-  TCCR2B &= ~_BV(WGM22);
+	// Disable timer interrupts til we need them later
+	TIMSK2 &= ~(_BV(TOIE2) | _BV(OCIE2A) | _BV(OCIE2B));
+	// Configure timer in CTC mode (clear when TCNT2 reaches OCR2A)
+	TCCR2A = (TCCR2A & ~_BV(WGM20)) | _BV(WGM21);
+	TCCR2B &= ~_BV(WGM22);
 	// Use system clock for timer
 	ASSR &= ~_BV(AS2);
-	// Enable overflow interrupt only, no compare interrupt
-  TIMSK2 &= ~_BV(OCIE2A);
-	// 1024 prescaler
-	TCCR2B |= _BV(CS22) | _BV(CS21) | _BV(CS20);
+	// 64 prescaler (see STEP_TIMER_PRESCALER)
+	TCCR2B = (TCCR2B & ~(_BV(CS21) | _BV(CS20))) | _BV(CS22);
+	TicksRemaining = 0;
 
 	// We start off stationary!
 	CurrentMovement = false;
@@ -81,82 +187,307 @@ void MoveInit(void) {
 	CurrentY = 0;
 	CurrentTheta = 0;
 	CurrentPhi = 0;
-	TargetX = 0;
-	TargetY = 0;
-	TargetTheta = 0;
-	TargetPhi = 0;
-	MoveHomeX();
-	MoveHomeY();
+	Current = &Movements[0];
+	Next = &Movements[1];
+	NextReady = false;
+	Current->TargetX = 0;
+	Current->TargetY = 0;
+	Current->TargetTheta = 0;
+	Current->TargetPhi = 0;
+
+	// Homing is up to the host, because it moves as soon as we're powered
+	HomeAxes = 0;
+	HomePhase = HOME_START;
+	HomeHit = false;
+	StartPending = false;
 }
 
 // Called on each iteration of the main loop (NOT via interrupts)
 void MoveSpin(void) {
+	// Carry on homing if we've got to it, and aren't in the middle of a seek
+	if (!CurrentMovement && Homing()) {
+		HomeSpin();
+	}
+
 	// If there are movements we can make in the buffer, and we're currently not moving,
 	// make them
-	if (!CurrentMovement && !BufferEmpty()) {
-		RingRemove(&TargetX, &TargetY, &TargetTheta, &TargetPhi);
-		PrecalculateMovement();
-		MoveStep();
+	if (!CurrentMovement && RingReady()) {
+		PrecalculateMovement(Next, Current, true);
+		StartMovement();
+	}
+
+	// Get the movement after this one ready, so the step interrupt can carry
+	// straight on into it without stopping. Leave it in the ring for as long as
+	// we can though: until we know the movement after it (so we know how fast
+	// to finish), or we're already slowing down for the end of this one
+	if (CurrentMovement && !NextReady && RingReady()
+			&& (BufferCount() >= 2 || Current->Profile.Phase >= PROFILE_DECEL)) {
+		PrecalculateMovement(Next, Current, false);
+
+		cli();
+		if (CurrentMovement) {
+			NextReady = true;
+			sei();
+		} else {
+			sei();
+			// The current movement finished while we were working this one out,
+			// so it's too late to carry straight on: start again from rest
+			PlannerPrepare(&Next->Profile, Next->Line.Steps, 0, Next->MaxVelocity, Next->ExitVelocity, Next->Acceleration);
+			StartMovement();
+		}
 	}
 }
 
-// Called before the start of each movement.
-// Calculates anything we need to calculate or set before beginning a movement
-void PrecalculateMovement(void) {
+// Start moving the movement in Next from rest
+static void StartMovement(void) {
+	SwapMovements();
 	CurrentMovement = true;
-	XDir = (CurrentX < TargetX);
-	YDir = (CurrentY < TargetY);
-	ThetaDir = (CurrentTheta < TargetTheta);
-	PhiDir = (CurrentPhi < TargetPhi);
+
+	// Restart the timer so the first interval is timed from this step. Until
+	// MoveStep loads the real compare value, make sure the old one can't match
+	OCR2A = 0xFF;
+	TCNT2 = 0;
+	TIFR2 = _BV(OCF2A);
+	MoveStep();
+}
+
+// Make the movement in Next the current one
+static void SwapMovements(void) {
+	movement *m = Current;
+	Current = Next;
+	Next = m;
+
+	MotorSetDirection(Current->XDir, Current->YDir);
+}
+
+// Called before the start of each movement.
+// Takes the next movement off the ring into m, and calculates anything we need
+// to calculate or set before beginning it. previous is the movement before it,
+// which it starts from the end of
+void PrecalculateMovement(movement *m, movement *previous, bool fromRest) {
+	uint32_t entrySpeedSqr = fromRest ? 0 : RingPlan[RingTail].EntrySpeedSqr;
+	uint16_t speed = RingSpeed[RingTail];
+	RingRemove(&m->TargetX, &m->TargetY, &m->TargetTheta, &m->TargetPhi);
+	// Finish at the speed the movement after this one starts at. That speed
+	// can't change any more, because it's now at RingTail
+	uint32_t exitSpeedSqr = BufferEmpty() ? 0 : RingPlan[RingTail].EntrySpeedSqr;
+
+	uint16_t distance[AXES];
+	PrepareLine(m, previous, distance);
+
+	// The velocity profile times ticks of the dominant axis, and every other
+	// axis moves proportionally slower, so scale each axis' limits up by how
+	// much slower it's moving. The tightest limit then wins
+	uint16_t maxVelocity = UINT16_MAX, acceleration = UINT16_MAX;
+	float length = 0;
+	for (byte axis = 0; axis < AXES; axis++) {
+		ApplyAxisLimit(&maxVelocity, Config.MaxVelocity[axis], distance[axis], m->Line.Steps);
+		ApplyAxisLimit(&acceleration, Config.Acceleration[axis], distance[axis], m->Line.Steps);
+		length += (float) distance[axis] * distance[axis];
+	}
+
+	// Entry and exit speeds (and timed movements' speeds) are planned along the
+	// path through all the axes, so convert them to speeds of the dominant axis
+	float scale = m->Line.Steps / sqrt(length);
+	if (speed && speed * scale < maxVelocity) { maxVelocity = (speed * scale > 1) ? speed * scale : 1; }
+	float entryVelocity = sqrt(entrySpeedSqr) * scale;
+	float exitVelocity = sqrt(exitSpeedSqr) * scale;
+	m->MaxVelocity = maxVelocity;
+	m->Acceleration = acceleration;
+	m->ExitVelocity = (exitVelocity < maxVelocity) ? exitVelocity : maxVelocity;
+	PlannerPrepare(&m->Profile, m->Line.Steps, (entryVelocity < maxVelocity) ? entryVelocity : maxVelocity,
+			maxVelocity, m->ExitVelocity, acceleration);
+}
+
+// Work out the direction and distance of each axis from previous's target to
+// m's, and interpolate a straight line so that every axis arrives at the same
+// time
+static void PrepareLine(movement *m, movement *previous, uint16_t distance[AXES]) {
+	m->XDir = (previous->TargetX < m->TargetX);
+	m->YDir = (previous->TargetY < m->TargetY);
+	m->ThetaDir = (previous->TargetTheta < m->TargetTheta);
+	m->PhiDir = (previous->TargetPhi < m->TargetPhi);
+
+	distance[AXIS_X] = m->XDir ? m->TargetX - previous->TargetX : previous->TargetX - m->TargetX;
+	distance[AXIS_Y] = m->YDir ? m->TargetY - previous->TargetY : previous->TargetY - m->TargetY;
+	distance[AXIS_THETA] = m->ThetaDir ? m->TargetTheta - previous->TargetTheta : previous->TargetTheta - m->TargetTheta;
+	distance[AXIS_PHI] = m->PhiDir ? m->TargetPhi - previous->TargetPhi : previous->TargetPhi - m->TargetPhi;
+	PlannerLinePrepare(&m->Line, distance);
+}
+
+// Axes that aren't moving don't limit the movement
+static void ApplyAxisLimit(uint16_t *limit, uint16_t axisLimit, uint16_t distance, uint16_t steps) {
+	if (distance == 0) { return; }
+	uint32_t scaled = ((uint32_t) axisLimit * steps) / distance;
+	if (scaled < *limit) { *limit = scaled; }
 }
 
 // Perform one step in the movement, and set MoveStep to be called again
-// via a timer
+// via a timer after the interval given by the velocity profile
 void MoveStep(void) {
-	// Increment each stepper in the direction required, if it needs to be moved
-	// Sets direction pin, pulls step pin low, waits 2us, then pulls step pin high
-	if (CurrentX != TargetX) {
-		MotorXSetDirection(XDir);
+	// Step each axis the line says should move on this tick
+	// Pulls the step pins low, and times when to pull them back high
+	movement *m = Current;
+	uint8_t axes = PlannerLineStep(&m->Line);
+	if (axes & _BV(AXIS_X)) {
 		MotorXSetStep();
-		if (XDir) { CurrentX++; } else { CurrentX--; }
+		if (m->XDir) { CurrentX++; } else { CurrentX--; }
 	}
-	if (CurrentY != TargetY) {
-		MotorYSetDirection(YDir);
+	if (axes & _BV(AXIS_Y)) {
 		MotorYSetStep();
-		if (YDir) { CurrentY++; } else { CurrentY--; }
+		if (m->YDir) { CurrentY++; } else { CurrentY--; }
 	}
 	MotorStep();
+	StepPulseStart();
 
-	// TODO: Make theta, phi motors move
-	if (CurrentTheta != TargetTheta) { CurrentTheta++; }
-	if (CurrentPhi != TargetPhi) { CurrentPhi++; }
+	// Theta and phi are servos, which Servo.c keeps up with
+	if (axes & _BV(AXIS_THETA)) {
+		if (m->ThetaDir) { CurrentTheta++; } else { CurrentTheta--; }
+	}
+	if (axes & _BV(AXIS_PHI)) {
+		if (m->PhiDir) { CurrentPhi++; } else { CurrentPhi--; }
+	}
 
-	if ((CurrentX != TargetX) || (CurrentY != TargetY) || (CurrentTheta != TargetTheta) || (CurrentPhi != TargetPhi)) {
-		// TODO: Change this based on a desired velocity based on Bresenham
-		// IMPORTANT: Things will get weird if this delay is less than the delay used in Motor.c of ~2us
-		TCNT2 = 0;
-		TIMSK2 |= _BV(TOIE2);
+	// The profile can end the movement early, if we're stopping (see MoveAbort)
+	if (m->Line.StepCount < m->Profile.Steps) {
+		StepTimerSchedule(PlannerNextInterval(&m->Profile));
+	} else if (NextReady) {
+		// Carry straight on into the next movement, taking its first step after
+		// the interval its profile starts at
+		NextReady = false;
+		SwapMovements();
+		StepTimerSchedule(PlannerEntryInterval(&Current->Profile));
 	} else {
+		// If we were planning on carrying on into another movement, it wasn't
+		// ready in time, so we have to stop here
 		FinishMovement();
 	}
 }
-// Called when our timer overflows
-ISR(TIMER2_OVF_vect) {
-	// Disable timer
-	TIMSK2 &= ~_BV(TOIE2);
 
-	// Move another step
-	MoveStep();
+// Set the step timer to call MoveStep after the passed number of ticks,
+// counted from the last compare match (or from when the timer was restarted
+// in MoveSpin)
+static void StepTimerSchedule(interval ticks) {
+	// Even if the profile's finished before we've got to the target, keep going
+	if (ticks == 0) { ticks = 1; }
+	TicksRemaining = ticks;
+	StepTimerReload();
+	TIMSK2 |= _BV(OCIE2A);
+}
+
+// Load OCR2A with the next part of the current interval. Never leaves a short
+// final part, so we can't miss the compare match while the ISR's running
+inline static void StepTimerReload(void) {
+	interval chunk = TicksRemaining;
+	if (chunk > 2*256) {
+		chunk = 256;
+	} else if (chunk > 256) {
+		chunk /= 2;
+	}
+	TicksRemaining -= chunk;
+	// Timer counts from 0 to OCR2A inclusive
+	OCR2A = (byte) (chunk - 1);
+}
+
+// Start timing the end of a step pulse from now
+inline static void StepPulseStart(void) {
+	OCR2B = TCNT2 + STEP_PULSE_TICKS;
+	TIFR2 = _BV(OCF2B);
+	TIMSK2 |= _BV(OCIE2B);
+}
+
+// Called on each compare match of our timer
+ISR(TIMER2_COMPA_vect) {
+	// The interval was shorter than a step pulse
+	MotorStepEnd();
+
+	if (TicksRemaining > 0) {
+		// Still part way through a long interval
+		StepTimerReload();
+	} else {
+		// Move another step
+		MoveStep();
+	}
+}
+
+// Called when a step pulse has lasted long enough
+ISR(TIMER2_COMPB_vect) {
+	MotorStepEnd();
+	TIMSK2 &= ~_BV(OCIE2B);
 }
 
 // Called after a movement happens
 void FinishMovement(void) {
+	// Stop the step timer
+	TIMSK2 &= ~_BV(OCIE2A);
+
 	// We're not moving anymore
 	CurrentMovement = false;
 }
 
 // Move to a new absolutely specified position
-inline int MoveAddAbsolute(position x, position y, position theta, position phi) { return RingAdd(x, y, theta, phi); }
+inline int MoveAddAbsolute(position x, position y, position theta, position phi) { return RingAdd(x, y, theta, phi, 0); }
+
+// Move to a new absolutely specified position, taking duration ms to get there
+// from the end of the last movement (or longer, if the axes can't go that fast)
+inline int MoveAddTimed(position x, position y, position theta, position phi, uint16_t duration) {
+	return RingAdd(x, y, theta, phi, duration);
+}
+
+// Work out the look-ahead plan for a movement of delta steps on each axis,
+// following on from the last movement added (unless it's the first in the
+// ring, in which case it has to start from rest). Returns the speed along its
+// path it has to keep to so it takes duration ms (0 if it's not timed)
+static uint16_t PlanMovement(plan_block *block, bool first, int32_t delta[AXES], uint16_t duration) {
+	float length = 0;
+	for (byte axis = 0; axis < AXES; axis++) {
+		length += (float) delta[axis] * delta[axis];
+	}
+	length = sqrt(length);
+
+	// Fastest we can go along the movement, and how quickly we can get there,
+	// without any axis going over its own limits
+	float unit[AXES];
+	float nominalSpeed = UINT16_MAX, acceleration = UINT16_MAX;
+	for (byte axis = 0; axis < AXES; axis++) {
+		unit[axis] = delta[axis] / length;
+		if (delta[axis] != 0) {
+			float scale = length / fabs(delta[axis]);
+			if (Config.MaxVelocity[axis] * scale < nominalSpeed) { nominalSpeed = Config.MaxVelocity[axis] * scale; }
+			if (Config.Acceleration[axis] * scale < acceleration) { acceleration = Config.Acceleration[axis] * scale; }
+		}
+	}
+	uint16_t speed = 0;
+	if (duration) {
+		float timed = length * 1000 / duration;
+		speed = (timed >= UINT16_MAX) ? UINT16_MAX : (timed < 1) ? 1 : (uint16_t) timed;
+		if (speed < nominalSpeed) { nominalSpeed = speed; }
+	}
+	uint32_t nominalSpeedSqr = FloatToSqr(nominalSpeed * nominalSpeed);
+	block->AccelDistance = FloatToSqr(2 * acceleration * length);
+
+	// Go round the corner from the last movement as fast as the angle and both
+	// movements allow
+	block->EntrySpeedSqr = 0;
+	if (first) {
+		block->MaxEntrySpeedSqr = 0;
+	} else {
+		block->MaxEntrySpeedSqr = PlannerJunctionSpeedSqr(LastUnit, unit, acceleration);
+		if (nominalSpeedSqr < block->MaxEntrySpeedSqr) { block->MaxEntrySpeedSqr = nominalSpeedSqr; }
+		if (LastNominalSpeedSqr < block->MaxEntrySpeedSqr) { block->MaxEntrySpeedSqr = LastNominalSpeedSqr; }
+	}
+
+	for (byte axis = 0; axis < AXES; axis++) {
+		LastUnit[axis] = unit[axis];
+	}
+	LastNominalSpeedSqr = nominalSpeedSqr;
+	return speed;
+}
+
+// Convert a (non-negative) float to a uint32_t, saturating rather than overflowing
+static uint32_t FloatToSqr(float value) {
+	return (value >= (float) UINT32_MAX) ? UINT32_MAX : (uint32_t) value;
+}
 
 // Move relative to the current endgoal position (the last element in the ring buffer, or the target of
 // the current move if the buffer is empty)
@@ -183,23 +514,179 @@ static position SafeAdd(position a, position b) {
 	}
 }
 
-// Cancel any buffered moves
-// TODO: Cancel the current move (interrupt-safely)
+// Cancel any buffered moves and homing, and bring the current move to a stop
+// as quickly as its acceleration allows
 void MoveAbort(void) {
+	movement *stopping = NULL;
+	cli();
 	RingHead = RingTail;
+	RingPlanned = RingTail;
+	HomeAxes = 0;
+	HomePhase = HOME_START;
+	HomeAt = RingTail;
+	StartPending = false;
+	if (CurrentMovement) {
+		// Stop in the current movement if we can. If we're going too fast to
+		// stop before the corner into the next one, stop in that instead (it
+		// was planned to leave us slow enough to take the corner)
+		if (!NextReady || PlannerStopSteps(&Current->Profile) <= Current->Profile.Steps) {
+			NextReady = false;
+			stopping = Current;
+		} else {
+			stopping = Next;
+		}
+		PlannerStop(&stopping->Profile);
+	}
+	sei();
+
+	// Only we look at targets, so they can wait until interrupts are back on
+	if (stopping) { StopTarget(stopping); }
 }
 
-// Home x and y axes with endstops
-void MoveHomeX(void) {
-	// TODO
+// Move a movement's target back to wherever its profile now finishes: each
+// axis is short by however many steps the rest of its line would have taken
+static void StopTarget(movement *m) {
+	uint16_t ticks = m->Profile.Steps;
+	m->TargetX += (m->XDir ? -1 : 1) * (m->Line.Distance[AXIS_X] - PlannerLineAxisSteps(&m->Line, AXIS_X, ticks));
+	m->TargetY += (m->YDir ? -1 : 1) * (m->Line.Distance[AXIS_Y] - PlannerLineAxisSteps(&m->Line, AXIS_Y, ticks));
+	m->TargetTheta += (m->ThetaDir ? -1 : 1) * (m->Line.Distance[AXIS_THETA] - PlannerLineAxisSteps(&m->Line, AXIS_THETA, ticks));
+	m->TargetPhi += (m->PhiDir ? -1 : 1) * (m->Line.Distance[AXIS_PHI] - PlannerLineAxisSteps(&m->Line, AXIS_PHI, ticks));
 }
 
-void MoveHomeY(void) {
-	// TODO
+// Home the passed axes (a bitmask, see Planner.h) once the movements already
+// in the ring are done. Returns -1 if other axes are already waiting to home
+// after different movements
+int MoveHome(byte axes) {
+	if (HomeAxes && RingHead != HomeAt) { return -1; }
+	HomeAt = RingHead;
+	HomeAxes |= axes;
+	return 0;
+}
+inline int MoveHomeX(void) { return MoveHome(_BV(AXIS_X)); }
+inline int MoveHomeY(void) { return MoveHome(_BV(AXIS_Y)); }
+
+// Whether the ring's got to where we have to home
+bool Homing(void) { return HomeAxes && RingTail == HomeAt; }
+
+// Move to a new absolutely specified position, starting from rest at time (ms,
+// see ClockMillis), or straight away if that's passed. If we're already going
+// to be there, the movement after it waits instead. Returns -1 if the ring's
+// full, or another movement's already waiting for its time
+int MoveAddAt(position x, position y, position theta, position phi, uint32_t time) {
+	if (StartPending || BufferFull()) { return -1; }
+	StartPending = true;
+	StartAt = RingHead;
+	StartTime = time;
+	return RingAdd(x, y, theta, phi, 0);
+}
+
+// Whether the ring's got to a movement that has to wait for its time
+static bool WaitingToStart(void) {
+	if (!StartPending || RingTail != StartAt) { return false; }
+	if ((int32_t) (ClockMillis() - StartTime) < 0) { return true; }
+	StartPending = false;
+	return false;
+}
+
+// Whether there's a movement in the ring we can start on
+bool RingReady(void) { return !BufferEmpty() && !Homing() && !WaitingToStart(); }
+
+// Start the next part of homing, once the last one's stopped
+static void HomeSpin(void) {
+	// Seeks stop wherever they hit the endstop, so that's where we are
+	cli();
+	Current->TargetX = CurrentX;
+	Current->TargetY = CurrentY;
+	sei();
+	bool hit = HomeHit;
+	HomeHit = false;
+
+	bool moving = false;
+	switch (HomePhase) {
+		case HOME_START:
+			// Already on the endstop: just back off it
+			HomeAxis = (HomeAxes & _BV(AXIS_X)) ? AXIS_X : AXIS_Y;
+			if (MotorEndstops() & _BV(HomeAxis)) {
+				HomePhase = HOME_BACKING_OFF;
+				moving = HomeMove(Config.HomeBackOff, Config.HomeFastVelocity);
+			} else {
+				HomePhase = HOME_SEEK_FAST;
+				moving = HomeMove(-HOME_MAX_TRAVEL, Config.HomeFastVelocity);
+			}
+			break;
+
+		case HOME_SEEK_FAST:
+			if (hit) {
+				HomePhase = HOME_BACKING_OFF;
+				moving = HomeMove(Config.HomeBackOff, Config.HomeFastVelocity);
+			}
+			break;
+
+		case HOME_BACKING_OFF:
+			if (!(MotorEndstops() & _BV(HomeAxis))) {
+				HomePhase = HOME_SEEK_SLOW;
+				moving = HomeMove(-2 * (int32_t) Config.HomeBackOff, Config.HomeSlowVelocity);
+			}
+			break;
+
+		case HOME_SEEK_SLOW:
+			if (hit) {
+				cli();
+				if (HomeAxis == AXIS_X) {
+					CurrentX = Current->TargetX = Config.HomeLatch[AXIS_X];
+				} else {
+					CurrentY = Current->TargetY = Config.HomeLatch[AXIS_Y];
+				}
+				sei();
+				HomeAxes &= ~_BV(HomeAxis);
+				HomePhase = HOME_START;
+				return;
+			}
+			break;
+	}
+
+	// Never found the endstop (or never got off it): give up on homing,
+	// leaving the positions as they were
+	if (!moving) {
+		HomeAxes = 0;
+		HomePhase = HOME_START;
+	}
+}
+
+// Move HomeAxis distance steps from where it is (clamped to the positions we
+// can hold) from rest. Returns false if it can't go any further that way
+static bool HomeMove(int32_t distance, uint16_t velocity) {
+	movement *m = Next;
+	m->TargetX = Current->TargetX;
+	m->TargetY = Current->TargetY;
+	m->TargetTheta = Current->TargetTheta;
+	m->TargetPhi = Current->TargetPhi;
+	position *target = (HomeAxis == AXIS_X) ? &m->TargetX : &m->TargetY;
+	int32_t to = *target + distance;
+	*target = (to < POSITION_MIN) ? POSITION_MIN : (to > POSITION_MAX) ? POSITION_MAX : to;
+
+	uint16_t steps[AXES];
+	PrepareLine(m, Current, steps);
+	if (m->Line.Steps == 0) { return false; }
+	m->MaxVelocity = velocity;
+	m->ExitVelocity = 0;
+	m->Acceleration = Config.Acceleration[HomeAxis];
+	PlannerPrepare(&m->Profile, m->Line.Steps, 0, velocity, 0, m->Acceleration);
+	StartMovement();
+	return true;
+}
+
+// Stop a seek as soon as it hits the endstop. Homing speeds are slow enough
+// to stop dead
+ISR(ENDSTOP_vect) {
+	if (HomePhase != HOME_SEEK_FAST && HomePhase != HOME_SEEK_SLOW) { return; }
+	if (!CurrentMovement || !(MotorEndstops() & _BV(HomeAxis))) { return; }
+	FinishMovement();
+	HomeHit = true;
 }
 
 // Read the last position tuple in the ring and store it in the passed variables
-// If the ring is empty, use Target position variables instead
+// If the ring is empty, use the target of the last movement taken off it instead
 void ReadEndgoalPosition(position *x, position *y, position *theta, position *phi) {
 	if (RingHead != RingTail) {
 		// Buffer not empty
@@ -211,22 +698,38 @@ void ReadEndgoalPosition(position *x, position *y, position *theta, position *ph
 		*theta = RingDataTheta[prev_head];
 		*phi = RingDataPhi[prev_head];
 	} else {
-		// Nothing in buffer
-		*x = TargetX;
-		*y = TargetY;
-		*theta = TargetTheta;
-		*phi = TargetPhi;
+		// Nothing in buffer. The last movement is either waiting to go next, or
+		// the current one (and the step interrupt can swap them at any time)
+		cli();
+		movement *last = NextReady ? Next : Current;
+		*x = last->TargetX;
+		*y = last->TargetY;
+		*theta = last->TargetTheta;
+		*phi = last->TargetPhi;
+		sei();
+	}
+
+	// Movements after homing start from where it leaves us
+	if (HomeAxes && RingHead == HomeAt) {
+		if (HomeAxes & _BV(AXIS_X)) { *x = Config.HomeLatch[AXIS_X]; }
+		if (HomeAxes & _BV(AXIS_Y)) { *y = Config.HomeLatch[AXIS_Y]; }
 	}
 }
 inline void MoveGetTargetPosition(position *x, position *y, position *theta, position *phi) { ReadEndgoalPosition(x, y, theta, phi); }
-// Get the current position
+// Get the current position. The step interrupt can change it between any two
+// bytes, so it's read all at once
 void MoveGetCurrentPosition(position *x, position *y, position *theta, position *phi) {
+	cli();
 	*x = CurrentX;
 	*y = CurrentY;
 	*theta = CurrentTheta;
 	*phi = CurrentPhi;
+	sei();
 }
 
+// Number of movements that can still be added to the ring
+byte MoveQueueSpace(void) { return RING_SIZE - 1 - BufferCount(); }
+
 // Raw ring buffer access functions
 // If the head and tail are equal, the buffer is empty
 bool BufferEmpty(void) { return (RingHead == RingTail); }
@@ -234,16 +737,33 @@ bool BufferEmpty(void) { return (RingHead == RingTail); }
 // If the head is one slot behind the tail, the buffer is full
 bool BufferFull(void) { return ((RingHead + 1) % RING_SIZE) == RingTail; }
 
-// Add a position tuple to the ring
-static int RingAdd(position x, position y, position theta, position phi) {
+byte BufferCount(void) { return (byte) (RingHead - RingTail) % RING_SIZE; }
+
+// Add a position tuple to the ring, and plan it in after the movements
+// already there
+static int RingAdd(position x, position y, position theta, position phi, uint16_t duration) {
 	byte next_head = (RingHead + 1) % RING_SIZE;
 	if (next_head != RingTail) {
 		// There is room
+		position fromX, fromY, fromTheta, fromPhi;
+		ReadEndgoalPosition(&fromX, &fromY, &fromTheta, &fromPhi);
+		int32_t delta[AXES];
+		delta[AXIS_X] = (int32_t) x - fromX;
+		delta[AXIS_Y] = (int32_t) y - fromY;
+		delta[AXIS_THETA] = (int32_t) theta - fromTheta;
+		delta[AXIS_PHI] = (int32_t) phi - fromPhi;
+		// Already going to be there
+		if (!delta[AXIS_X] && !delta[AXIS_Y] && !delta[AXIS_THETA] && !delta[AXIS_PHI]) { return 0; }
+
 		RingDataX[RingHead] = x;
 		RingDataY[RingHead] = y;
 		RingDataTheta[RingHead] = theta;
 		RingDataPhi[RingHead] = phi;
+		// Movements start from rest after homing, and at their time
+		bool first = BufferEmpty() || (HomeAxes && RingHead == HomeAt) || (StartPending && RingHead == StartAt);
+		RingSpeed[RingHead] = PlanMovement(&RingPlan[RingHead], first, delta, duration);
 		RingHead = next_head;
+		RingPlanned = PlannerRecalculate(RingPlan, RING_SIZE - 1, RingPlanned, RingHead);
 		return 0;
 	} else {
 		// No more room
@@ -259,6 +779,7 @@ static int RingRemove(position *x, position *y, position *theta, position *phi)
 		*y = RingDataY[RingTail];
 		*theta = RingDataTheta[RingTail];
 		*phi = RingDataPhi[RingTail];
+		if (RingPlanned == RingTail) { RingPlanned = (RingTail + 1) % RING_SIZE; }
 		RingTail = (RingTail + 1) % RING_SIZE;
 		return 0;
 	} else {
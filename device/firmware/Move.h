@@ -1,16 +1,20 @@
 #include "Global.h"
 
 typedef int16_t position; // Signed for relative movements
-#define POSITION_MAX INT8_MAX
-#define POSITION_MIN INT8_MIN
+#define POSITION_MAX INT16_MAX
+#define POSITION_MIN INT16_MIN
 
 void MoveInit(void);
 void MoveSpin(void);
 int MoveAddRelative(position x, position y, position theta, position phi);
 int MoveAddAbsolute(position x, position y, position theta, position phi);
+int MoveAddTimed(position x, position y, position theta, position phi, uint16_t duration);
+int MoveAddAt(position x, position y, position theta, position phi, uint32_t time);
 // Writes current position into passed variables
 void MoveGetCurrentPosition(position *x, position *y, position *theta, position *phi);
 void MoveGetTargetPosition(position *x, position *y, position *theta, position *phi);
 void MoveAbort(void);
-void MoveHomeX(void);
-void MoveHomeY(void);
+byte MoveQueueSpace(void);
+int MoveHome(byte axes);
+int MoveHomeX(void);
+int MoveHomeY(void);
@@ -0,0 +1,136 @@
+/* ****************************************************************************
+   Path.c
+
+	 Paths: smooth camera moves through a few keyframes, each a position and
+	 how long after the keyframe before it to get there. Once a path's run, the
+	 first keyframe is moved to like any other position, then a Catmull-Rom
+	 spline is followed through the rest (see Planner.c), so the host only
+	 sends the keyframes and never the hundreds of movements along the curve.
+
+	 The spline is sampled every PATH_SAMPLE ms, and each sample is queued as
+	 a movement timed to last as long as the sample (see MoveAddTimed). Samples
+	 are only worked out when the ring has room for them, one per PathSpin, so
+	 the ring stays full without the path ever needing more RAM than its
+	 keyframes. The spline's still at the first and last keyframes, so paths
+	 ease in and out.
+
+	 Movements take as long as they're timed for unless the axes can't go that
+	 fast, in which case the path runs late rather than leaving the curve.
+***************************************************************************** */
+
+#include "stdbool.h"
+#include "Move.h"
+#include "Path.h"
+#include "Planner.h"
+
+// Milliseconds between samples along the spline: fine enough that the
+// movements between them look curved, but long enough for the look-ahead in
+// the ring to cover about a second of the path
+#define PATH_SAMPLE 40
+
+// Keyframes, and how long (ms) after the keyframe before each one is (the
+// first's isn't used)
+static position Keyframes[PATH_KEYFRAMES][AXES];
+static uint16_t Durations[PATH_KEYFRAMES];
+static byte KeyframeCount;
+
+// Whether we're sampling the spline, which keyframe the segment being sampled
+// starts at, and how far into it (ms) we've got
+static bool Running;
+static byte Segment;
+static uint16_t Elapsed;
+// Last sample queued, and how long (ms) since it: samples that didn't move
+// a whole step add their time onto the next one that does
+static position Last[AXES];
+static uint16_t Carried;
+
+static position Sample(byte axis, uint32_t s);
+
+// Queue the next sample along the path, if there's room for it
+void PathSpin(void) {
+	if (!Running || MoveQueueSpace() == 0) { return; }
+
+	uint16_t duration = Durations[Segment + 1];
+	uint16_t step = duration - Elapsed;
+	if (step > PATH_SAMPLE) { step = PATH_SAMPLE; }
+	Elapsed += step;
+	Carried = (Carried > UINT16_MAX - step) ? UINT16_MAX : Carried + step;
+
+	position target[AXES];
+	bool moved = false;
+	uint32_t s = ((uint32_t) Elapsed << SPLINE_SHIFT) / duration;
+	for (byte axis = 0; axis < AXES; axis++) {
+		target[axis] = Sample(axis, s);
+		if (target[axis] != Last[axis]) { moved = true; }
+	}
+	if (moved) {
+		MoveAddTimed(target[AXIS_X], target[AXIS_Y], target[AXIS_THETA], target[AXIS_PHI], Carried);
+		for (byte axis = 0; axis < AXES; axis++) { Last[axis] = target[axis]; }
+		Carried = 0;
+	}
+
+	if (Elapsed == duration) {
+		Elapsed = 0;
+		if (++Segment == KeyframeCount - 1) { Running = false; }
+	}
+}
+
+// Where an axis is s (Q16.16) of the way through the current segment. The
+// tangents at each end are taken from the keyframes either side, except at
+// the ends of the path, where we're still
+static position Sample(byte axis, uint32_t s) {
+	byte i = Segment;
+	uint16_t duration = Durations[i + 1];
+	int32_t p0 = Keyframes[i][axis], p1 = Keyframes[i + 1][axis];
+	int32_t t0 = 0, t1 = 0;
+	if (i > 0) {
+		t0 = PlannerCatmullRomTangent(Keyframes[i - 1][axis], p1, (uint32_t) Durations[i] + duration, duration);
+	}
+	if (i + 2 < KeyframeCount) {
+		t1 = PlannerCatmullRomTangent(p0, Keyframes[i + 2][axis], (uint32_t) duration + Durations[i + 2], duration);
+	}
+	int32_t p = PlannerHermite(p0, p1, t0, t1, s);
+	// The curve can overshoot the keyframes a little
+	return (p > POSITION_MAX) ? POSITION_MAX : (p < POSITION_MIN) ? POSITION_MIN : p;
+}
+
+// Forget the keyframes. A path that's running stops being sampled, but the
+// part already queued still gets moved
+void PathClear(void) {
+	Running = false;
+	KeyframeCount = 0;
+}
+
+// Add a keyframe, duration ms after the one before (ignored for the first).
+// Returns false if there's no room, or it's not after the one before, or the
+// path's running
+bool PathAdd(int16_t positions[4], uint16_t duration) {
+	if (Running || KeyframeCount == PATH_KEYFRAMES) { return false; }
+	if (KeyframeCount > 0 && duration == 0) { return false; }
+	for (byte axis = 0; axis < AXES; axis++) { Keyframes[KeyframeCount][axis] = positions[axis]; }
+	Durations[KeyframeCount] = duration;
+	KeyframeCount++;
+	return true;
+}
+
+// Start the path, after the movements already queued. Returns false if it
+// hasn't got at least two keyframes, is already running, or there's no room
+// in the ring to move to the first keyframe
+bool PathRun(void) {
+	if (Running || KeyframeCount < 2) { return false; }
+	position *first = Keyframes[0];
+	if (MoveAddAbsolute(first[AXIS_X], first[AXIS_Y], first[AXIS_THETA], first[AXIS_PHI])) { return false; }
+	for (byte axis = 0; axis < AXES; axis++) { Last[axis] = first[axis]; }
+	Segment = 0;
+	Elapsed = 0;
+	Carried = 0;
+	Running = true;
+	return true;
+}
+
+// Stop sampling the path (when aborting), keeping the keyframes
+void PathStop(void) { Running = false; }
+
+bool PathRunning(void) { return Running; }
+
+uint8_t PathKeyframes(void) { return KeyframeCount; }
@@ -0,0 +1,13 @@
+#include "stdbool.h"
+#include <stdint.h>
+
+// Most keyframes a path can have
+#define PATH_KEYFRAMES 8
+
+void PathSpin(void);
+void PathClear(void);
+bool PathAdd(int16_t positions[4], uint16_t duration);
+bool PathRun(void);
+void PathStop(void);
+bool PathRunning(void);
+uint8_t PathKeyframes(void);
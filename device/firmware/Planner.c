@@ -0,0 +1,344 @@
+/* ****************************************************************************
+   Planner.c
+
+	 Generates trapezoidal velocity profiles for movements: accelerate at a
+	 constant rate from an entry velocity up to a maximum velocity, cruise, then
+	 decelerate at the same rate to an exit velocity. If the movement is too
+	 short to reach maximum velocity, the profile is triangular instead.
+
+	 Based on the algorithm in Atmel application note AVR446 ("Linear speed
+	 control of stepper motor"): the interval between steps is updated with one
+	 integer division per step using a Taylor series approximation, so there's no
+	 floating point maths (and no square roots) in the step interrupt. Floating
+	 point is only used once per movement, in PlannerPrepare.
+
+	 Also interpolates straight lines across all the axes, so that they all
+	 arrive at the same time (see PlannerLinePrepare). The velocity profile then
+	 times the ticks of the axis with furthest to go.
+
+	 Entry and exit velocities come from look-ahead over the queue of movements
+	 (see PlannerRecalculate), in the same way as grbl: each corner between two
+	 movements gets a maximum speed from its angle, and then passes backwards and
+	 forwards over the queue to find the fastest speeds we can still accelerate to
+	 and stop from.
+
+	 Paths through keyframes (see Path.c) follow Catmull-Rom splines: cubic
+	 Hermite segments between each pair of keyframes, leaving each keyframe in
+	 the direction from the one before to the one after. Evaluated in fixed
+	 point, a sample at a time (see PlannerHermite).
+
+	 Doesn't touch any hardware, so can be compiled and tested on the host (see
+	 test/).
+***************************************************************************** */
+
+#include <math.h>
+#include "Planner.h"
+
+// AVR446 correction factor applied to the first interval, compensating for
+// the inaccuracy of the Taylor series approximation at low step counts
+#define FIRST_INTERVAL_CORRECTION 0.676
+
+// How far junctions are allowed to deviate from the corner between two
+// movements (in steps). Larger values take corners faster
+#define JUNCTION_DEVIATION 1.0
+
+static uint32_t RampIndex(uint16_t velocity, uint16_t acceleration);
+static interval RampInterval(uint32_t n, uint16_t acceleration);
+static uint32_t SaturatingAdd(uint32_t a, uint32_t b);
+
+// Setup a profile for a movement of the passed number of steps, starting at
+// entryVelocity and ending at exitVelocity (0 to start or end stationary)
+// Velocities in steps/s, acceleration in steps/s^2
+void PlannerPrepare(profile *p, uint32_t steps, uint16_t entryVelocity, uint16_t maxVelocity, uint16_t exitVelocity, uint16_t acceleration) {
+	p->Steps = steps;
+	p->StepCount = 0;
+	p->Rest = 0;
+	p->Fraction = 0;
+
+	if (steps == 0) {
+		p->Phase = PROFILE_DONE;
+		p->Delay = 0;
+		return;
+	}
+
+	// Cruising interval, and where on the ramp up from standstill we start and
+	// finish
+	p->MinDelay = ((interval) STEP_TIMER_FREQ << INTERVAL_SHIFT) / maxVelocity;
+	p->ExitRamp = RampIndex(exitVelocity, acceleration);
+	p->RampCount = RampIndex(entryVelocity, acceleration);
+	p->Delay = RampInterval(p->RampCount, acceleration);
+
+	if (p->Delay <= p->MinDelay) {
+		// We can go straight to cruising
+		p->RampCount = RampIndex(maxVelocity, acceleration);
+		p->LastAccelDelay = (p->RampCount > 0) ? RampInterval(p->RampCount - 1, acceleration) : p->MinDelay;
+		p->Delay = p->MinDelay;
+		p->Phase = PROFILE_CRUISE;
+	} else {
+		p->Phase = PROFILE_ACCEL;
+	}
+}
+
+// Number of steps it takes to accelerate to velocity from standstill (v^2 = 2as)
+static uint32_t RampIndex(uint16_t velocity, uint16_t acceleration) {
+	return ((uint32_t) velocity * velocity) / (2 * (uint32_t) acceleration);
+}
+
+// Interval (fixed point) between steps n and n+1 when accelerating from
+// standstill. Only used to find where to start: after that the profile uses
+// the cheaper approximation in PlannerNextInterval
+static interval RampInterval(uint32_t n, uint16_t acceleration) {
+	double first = STEP_TIMER_FREQ * sqrt(2.0 / acceleration) * (1 << INTERVAL_SHIFT);
+	if (n == 0) { return (interval) (FIRST_INTERVAL_CORRECTION * first); }
+	return (interval) (first * (sqrt(n + 1) - sqrt(n)));
+}
+
+// Called each time a step is taken. Returns the interval until the next step
+// should be taken (in step timer ticks), or 0 if the movement is finished.
+// Fast enough to be called from an interrupt
+//
+// The deceleration ramp is the acceleration ramp mirrored, so we start
+// decelerating as soon as the number of intervals left equals the number of
+// intervals it takes to get from where we are on the ramp (RampCount) back down
+// to the exit velocity (ExitRamp)
+interval PlannerNextInterval(profile *p) {
+	if (p->Phase == PROFILE_DONE) { return 0; }
+
+	p->StepCount++;
+	if (p->StepCount >= p->Steps) {
+		p->Phase = PROFILE_DONE;
+		return 0;
+	}
+
+	// Return the interval we calculated last time, and calculate the one after
+	// that ready for next time
+	interval current = p->Delay;
+	interval next = current;
+	// Number of intervals left after the current one
+	int32_t remaining = p->Steps - 1 - p->StepCount;
+
+	switch (p->Phase) {
+		case PROFILE_ACCEL:
+			if (remaining > p->RampCount + 1 - p->ExitRamp) {
+				// Room to accelerate for another step and still stop in time
+				p->RampCount++;
+				uint32_t numerator = 2 * current + p->Rest;
+				uint32_t denominator = 4 * p->RampCount + 1;
+				next = current - numerator / denominator;
+				p->Rest = numerator % denominator;
+
+				if (next <= p->MinDelay) {
+					// Reached maximum velocity
+					p->LastAccelDelay = current;
+					next = p->MinDelay;
+					p->Phase = PROFILE_CRUISE;
+				}
+				break;
+			}
+
+			// Triangular profile: start decelerating, either holding the peak
+			// velocity for one more interval or going straight back down the ramp
+			p->Phase = PROFILE_DECEL;
+			p->Rest = 0;
+			if (remaining == p->RampCount + 1 - p->ExitRamp) {
+				p->RampCount = -(p->RampCount + 1);
+				break;
+			}
+			p->RampCount = -(p->RampCount + 1);
+			// Fall through - take the first step down the ramp straight away
+		case PROFILE_DECEL:
+			if (p->RampCount < -(p->ExitRamp + 1)) {
+				p->RampCount++;
+				// Inverse of the acceleration step
+				uint32_t numerator = 2 * current + p->Rest;
+				uint32_t denominator = 4 * (-p->RampCount) - 1;
+				next = current + numerator / denominator;
+				p->Rest = numerator % denominator;
+			}
+			break;
+
+		case PROFILE_CRUISE:
+			if (remaining <= p->RampCount - p->ExitRamp) {
+				next = p->LastAccelDelay;
+				p->RampCount = -p->RampCount;
+				p->Rest = 0;
+				p->Phase = PROFILE_DECEL;
+			}
+			break;
+
+		case PROFILE_DONE:
+			break;
+	}
+	p->Delay = next;
+
+	// Round to whole ticks, carrying what we lost over to the next interval
+	p->Fraction += current;
+	current = p->Fraction >> INTERVAL_SHIFT;
+	p->Fraction &= (1 << INTERVAL_SHIFT) - 1;
+	return current;
+}
+
+// Number of steps into the movement we'd be stopped by if we started slowing
+// down to a standstill now, rather than to the exit velocity at the end. Can
+// be past the end of the movement, if it's going too fast to stop in time.
+// The ramp down is as long as the ramp up to the speed we're at, plus a step
+// or two while we get onto it
+uint32_t PlannerStopSteps(profile *p) {
+	if (p->Phase == PROFILE_DONE) { return p->StepCount; }
+	uint32_t ramp = (p->RampCount < 0) ? -p->RampCount : p->RampCount;
+	return p->StepCount + ramp + 3;
+}
+
+// Slow down to a standstill as soon as we can (or by the end of the
+// movement), cutting the movement short. Safe to call from an interrupt
+void PlannerStop(profile *p) {
+	uint32_t steps = PlannerStopSteps(p);
+	if (steps < p->Steps) { p->Steps = steps; }
+	p->ExitRamp = 0;
+}
+
+// Setup a straight line movement where each axis moves the passed number of
+// steps (ignoring direction: the caller handles that)
+void PlannerLinePrepare(line *l, uint16_t distance[AXES]) {
+	l->Steps = 0;
+	l->StepCount = 0;
+	for (uint8_t axis = 0; axis < AXES; axis++) {
+		l->Distance[axis] = distance[axis];
+		if (distance[axis] > l->Steps) { l->Steps = distance[axis]; }
+	}
+	// Start half a step in, so that each axis' steps are centred on the ideal line
+	for (uint8_t axis = 0; axis < AXES; axis++) {
+		l->Error[axis] = l->Steps / 2;
+	}
+}
+
+// Advance the line by one tick. Returns a bitmask (bits numbered by AXIS_*)
+// of the axes that should step on this tick, or 0 once the line is finished
+uint8_t PlannerLineStep(line *l) {
+	if (l->StepCount >= l->Steps) { return 0; }
+	l->StepCount++;
+
+	uint8_t mask = 0;
+	for (uint8_t axis = 0; axis < AXES; axis++) {
+		l->Error[axis] -= l->Distance[axis];
+		if (l->Error[axis] < 0) {
+			l->Error[axis] += l->Steps;
+			mask |= (1 << axis);
+		}
+	}
+	return mask;
+}
+
+// Number of steps axis has taken after the first ticks ticks of the line,
+// without having to step through it
+uint16_t PlannerLineAxisSteps(line *l, uint8_t axis, uint16_t ticks) {
+	// Each step puts the error term back up by Steps (see PlannerLineStep)
+	int32_t behind = (int32_t) ticks * l->Distance[axis] - l->Steps / 2;
+	if (behind <= 0) { return 0; }
+	return (behind + l->Steps - 1) / l->Steps;
+}
+
+// Interval (in whole ticks) the profile starts at. Used as the gap between the
+// last step of one movement and the first step of the next
+interval PlannerEntryInterval(profile *p) {
+	return p->Delay >> INTERVAL_SHIFT;
+}
+
+// Maximum speed^2 we can go round the corner between two movements, given the
+// unit vectors along each of them. Uses the junction deviation approximation
+// from grbl: fit a circle tangent to both movements that passes
+// JUNCTION_DEVIATION from the corner, and go as fast as we can round it with
+// the acceleration we have
+uint32_t PlannerJunctionSpeedSqr(float previousUnit[AXES], float unit[AXES], uint16_t acceleration) {
+	// Cosine of the angle between the movements (-1 going straight on, 1
+	// reversing)
+	float cosTheta = 0;
+	for (uint8_t axis = 0; axis < AXES; axis++) {
+		cosTheta -= previousUnit[axis] * unit[axis];
+	}
+
+	if (cosTheta > 0.999) {
+		// Reversing: we have to stop
+		return 0;
+	} else if (cosTheta < -0.999) {
+		// Straight on: no limit from the corner
+		return UINT32_MAX;
+	}
+	float sinHalfTheta = sqrt(0.5 * (1.0 - cosTheta));
+	return (uint32_t) ((acceleration * JUNCTION_DEVIATION * sinHalfTheta) / (1.0 - sinHalfTheta));
+}
+
+// Called after a movement is added to the end of a queue of plan blocks (a
+// ring buffer, with the passed index mask). Updates the planned entry speeds of
+// the blocks from planned up to head (exclusive).
+//
+// The block at planned never changes: everything before it is already as fast
+// as it can be, however many more blocks are added, so we only have to look at
+// the blocks added since. Returns the new planned index.
+uint8_t PlannerRecalculate(plan_block *blocks, uint8_t mask, uint8_t planned, uint8_t head) {
+	uint8_t index = (head - 1) & mask;
+	if (index == planned) { return planned; }
+
+	// Backward pass: the newest block has to be able to stop, and every other
+	// block has to be able to slow down to the speed the block after it starts
+	plan_block *current = &blocks[index];
+	plan_block *next;
+	current->EntrySpeedSqr = current->MaxEntrySpeedSqr < current->AccelDistance ? current->MaxEntrySpeedSqr : current->AccelDistance;
+	index = (index - 1) & mask;
+	while (index != planned) {
+		next = current;
+		current = &blocks[index];
+		if (current->EntrySpeedSqr != current->MaxEntrySpeedSqr) {
+			uint32_t entrySpeedSqr = SaturatingAdd(next->EntrySpeedSqr, current->AccelDistance);
+			current->EntrySpeedSqr = entrySpeedSqr < current->MaxEntrySpeedSqr ? entrySpeedSqr : current->MaxEntrySpeedSqr;
+		}
+		index = (index - 1) & mask;
+	}
+
+	// Forward pass: every block has to be able to accelerate up to the speed
+	// the block after it starts at. Blocks held back here, or already going
+	// round their corner as fast as they can, are as fast as they'll ever be
+	next = &blocks[planned];
+	index = (planned + 1) & mask;
+	while (index != head) {
+		current = next;
+		next = &blocks[index];
+		if (current->EntrySpeedSqr < next->EntrySpeedSqr) {
+			uint32_t entrySpeedSqr = SaturatingAdd(current->EntrySpeedSqr, current->AccelDistance);
+			if (entrySpeedSqr < next->EntrySpeedSqr) {
+				next->EntrySpeedSqr = entrySpeedSqr;
+				planned = index;
+			}
+		}
+		if (next->EntrySpeedSqr == next->MaxEntrySpeedSqr) { planned = index; }
+		index = (index + 1) & mask;
+	}
+
+	return planned;
+}
+
+// Catmull-Rom tangent at a keyframe: the slope from the keyframe before it to
+// the one after (span ms apart), scaled up to steps over a segment lasting
+// duration ms. Scaling the same slope to the segments either side keeps the
+// velocity smooth through the keyframe even when they last different times
+int32_t PlannerCatmullRomTangent(int32_t before, int32_t after, uint32_t span, uint16_t duration) {
+	return (int32_t) ((int64_t) (after - before) * duration / span);
+}
+
+// Position s (Q16.16, from 0 to 1) of the way through a cubic Hermite segment
+// from p0 to p1, leaving with tangent t0 and arriving with t1 (see
+// PlannerCatmullRomTangent), to the nearest step. Horner's rule on the
+// segment's polynomial, so three multiplications and no divisions
+int32_t PlannerHermite(int32_t p0, int32_t p1, int32_t t0, int32_t t1, uint32_t s) {
+	int32_t c3 = 2 * (p0 - p1) + t0 + t1;
+	int32_t c2 = 3 * (p1 - p0) - 2 * t0 - t1;
+	int64_t v = (int64_t) c3 << SPLINE_SHIFT;
+	v = ((v * s) >> SPLINE_SHIFT) + ((int64_t) c2 << SPLINE_SHIFT);
+	v = ((v * s) >> SPLINE_SHIFT) + ((int64_t) t0 << SPLINE_SHIFT);
+	v = ((v * s) >> SPLINE_SHIFT) + ((int64_t) p0 << SPLINE_SHIFT);
+	return (int32_t) ((v + (1L << (SPLINE_SHIFT - 1))) >> SPLINE_SHIFT);
+}
+
+static uint32_t SaturatingAdd(uint32_t a, uint32_t b) {
+	return (a > UINT32_MAX - b) ? UINT32_MAX : a + b;
+}
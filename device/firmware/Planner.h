@@ -0,0 +1,77 @@
+#include <stdint.h>
+
+// Step timer is Timer2 clocked from the system clock through a /64 prescaler,
+// so one tick is 4us on a 16MHz board
+#define STEP_TIMER_PRESCALER 64
+#define STEP_TIMER_FREQ (F_CPU / STEP_TIMER_PRESCALER)
+
+// Number of step timer ticks between two consecutive steps
+typedef uint32_t interval;
+// Intervals are calculated internally in fixed point with this many fractional
+// bits, so that rounding to whole ticks doesn't make us drift from the profile
+#define INTERVAL_SHIFT 8
+
+typedef enum { PROFILE_ACCEL, PROFILE_CRUISE, PROFILE_DECEL, PROFILE_DONE } profile_phase;
+
+// State of a trapezoidal velocity profile for one movement. Filled in by
+// PlannerPrepare, then advanced one step at a time by PlannerNextInterval
+typedef struct {
+	uint32_t Steps;          // Total number of steps in the movement
+	uint32_t StepCount;      // Steps taken so far
+	int32_t RampCount;       // Position on the acceleration ramp: counts up while
+	                         // accelerating, and (negated) back up to 0 while decelerating
+	// All intervals below are fixed point (see INTERVAL_SHIFT)
+	interval Delay;          // Interval before the next step
+	interval MinDelay;       // Interval while cruising at maximum velocity
+	interval LastAccelDelay; // Last interval of the acceleration ramp
+	int32_t ExitRamp;        // Position on the ramp to decelerate down to
+	uint32_t Rest;           // Remainder carried between interval divisions
+	uint32_t Fraction;       // Fractional ticks carried between intervals
+	profile_phase Phase;
+} profile;
+
+void PlannerPrepare(profile *p, uint32_t steps, uint16_t entryVelocity, uint16_t maxVelocity, uint16_t exitVelocity, uint16_t acceleration);
+interval PlannerNextInterval(profile *p);
+interval PlannerEntryInterval(profile *p);
+uint32_t PlannerStopSteps(profile *p);
+void PlannerStop(profile *p);
+
+// Axes, as used to index arrays and in the bitmask returned by PlannerLineStep
+#define AXIS_X 0
+#define AXIS_Y 1
+#define AXIS_THETA 2
+#define AXIS_PHI 3
+#define AXES 4
+
+// State of a straight line movement across all axes at once, generated with
+// Bresenham's algorithm extended to 4D: the axis with furthest to go (the
+// dominant axis) steps on every tick, and each other axis steps whenever its
+// error term says it's fallen half a step behind the ideal line
+typedef struct {
+	uint16_t Steps;           // Ticks in the movement (distance of the dominant axis)
+	uint16_t StepCount;       // Ticks taken so far
+	uint16_t Distance[AXES];  // Steps each axis needs to take (always positive)
+	int32_t Error[AXES];
+} line;
+
+void PlannerLinePrepare(line *l, uint16_t distance[AXES]);
+uint8_t PlannerLineStep(line *l);
+uint16_t PlannerLineAxisSteps(line *l, uint8_t axis, uint16_t ticks);
+
+// Look-ahead plan for one queued movement, so that we don't have to stop
+// between movements. Speeds are along the path through all the axes (in
+// steps/s), and squared to save square roots
+typedef struct {
+	uint32_t EntrySpeedSqr;    // Planned speed at the start of the movement
+	uint32_t MaxEntrySpeedSqr; // Fastest we can take the corner into the movement
+	uint32_t AccelDistance;    // Most speed^2 can change by over the movement (2 * acceleration * length)
+} plan_block;
+
+uint32_t PlannerJunctionSpeedSqr(float previousUnit[AXES], float unit[AXES], uint16_t acceleration);
+uint8_t PlannerRecalculate(plan_block *blocks, uint8_t mask, uint8_t planned, uint8_t head);
+
+// Splines through keyframes (see Path.c). How far through a segment we are is
+// in fixed point with this many fractional bits
+#define SPLINE_SHIFT 16
+int32_t PlannerCatmullRomTangent(int32_t before, int32_t after, uint32_t span, uint16_t duration);
+int32_t PlannerHermite(int32_t p0, int32_t p1, int32_t t0, int32_t t1, uint32_t s);
@@ -0,0 +1,147 @@
+/* ****************************************************************************
+   Servo.c
+
+	 Theta (tilt) and phi (pan) are hobby servos, run by a second board (see
+	 servo_driver.ino) that we talk to over I2C. Every SERVO_PERIOD we send it
+	 the pulse width each servo should be at, worked out from its position.
+
+	 Theta and phi step along each line in Move.c with X and Y, so sampling
+	 where they've got to at a fixed rate gives setpoints interpolated along
+	 the line, in step with the steppers. Servos only take a pulse every 20ms,
+	 so they can't follow any more finely than that anyway.
+
+	 Frames are a sequence number, then each servo's number and pulse width
+	 (in microseconds, most significant byte first). The TWI sends them a byte
+	 at a time from its interrupt, so nothing here ever waits on the bus. A
+	 frame that doesn't get through is never sent again: the next one's due
+	 soon, and says where the servos should be by then.
+***************************************************************************** */
+
+#include "stdbool.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/twi.h>
+#include "Clock.h"
+#include "Move.h"
+#include "Servo.h"
+
+// Address of the servo driver, and the I2C clock
+#define SERVO_ADDRESS 0x08
+#define TWI_FREQ 100000UL
+
+// Pins (Arduino analog pins 4 and 5)
+#define TWI_PORT PORTC
+#define SDA_PIN 4
+#define SCL_PIN 5
+
+// Milliseconds between frames
+#define SERVO_PERIOD 20
+
+// Servo numbers the driver knows them by
+#define PAN_SERVO 0
+#define TILT_SERVO 1
+// Pulse width (us) at position 0, and microseconds per step (negative to
+// reverse), of each axis
+#define THETA_CENTRE 1500
+#define THETA_US_PER_STEP 1
+#define PHI_CENTRE 1500
+#define PHI_US_PER_STEP 1
+// Pulses hobby servos take at all (the driver limits each one further)
+#define SERVO_MIN_PULSE 500
+#define SERVO_MAX_PULSE 2500
+
+// Sequence number, then three bytes for each of the two servos
+#define FRAME_SIZE 7
+
+// Frame being sent, and how much of it has gone
+static byte Frame[FRAME_SIZE];
+static volatile byte FrameSent;
+// Whether a frame is still on its way (from START to STOP)
+static volatile bool Sending;
+static byte Sequence;
+// When the last frame was due
+static uint32_t LastFrame;
+
+static uint16_t PulseWidth(position pos, uint16_t centre, int8_t perStep);
+static void FrameAdd(byte index, byte servo, uint16_t pulse);
+
+void ServoInit(void) {
+	// Pull the bus up, in case nothing else on it does
+	TWI_PORT |= _BV(SDA_PIN) | _BV(SCL_PIN);
+
+	// No prescaler
+	TWSR = 0;
+	TWBR = (F_CPU / TWI_FREQ - 16) / 2;
+	TWCR = _BV(TWEN);
+
+	Sending = false;
+	Sequence = 0;
+	LastFrame = ClockMillis();
+}
+
+// Send the servos where theta and phi are, if it's time to
+void ServoSpin(void) {
+	uint32_t now = ClockMillis();
+	if (now - LastFrame < SERVO_PERIOD) { return; }
+	// Keep to the period, unless we've fallen a whole one behind
+	LastFrame = (now - LastFrame < 2*SERVO_PERIOD) ? LastFrame + SERVO_PERIOD : now;
+
+	if (Sending) {
+		// The last frame's had a whole period, so the bus is stuck. Turning the
+		// TWI off lets go of it, and we start again next time
+		TWCR = 0;
+		Sending = false;
+		return;
+	}
+
+	position x, y, theta, phi;
+	MoveGetCurrentPosition(&x, &y, &theta, &phi);
+	Frame[0] = Sequence++;
+	FrameAdd(1, TILT_SERVO, PulseWidth(theta, THETA_CENTRE, THETA_US_PER_STEP));
+	FrameAdd(4, PAN_SERVO, PulseWidth(phi, PHI_CENTRE, PHI_US_PER_STEP));
+	FrameSent = 0;
+	Sending = true;
+	TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+}
+
+static uint16_t PulseWidth(position pos, uint16_t centre, int8_t perStep) {
+	int32_t pulse = (int32_t) centre + (int32_t) pos * perStep;
+	if (pulse < SERVO_MIN_PULSE) { return SERVO_MIN_PULSE; }
+	if (pulse > SERVO_MAX_PULSE) { return SERVO_MAX_PULSE; }
+	return (uint16_t) pulse;
+}
+
+static void FrameAdd(byte index, byte servo, uint16_t pulse) {
+	Frame[index] = servo;
+	Frame[index + 1] = (byte) (pulse >> 8);
+	Frame[index + 2] = (byte) pulse;
+}
+
+// Called each time the TWI's finished sending something
+ISR(TWI_vect) {
+	switch (TW_STATUS) {
+		case TW_START:
+		case TW_REP_START:
+			TWDR = (SERVO_ADDRESS << 1) | TW_WRITE;
+			TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+			return;
+		case TW_MT_SLA_ACK:
+		case TW_MT_DATA_ACK:
+			if (FrameSent < FRAME_SIZE) {
+				TWDR = Frame[FrameSent++];
+				TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+				return;
+			}
+			break;
+		case TW_MT_ARB_LOST:
+			// Someone else has the bus, so leave it to them
+			TWCR = _BV(TWINT) | _BV(TWEN);
+			Sending = false;
+			return;
+		default:
+			// The driver isn't answering, or the bus went wrong
+			break;
+	}
+	TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+	Sending = false;
+}
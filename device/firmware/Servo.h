@@ -0,0 +1,2 @@
+void ServoInit(void);
+void ServoSpin(void);
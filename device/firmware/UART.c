@@ -3,6 +3,32 @@
 
 	 Handles interrupt-driven serial communication with RPi over USB (Arduino has
 	 an onboard USB UART chip)
+
+	 Speaks two protocols (see UARTSetProtocol). We start up speaking lines, so
+	 old hosts keep working: each command or reply is an opcode and its data,
+	 ended by LINE_END, with positions in three bytes so that LINE_END never
+	 turns up in the data.
+
+	 Hosts that ask for PROTOCOL_FRAMES get frames instead:
+	   COBS(opcode, data..., CRC high, CRC low) FRAME_END
+	 COBS (consistent overhead byte stuffing) removes every 0x00 from the frame
+	 for one byte of overhead, so FRAME_END only ever ends frames and we can
+	 always find the start of the next one. Positions are plain big-endian
+	 int16s. The CRC is CRC-16/CCITT (polynomial 0x1021, starting at 0xFFFF)
+	 over the opcode and data. PROTOCOL_UNITS is the same frames, but Command.c
+	 sends and receives positions in millimetres and degrees (see Units.c)
+
+	 Corrupted frames are answered with FRAME_ERROR, and the host sends them
+	 again. The host only sends one command at a time, waiting for its reply
+	 (every command replies, with FRAME_ACK if nothing else), and flips the top
+	 bit of the opcode on each new command. If a command comes in with the same
+	 bit as the last one, the host didn't get our reply to it, so we send that
+	 again rather than act on the command twice.
+
+	 Commands are read in place in the receive ring: we only start on one once
+	 its delimiter is there, so reading it never waits on the host, and it's
+	 only taken off the ring once we've finished with it. Frames are decoded
+	 over themselves (decoding never writes ahead of where it's reading).
 ***************************************************************************** */
 
 #include <avr/io.h>
@@ -17,6 +43,7 @@
 
 // Two ring buffers to store rx/tx data in. Taken from 
 // http://www.downtowndougbrown.com/2014/08/microcontrollers-uarts/
+// The receive ring's indices are bytes, and wrap around it on their own
 #define RING_SIZE 256 // Make a power of 2 to make modular arithmetic a lot faster
  
 // Transmission ring
@@ -34,13 +61,48 @@ static volatile byte RXRingHead;
 static volatile byte RXRingTail;
 static volatile byte RXRingData[RING_SIZE];
 static int RXRingAdd(byte c);
-static int RXRingRemove(void);
 inline static bool RXBufferFull(void);
 inline static bool RXBufferEmpty(void);
 
-// Store the number of lines (=number of 0x0D chars) in the
-// receive buffer
-static uint8_t LinesPresent = 0;
+// Store the number of lines or frames (=number of Delimiter chars) in the
+// receive buffer. Added to by the receive interrupt, so only ever taken from
+// with interrupts off
+static volatile uint8_t LinesPresent = 0;
+static volatile byte Delimiter = LINE_END;
+
+// Protocol we're speaking, and the one to switch to after the current command
+static byte Protocol;
+static byte NextProtocol;
+
+// Largest reply we'll send: an opcode and four positions in millimetres and
+// degrees
+#define REPLY_MAX 17
+// Top bit of the opcode in frames, flipped by the host on each new command
+#define FRAME_SEQUENCE 0x80
+// Sequence bit we'll never see, so the next command isn't taken as a repeat
+#define FRAME_NO_SEQUENCE 0x01
+
+// The command we're reading: where it starts in the receive ring, where its
+// delimiter is, its length (decoded, for frames) and where we are in it
+static byte RXStart;
+static byte RXEnd;
+static byte RXLength;
+static byte RXIndex;
+// The reply we're writing (kept so we can send it again)
+static byte TXFrame[REPLY_MAX + 2];
+static byte TXFrameLength;
+static byte Sequence;
+static bool Replied;
+// Frame being pushed to the host without it asking (see UARTPushStart), kept
+// apart so it can't disturb the reply
+static byte PushFrame[REPLY_MAX + 2];
+static byte PushFrameLength;
+static bool Pushing;
+
+static void RawWriteByte(byte data);
+static void RXConsume(void);
+static bool ReadFrame(void);
+static void WriteFrame(byte *data, byte length);
 
 // Initially setup up UART
 void UARTInit(void) {
@@ -70,14 +132,204 @@ void UARTInit(void) {
 	RXRingHead = 0;
 	TXRingTail = 0;
 	RXRingTail = 0;
+	LinesPresent = 0;
+
+	// Always start up speaking lines
+	Delimiter = LINE_END;
+	Protocol = PROTOCOL_LINES;
+	NextProtocol = PROTOCOL_LINES;
+	Sequence = FRAME_NO_SEQUENCE;
+	Pushing = false;
 }
 
 // Check status of our ring buffers
 bool UARTByteAvailable(void) { return !RXBufferEmpty(); }
+// Whether there's a whole command (a line or a frame) to read
 bool UARTLineAvailable(void) { return LinesPresent > 0; }
 
-// Write a byte out over serial (blocking if ring buffer (big) is full)
+// Protocol we're speaking (one of PROTOCOL_*)
+byte UARTProtocol(void) { return Protocol; }
+
+// Switch to speaking the passed protocol (one of PROTOCOL_*). Happens once the
+// command we're reading is finished (see UARTReadEnd), so the reply to it goes
+// out in the protocol the host asked in
+void UARTSetProtocol(byte protocol) {
+	NextProtocol = protocol;
+}
+
+// Start reading a command, once UARTLineAvailable says there's one there.
+// With frames, decodes the whole frame and checks it: returns false if it was
+// corrupted or a repeat (having already replied and dropped it), when the
+// command shouldn't be read any further
+bool UARTReadStart(void) {
+	Replied = false;
+
+	// Only we take from the ring, so the command stays where it is until
+	// RXConsume, and everything up to its delimiter has arrived
+	RXStart = RXRingTail;
+	RXEnd = RXStart;
+	while (RXRingData[RXEnd] != Delimiter) { RXEnd++; }
+	RXLength = RXEnd - RXStart;
+	RXIndex = 0;
+	if (Protocol == PROTOCOL_LINES) { return true; }
+
+	if (!ReadFrame()) {
+		RXConsume();
+		byte error[3] = { FRAME_ERROR };
+		WriteFrame(error, 1);
+		return false;
+	}
+
+	// Take the sequence bit off the opcode. A change of protocol always gets
+	// acted on: it's harmless twice, and the host uses it to start over
+	byte opcode = RXRingData[RXStart];
+	byte sequence = opcode & FRAME_SEQUENCE;
+	opcode &= ~FRAME_SEQUENCE;
+	RXRingData[RXStart] = opcode;
+	if (sequence == Sequence && opcode != PROTOCOL) {
+		RXConsume();
+		WriteFrame(TXFrame, TXFrameLength);
+		return false;
+	}
+	Sequence = sequence;
+	TXFrameLength = 0;
+	return true;
+}
+
+// Finish reading the current command, dropping anything we didn't read
+void UARTReadEnd(void) {
+	RXConsume();
+	if (Protocol != PROTOCOL_LINES && !Replied) {
+		// The host waits for a reply to every frame
+		UARTWriteByte(FRAME_ACK);
+		UARTWriteEnd();
+	}
+
+	if (NextProtocol != Protocol) {
+		Protocol = NextProtocol;
+		Sequence = FRAME_NO_SEQUENCE;
+		// Recount what we've got in the receive buffer with the new delimiter
+		cli();
+		Delimiter = (Protocol == PROTOCOL_LINES) ? LINE_END : FRAME_END;
+		LinesPresent = 0;
+		for (byte i = RXRingTail; i != RXRingHead; i = (i + 1) % RING_SIZE) {
+			if (RXRingData[i] == Delimiter) { LinesPresent++; }
+		}
+		sei();
+	}
+}
+
+// Send the reply written since the command was read
+void UARTWriteEnd(void) {
+	Replied = true;
+	if (Protocol == PROTOCOL_LINES) {
+		RawWriteByte(LINE_END);
+	} else {
+		TXFrame[0] |= Sequence;
+		WriteFrame(TXFrame, TXFrameLength);
+	}
+}
+
+// Start writing something the host didn't ask for, with UARTWriteByte and
+// UARTWritePosition, between commands. The host can't ask for it again, so
+// frames we push never have the sequence bit set
+void UARTPushStart(void) {
+	Pushing = true;
+	PushFrameLength = 0;
+}
+
+void UARTPushEnd(void) {
+	Pushing = false;
+	if (Protocol == PROTOCOL_LINES) {
+		RawWriteByte(LINE_END);
+	} else {
+		WriteFrame(PushFrame, PushFrameLength);
+	}
+}
+
+// Write a byte of a reply (or push)
 void UARTWriteByte(byte data) {
+	if (Protocol == PROTOCOL_LINES) {
+		RawWriteByte(data);
+	} else if (Pushing) {
+		if (PushFrameLength < REPLY_MAX) { PushFrame[PushFrameLength++] = data; }
+	} else if (TXFrameLength < REPLY_MAX) {
+		TXFrame[TXFrameLength++] = data;
+	}
+}
+
+// Read a byte of a command (0 past its end, rather than wait for more)
+byte UARTReadByte(void) {
+	if (RXIndex >= RXLength) { return 0; }
+	return RXRingData[(byte) (RXStart + RXIndex++)];
+}
+
+// Take the command we've read off the receive ring, delimiter and all
+static void RXConsume(void) {
+	RXRingTail = RXEnd + 1;
+	cli();
+	LinesPresent--;
+	sei();
+}
+
+// Undo the byte stuffing on the frame in the receive ring, in place, checking
+// its CRC as we go. Returns whether it's intact
+//
+// COBS splits the frame up into blocks at each 0x00, and replaces the 0x00
+// with a code byte at the start of the block giving the block's length (plus
+// one). A code of 0xFF is a block of 254 bytes not ended by a 0x00
+static bool ReadFrame(void) {
+	byte in = RXStart;
+	byte out = RXStart;
+	byte remaining = 0;
+	byte code = 0xFF;
+	uint16_t crc = 0xFFFF;
+	while (in != RXEnd) {
+		byte b = RXRingData[in++];
+		if (remaining == 0) {
+			if (code != 0xFF) {
+				RXRingData[out++] = 0x00;
+				crc = CRCUpdate(crc, 0x00);
+			}
+			code = b;
+			remaining = code - 1;
+		} else {
+			RXRingData[out++] = b;
+			crc = CRCUpdate(crc, b);
+			remaining--;
+		}
+	}
+	RXLength = out - RXStart;
+	if (remaining != 0 || RXLength < 3) { return false; }
+
+	// Running the CRC over the data and then the CRC itself always leaves 0
+	RXLength -= 2;
+	return crc == 0;
+}
+
+// Add the CRC to a frame (which needs two bytes spare on the end), stuff it,
+// and send it
+static void WriteFrame(byte *data, byte length) {
+	uint16_t crc = 0xFFFF;
+	for (byte i = 0; i < length; i++) { crc = CRCUpdate(crc, data[i]); }
+	data[length++] = crc >> 8;
+	data[length++] = crc & 0xFF;
+
+	// Frames are never long enough to need 0xFF codes
+	byte start = 0;
+	while (1) {
+		byte end = start;
+		while (end < length && data[end] != 0x00) { end++; }
+		RawWriteByte(end - start + 1);
+		for (byte i = start; i < end; i++) { RawWriteByte(data[i]); }
+		if (end == length) { break; }
+		start = end + 1;
+	}
+	RawWriteByte(FRAME_END);
+}
+
+// Write a byte out over serial (blocking if ring buffer (big) is full)
+static void RawWriteByte(byte data) {
     // Wait until there's room in the ring buffer
     while (TXBufferFull());
  
@@ -89,16 +341,8 @@ void UARTWriteByte(byte data) {
     UCSR0B |= _BV(UDRIE0);
 }
 
-// Read a byte in over serial (blocking)
-byte UARTReadByte(void) {
-    // Wait until a byte is available to read
-    while (RXBufferEmpty());
- 
-    // Then return the byte
-    return RXRingRemove();
-}
-
-// Read in three bytes and decode them into a two-byte position
+// Read in a position: two bytes (MSB first) in frames, or three bytes in lines
+// (decoded into a two-byte position)
 // We have this coding scheme so that newlines (0x0D) are never sent as
 // data bytes, because we're using them as stop bytes
 // TODO: Could do this much more efficiently, but does that really matter?
@@ -107,6 +351,11 @@ byte UARTReadByte(void) {
 // b1, b2 = p1, p2 with LSB set to 0 (LSB 0x0D = 1)
 // b3 = (?, ?, ?, ?, ?, ?, LSB b1, LSB b2) TODO: Make the other bits parity bits
 position UARTReadPosition(void) {
+	if (Protocol != PROTOCOL_LINES) {
+		byte high = UARTReadByte();
+		return (((position) high) << 8) | ((position) UARTReadByte());
+	}
+
 	// Read in raw bytes
 	byte b1 = UARTReadByte();
 	byte b2 = UARTReadByte();
@@ -120,8 +369,15 @@ position UARTReadPosition(void) {
 	return (((position) b1) << 8) | ((position) b2);	
 }
 
-// Given a position, write out three bytes using our coding scheme above
+// Given a position, write out two bytes, or three bytes using our coding
+// scheme above in lines
 void UARTWritePosition(position pos) {
+	if (Protocol != PROTOCOL_LINES) {
+		UARTWriteByte((byte) (pos >> 8));
+		UARTWriteByte((byte) (pos & 0xFF));
+		return;
+	}
+
 	// Encode
 	byte b1 = (byte) ((pos >> 8) & 0xFE);
 	byte b2 = (byte) (pos & 0xFE);
@@ -133,6 +389,18 @@ void UARTWritePosition(position pos) {
 	UARTWriteByte(b3);
 }
  
+// Read or write four bytes, MSB first (only in frames: lines have no way to
+// send them)
+int32_t UARTReadLong(void) {
+	uint32_t data = 0;
+	for (byte i = 0; i < 4; i++) { data = (data << 8) | UARTReadByte(); }
+	return (int32_t) data;
+}
+
+void UARTWriteLong(int32_t data) {
+	for (int8_t shift = 24; shift >= 0; shift -= 8) { UARTWriteByte((byte) (data >> shift)); }
+}
+
 // When data received, add it to RX buffer
 ISR(USART_RX_vect) {
     byte data = UDR0;
@@ -199,26 +467,16 @@ static int TXRingRemove(void) {
 }
  
 static int RXRingAdd(byte c) {
-    byte next_head = (RXRingHead + 1) % RING_SIZE;
-    if (next_head != RXRingTail) {
-        /* there is room */
-        RXRingData[RXRingHead] = c;
-        RXRingHead = next_head;
-				if (c == LINE_END) { LinesPresent++; }
-        return 0;
-    } else {
-        /* no room left in the buffer */
-        return -1;
-    }
-}
- 
-static int RXRingRemove(void) {
-    if (RXRingHead != RXRingTail) {
-        int c = RXRingData[RXRingTail];
-        RXRingTail = (RXRingTail + 1) % RING_SIZE;
-				if (c == LINE_END) { LinesPresent--; }
-        return c;
-    } else {
-        return -1;
-    }
+	byte next_head = (RXRingHead + 1) % RING_SIZE;
+	if (next_head != RXRingTail) {
+		/* there is room */
+		RXRingData[RXRingHead] = c;
+		RXRingHead = next_head;
+		if (c == Delimiter) { LinesPresent++; }
+		return 0;
+	} else {
+		/* no room left in the buffer */
+		return -1;
+	}
 }
+
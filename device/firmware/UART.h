@@ -3,11 +3,34 @@
 #include "Move.h"
 
 #define LINE_END 0x0D
+#define FRAME_END 0x00
+
+// Protocols we can speak (see UART.c), also used as their version numbers
+// when the host asks for one
+#define PROTOCOL_LINES 0
+#define PROTOCOL_FRAMES 1
+#define PROTOCOL_UNITS 2
+#define PROTOCOL_VERSION PROTOCOL_UNITS
+
+// Opcodes the UART uses itself, and the one asking for a protocol (see
+// Command.c for the rest)
+#define PROTOCOL 0x11
+#define FRAME_ACK 0x13
+#define FRAME_ERROR 0x14
 
 void UARTInit(void);
+void UARTSetProtocol(byte protocol);
+byte UARTProtocol(void);
+bool UARTReadStart(void);
+void UARTReadEnd(void);
+void UARTWriteEnd(void);
+void UARTPushStart(void);
+void UARTPushEnd(void);
 void UARTWriteByte(byte data);
 void UARTWritePosition(position pos);
 byte UARTReadByte(void);
 position UARTReadPosition(void);
+int32_t UARTReadLong(void);
+void UARTWriteLong(int32_t data);
 bool UARTByteAvailable(void);
 bool UARTLineAvailable(void);
@@ -0,0 +1,64 @@
+/* ****************************************************************************
+   Units.c
+
+	 Converts between millimetres and degrees, as hosts speaking
+	 PROTOCOL_UNITS send them (see UART.c), and the steps Move.c works in.
+	 Each axis has its own scale, in steps per millimetre or degree, which is
+	 a setting (see Config.c) so the board knows its own calibration.
+
+	 Positions come in finer than a step, so each relative movement would
+	 otherwise round a little differently and a long run of them would drift.
+	 Instead we keep what rounding left over at the end of the queue, and add
+	 it into the next relative movement. Absolute movements start it over
+***************************************************************************** */
+
+#include "stdbool.h"
+#include "Config.h"
+#include "Move.h"
+#include "Planner.h"
+#include "Units.h"
+
+// Units per step (Q0.32), from each axis' scale in Config.Scale (steps per
+// unit, Q16.16), so converting back never has to divide
+static uint32_t Inverse[AXES];
+
+// Fractions of a step (Q16.16) left over at the end of the queue, and what
+// they'll be once the movement being converted is added
+static int32_t Remainder[AXES];
+static int32_t Pending[AXES];
+
+// Pick up the scales (again, after they've been changed). Config only allows
+// more than a step per unit, which leaves room for the inverse
+void UnitsInit(void) {
+	for (uint8_t axis = 0; axis < AXES; axis++) {
+		Inverse[axis] = (uint32_t) ((1ULL << (32 + FIXED_SHIFT)) / Config.Scale[axis]);
+	}
+	UnitsClearRemainders();
+}
+
+// Convert a position (or with relative set, a distance from the end of the
+// queue) to the nearest whole step. Returns false if that's out of range.
+// Relative movements carry over what rounding leaves, once committed
+bool UnitsToSteps(uint8_t axis, fixed value, bool relative, int16_t *steps) {
+	int64_t exact = ((int64_t) value * Config.Scale[axis]) >> FIXED_SHIFT;
+	if (relative) { exact += Remainder[axis]; }
+	int64_t whole = (exact + (1L << (FIXED_SHIFT - 1))) >> FIXED_SHIFT;
+	if (whole > POSITION_MAX || whole < POSITION_MIN) { return false; }
+	*steps = (int16_t) whole;
+	Pending[axis] = (int32_t) (exact - (whole << FIXED_SHIFT));
+	return true;
+}
+
+// The movement just converted has been queued, so carry over its remainders
+void UnitsCommit(void) {
+	for (uint8_t axis = 0; axis < AXES; axis++) { Remainder[axis] = Pending[axis]; }
+}
+
+// The end of the queue has moved to a whole step (homing or aborting)
+void UnitsClearRemainders(void) {
+	for (uint8_t axis = 0; axis < AXES; axis++) { Remainder[axis] = Pending[axis] = 0; }
+}
+
+fixed UnitsFromSteps(uint8_t axis, int16_t steps) {
+	return (fixed) (((int64_t) steps * Inverse[axis] + (1L << (31 - FIXED_SHIFT))) >> (32 - FIXED_SHIFT));
+}
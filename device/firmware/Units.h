@@ -0,0 +1,13 @@
+#include "stdbool.h"
+#include <stdint.h>
+
+// Millimetres (X and Y) or degrees (theta and phi) in Q16.16 fixed point: the
+// top 16 bits are the whole part, and the bottom 16 the fraction
+typedef int32_t fixed;
+#define FIXED_SHIFT 16
+
+void UnitsInit(void);
+bool UnitsToSteps(uint8_t axis, fixed value, bool relative, int16_t *steps);
+void UnitsCommit(void);
+void UnitsClearRemainders(void);
+fixed UnitsFromSteps(uint8_t axis, int16_t steps);
@@ -14,10 +14,14 @@
 
 #include <avr/interrupt.h>
 
+#include "Clock.h"
 #include "Command.h"
+#include "Config.h"
 #include "Global.h"
 #include "Move.h"
 #include "Motor.h"
+#include "Path.h"
+#include "Servo.h"
 
 void init(void);
 void spin(void);
@@ -37,10 +41,19 @@ void init(void) {
 	// Enable interrupts
 	sei();
 
+	// Start keeping time
+	ClockInit();
+
+	// Load the settings everything else reads
+	ConfigInit();
+
 	// Intiial setup for motors (this doesn't turn the drivers on --- we have
 	// MotorStart and MotorStop for that)
 	MotorInit();
 
+	// Start sending theta and phi to the servo driver
+	ServoInit();
+
 	// Setup the command interface
 	CommandInit();
 
@@ -55,6 +68,12 @@ void spin(void) {
 	// Respond to commands
 	CommandSpin();
 
+	// Queue the next movement along the path, if one's running
+	PathSpin();
+
 	// Move
 	MoveSpin();
+
+	// Keep the servos where theta and phi have got to
+	ServoSpin();
 }
@@ -0,0 +1,586 @@
+/* ****************************************************************************
+   Sim.c
+
+	 Simulates the parts of the ATmega328p the firmware uses, so that it can be
+	 built and tested on the host (see the simtest target in the Makefile).
+	 Together with the headers in sim/, which stand in for avr-libc's, this
+	 replaces the hardware: firmware sources are compiled unchanged.
+
+	 Time only passes on a virtual clock. Firmware code runs in no time at all,
+	 except that each pass of the main loop takes SIM_SPIN_CYCLES and busy-waits
+	 (_delay_us) take as long as they ask for. Between runs of firmware code we
+	 advance the clock to the next thing the hardware would do (a Timer2 tick, a
+	 byte arriving or finishing transmitting), and call any ISRs that should
+	 fire. Everything is deterministic.
+
+	 ISRs take SIM_INTERRUPT_CYCLES, plus their busy-waits, plus whatever
+	 SimISRCost says their code takes, and interrupts raised meanwhile wait for
+	 them to finish, like on the AVR. SimISRStats records the result.
+
+	 Registers are plain variables, so we can't see the firmware writing to
+	 them. Instead, we look at them whenever firmware code returns to us:
+	   - TIFR2 reads as the timer's flags with SIM_REG_UNWRITTEN set. Any
+	     value written without it clears the flags written as 1s. Each
+	     access to TIFR2 picks up the last one, so none get missed
+	   - UDR0 holds SIM_UDR_EMPTY (more than a byte) until a byte is written
+	     to it, and received bytes are read from it with SIM_UDR_RECEIVED
+	     set, which the firmware's cast to byte throws away
+	   - Changes to PORTB/C/D are passed to SimPinHook
+	   - PINB/C/D read back output pins, and input pins read what SimDrivePin
+	     drives them to, or their pull-up. Changes on pins in PCMSK0-2 raise
+	     pin change interrupts
+	   - TWCR reads with SIM_REG_UNWRITTEN set too. Any value written without
+	     it is acted on: TWINT written as 1 clears the flag and sends a START,
+	     STOP or TWDR, and clearing TWEN lets go of the bus
+	 Only Timer2 in normal and CTC modes, Timer0 overflowing in normal mode,
+	 pin change interrupts, USART0 with 16x sampling and the TWI as a master
+	 writing to one slave (see SimTWIAddress) are simulated.
+***************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include <util/twi.h>
+#include "Sim.h"
+
+// Cycles we pretend each pass of the main loop takes
+#define SIM_SPIN_CYCLES 100
+
+// Responding to an interrupt, jumping from the vector table and returning with
+// RETI (see the ATmega328p datasheet, "Interrupt Response Time")
+#define SIM_INTERRUPT_CYCLES (4 + 3 + 4)
+
+#define SIM_REG_UNWRITTEN 0x100
+#define SIM_UDR_EMPTY 0x100
+#define SIM_UDR_RECEIVED 0x200
+
+// Size of the queues of bytes to and from the host
+#define SIM_SERIAL_SIZE 4096
+// Longest write to the TWI slave we keep
+#define SIM_TWI_SIZE 64
+
+// Firmware entry points, from holocam.c
+void init(void);
+void spin(void);
+
+volatile uint8_t SREG;
+volatile uint8_t PORTB, DDRB, PINB;
+volatile uint8_t PORTC, DDRC, PINC;
+volatile uint8_t PORTD, DDRD, PIND;
+volatile uint8_t PCICR, PCMSK0, PCMSK1, PCMSK2;
+volatile uint8_t TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2, ASSR;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, TIMSK0;
+volatile uint16_t UDR0;
+volatile uint8_t UCSR0A, UCSR0B, UCSR0C, UBRR0H, UBRR0L;
+volatile uint8_t TWBR, TWSR, TWAR, TWDR;
+volatile uint16_t TWCR;
+
+uint32_t SimSerialOverruns;
+sim_pin_hook SimPinHook;
+sim_isr_stats SimISRStats[SIM_VECTORS];
+sim_isr_cost SimISRCost;
+sim_twi_hook SimTWIHook;
+uint8_t SimTWIAddress;
+const char *SimVectorNames[SIM_VECTORS] = {
+	"PCINT0_vect", "PCINT1_vect", "PCINT2_vect", "TIMER2_COMPA_vect", "TIMER2_COMPB_vect", "TIMER2_OVF_vect", "TIMER0_OVF_vect", "USART_RX_vect", "USART_UDRE_vect", "TWI_vect"
+};
+
+static uint64_t Clock;
+
+// Timer2 interrupt flags, and the copy the firmware last got through TIFR2
+static uint8_t TimerFlags;
+static volatile uint16_t TIFR2Copy;
+// Timer0's overflow flag
+static bool Timer0Overflow;
+// Pin change interrupt flags (bit n for PCINTn)
+static uint8_t PinChangeFlags;
+// Input pins driven from outside (see SimDrivePin), and what to
+static uint8_t Driven[3], DrivenLevel[3];
+// When each interrupt was last raised
+static uint64_t Raised[SIM_VECTORS];
+
+// Bytes on their way to the firmware, and the time the next one arrives
+static uint8_t RXQueue[SIM_SERIAL_SIZE];
+static int RXQueueHead, RXQueueTail;
+static uint64_t RXArrival;
+// Received bytes waiting to be read: the AVR has a two byte FIFO, and a third
+// byte can wait in the shift register before we overrun
+#define SIM_RX_FIFO 3
+static uint8_t RXFIFO[SIM_RX_FIFO];
+static int RXCount;
+static uint8_t RXData;
+
+// Transmit holding register, then the shift register (busy until TXDone)
+static bool TXHoldingFull, TXShifting;
+static uint8_t TXHolding, TXShift;
+static uint64_t TXDone;
+// Bytes the firmware has finished transmitting
+static uint8_t TXQueue[SIM_SERIAL_SIZE];
+static int TXQueueHead, TXQueueTail;
+
+// TWI: what the firmware last wrote to TWCR (less the bits that start
+// something), whether TWINT is set, and what's on the bus. Each START, address
+// or data byte takes until TWIDone, then sets TWINT with TWIStatus
+typedef enum { TWI_IDLE, TWI_STARTED, TWI_WRITING, TWI_NACKED } twi_state;
+static twi_state TWIState;
+static uint8_t TWIControl;
+static bool TWIFlag, TWIBusy;
+static uint8_t TWIStatus;
+static uint64_t TWIDone;
+// Bytes written to the slave since it was addressed
+static uint8_t TWIData[SIM_TWI_SIZE];
+static int TWILength;
+
+// Port levels last time we looked, to spot changes
+static uint8_t LastPortB, LastPortC, LastPortD;
+
+static void Advance(uint64_t cycles);
+static void Sync(void);
+static void SyncTIFR2(void);
+static void SyncPort(volatile uint8_t *port, uint8_t *last);
+static void SyncPins(void);
+static void TimerTick(void);
+static void Timer0Tick(void);
+static uint32_t TimerPrescaler(void);
+static uint32_t Timer0Prescaler(void);
+static uint64_t FrameCycles(void);
+static void ReceiveByte(void);
+static void TransmitDone(void);
+static void StartTransmit(void);
+static void SyncTWI(void);
+static void TWIOperation(uint8_t status, uint32_t bits);
+static void TWITransmit(void);
+static void TWIRelease(void);
+static void TWIComplete(void);
+static void Dispatch(void);
+static void SetTimerFlag(uint8_t flag, sim_vector vector);
+static void RunISR(sim_vector vector, void (*isr)(void));
+
+uint64_t SimCycles(void) { return Clock; }
+
+void SimBoot(void) {
+	Clock = 0;
+	SREG = 0;
+	PORTB = DDRB = PINB = 0;
+	PORTC = DDRC = PINC = 0;
+	PORTD = DDRD = PIND = 0;
+	LastPortB = LastPortC = LastPortD = 0;
+	PCICR = PCMSK0 = PCMSK1 = PCMSK2 = 0;
+	PinChangeFlags = 0;
+	memset(Driven, 0, sizeof(Driven));
+	memset(DrivenLevel, 0, sizeof(DrivenLevel));
+	TCCR2A = TCCR2B = TCNT2 = OCR2A = OCR2B = TIMSK2 = ASSR = 0;
+	TimerFlags = 0;
+	TIFR2Copy = SIM_REG_UNWRITTEN;
+	TCCR0A = TCCR0B = TCNT0 = TIMSK0 = 0;
+	Timer0Overflow = false;
+	UDR0 = SIM_UDR_EMPTY;
+	UCSR0A = _BV(UDRE0);
+	UCSR0B = 0;
+	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+	UBRR0H = UBRR0L = 0;
+	RXQueueHead = RXQueueTail = 0;
+	RXCount = 0;
+	TXHoldingFull = TXShifting = false;
+	TXQueueHead = TXQueueTail = 0;
+	SimSerialOverruns = 0;
+	TWBR = TWAR = TWDR = 0;
+	TWSR = TW_NO_INFO;
+	TWCR = SIM_REG_UNWRITTEN;
+	TWIState = TWI_IDLE;
+	TWIControl = 0;
+	TWIFlag = TWIBusy = false;
+	memset(SimISRStats, 0, sizeof(SimISRStats));
+
+	init();
+	Sync();
+}
+
+void SimRun(uint64_t cycles) {
+	uint64_t end = Clock + cycles;
+	while (Clock < end) {
+		spin();
+		Advance((end - Clock < SIM_SPIN_CYCLES) ? end - Clock : SIM_SPIN_CYCLES);
+	}
+}
+
+bool SimRunUntil(bool (*done)(void), uint64_t timeout) {
+	uint64_t end = Clock + timeout;
+	while (!done()) {
+		if (Clock >= end) { return false; }
+		spin();
+		Advance(SIM_SPIN_CYCLES);
+	}
+	return true;
+}
+
+// Busy-waits from util/delay.h
+void SimDelayCycles(uint64_t cycles) {
+	Advance(cycles);
+}
+
+void SimSerialSend(const uint8_t *data, int length) {
+	for (int i = 0; i < length; i++) {
+		if (RXQueueHead == RXQueueTail) { RXArrival = Clock + FrameCycles(); }
+		int next = (RXQueueHead + 1) % SIM_SERIAL_SIZE;
+		if (next == RXQueueTail) {
+			fprintf(stderr, "sim: serial queue to firmware full\n");
+			exit(1);
+		}
+		RXQueue[RXQueueHead] = data[i];
+		RXQueueHead = next;
+	}
+}
+
+int SimSerialReceive(uint8_t *data, int max) {
+	int count = 0;
+	while (count < max && TXQueueTail != TXQueueHead) {
+		data[count++] = TXQueue[TXQueueTail];
+		TXQueueTail = (TXQueueTail + 1) % SIM_SERIAL_SIZE;
+	}
+	return count;
+}
+
+void SimDrivePin(volatile uint8_t *port, uint8_t pin, bool level) {
+	int index = (port == &PINB) ? 0 : (port == &PINC) ? 1 : 2;
+	Driven[index] |= _BV(pin);
+	if (level) { DrivenLevel[index] |= _BV(pin); } else { DrivenLevel[index] &= ~_BV(pin); }
+	SyncPins();
+}
+
+int SimSerialPending(void) { return (RXQueueHead - RXQueueTail + SIM_SERIAL_SIZE) % SIM_SERIAL_SIZE; }
+
+// Move the clock forward, handling everything the hardware does on the way
+static void Advance(uint64_t cycles) {
+	uint64_t end = Clock + cycles;
+	Sync();
+	Dispatch();
+
+	while (Clock < end) {
+		// Jump to whichever happens first
+		uint64_t next = end;
+		uint32_t prescaler = TimerPrescaler();
+		uint64_t tick = prescaler ? (Clock / prescaler + 1) * prescaler : UINT64_MAX;
+		if (tick < next) { next = tick; }
+		uint32_t prescaler0 = Timer0Prescaler();
+		uint64_t tick0 = prescaler0 ? (Clock / prescaler0 + 1) * prescaler0 : UINT64_MAX;
+		if (tick0 < next) { next = tick0; }
+		if (RXQueueHead != RXQueueTail && RXArrival < next) { next = RXArrival; }
+		if (TXShifting && TXDone < next) { next = TXDone; }
+		if (TWIBusy && TWIDone < next) { next = TWIDone; }
+		Clock = next;
+
+		if (Clock == tick) { TimerTick(); }
+		if (Clock == tick0) { Timer0Tick(); }
+		if (RXQueueHead != RXQueueTail && Clock == RXArrival) { ReceiveByte(); }
+		if (TXShifting && Clock == TXDone) { TransmitDone(); }
+		if (TWIBusy && Clock == TWIDone) { TWIComplete(); }
+		Dispatch();
+	}
+}
+
+// Pick up whatever firmware code has written to the registers since we last
+// looked
+static void Sync(void) {
+	SyncTIFR2();
+
+	if (UDR0 < SIM_UDR_EMPTY) {
+		if ((UCSR0B & _BV(TXEN0)) && !TXHoldingFull) {
+			TXHolding = (uint8_t) UDR0;
+			TXHoldingFull = true;
+			StartTransmit();
+		}
+		UDR0 = SIM_UDR_EMPTY;
+	}
+	if (TXHoldingFull) { UCSR0A &= ~_BV(UDRE0); } else { UCSR0A |= _BV(UDRE0); }
+	SyncTWI();
+
+	SyncPort(&PORTB, &LastPortB);
+	SyncPort(&PORTC, &LastPortC);
+	SyncPort(&PORTD, &LastPortD);
+	SyncPins();
+}
+
+volatile uint16_t *SimTIFR2(void) {
+	SyncTIFR2();
+	TIFR2Copy = SIM_REG_UNWRITTEN | TimerFlags;
+	return &TIFR2Copy;
+}
+
+static void SyncTIFR2(void) {
+	if (!(TIFR2Copy & SIM_REG_UNWRITTEN)) { TimerFlags &= ~TIFR2Copy; }
+	TIFR2Copy = SIM_REG_UNWRITTEN;
+}
+
+static void SyncPort(volatile uint8_t *port, uint8_t *last) {
+	uint8_t changed = *port ^ *last;
+	*last = *port;
+	if (!changed || !SimPinHook) { return; }
+	for (uint8_t pin = 0; pin < 8; pin++) {
+		if (changed & _BV(pin)) { SimPinHook(port, pin, (*port & _BV(pin)) != 0, Clock); }
+	}
+}
+
+// Work out what each input register reads, raising pin change interrupts for
+// pins that have changed
+static void SyncPins(void) {
+	static volatile uint8_t * const ports[3] = { &PORTB, &PORTC, &PORTD };
+	static volatile uint8_t * const ddrs[3] = { &DDRB, &DDRC, &DDRD };
+	static volatile uint8_t * const pins[3] = { &PINB, &PINC, &PIND };
+	static volatile uint8_t * const masks[3] = { &PCMSK0, &PCMSK1, &PCMSK2 };
+	for (int i = 0; i < 3; i++) {
+		uint8_t outside = (Driven[i] & DrivenLevel[i]) | (~Driven[i] & *ports[i]);
+		uint8_t level = (*ddrs[i] & *ports[i]) | (~*ddrs[i] & outside);
+		uint8_t changed = level ^ *pins[i];
+		*pins[i] = level;
+		if ((changed & *masks[i]) && !(PinChangeFlags & _BV(i))) {
+			PinChangeFlags |= _BV(i);
+			Raised[SIM_PCINT0 + i] = Clock;
+		}
+	}
+}
+
+// One tick of Timer2's (prescaled) clock
+static void TimerTick(void) {
+	uint8_t count = TCNT2;
+	bool ctc = (TCCR2A & (_BV(WGM21) | _BV(WGM20))) == _BV(WGM21) && !(TCCR2B & _BV(WGM22));
+
+	if (count == OCR2B) { SetTimerFlag(OCF2B, SIM_TIMER2_COMPB); }
+	if (count == OCR2A) { SetTimerFlag(OCF2A, SIM_TIMER2_COMPA); }
+	if (ctc && count == OCR2A) {
+		TCNT2 = 0;
+	} else {
+		TCNT2 = count + 1;
+		if (count == 0xFF) { SetTimerFlag(TOV2, SIM_TIMER2_OVF); }
+	}
+}
+
+// One tick of Timer0's (prescaled) clock
+static void Timer0Tick(void) {
+	if (++TCNT0 == 0) {
+		if (!Timer0Overflow) { Raised[SIM_TIMER0_OVF] = Clock; }
+		Timer0Overflow = true;
+	}
+}
+
+static void SetTimerFlag(uint8_t flag, sim_vector vector) {
+	if (!(TimerFlags & _BV(flag))) { Raised[vector] = Clock; }
+	TimerFlags |= _BV(flag);
+}
+
+static uint32_t TimerPrescaler(void) {
+	static const uint32_t prescalers[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+	return prescalers[TCCR2B & (_BV(CS22) | _BV(CS21) | _BV(CS20))];
+}
+
+// Timer0 has fewer prescalers, and uses its last two clock selects for an
+// external clock (which we don't simulate)
+static uint32_t Timer0Prescaler(void) {
+	static const uint32_t prescalers[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	return prescalers[TCCR0B & (_BV(CS02) | _BV(CS01) | _BV(CS00))];
+}
+
+// Cycles to send one frame: start bit, 5-9 data bits, optional parity and one
+// or two stop bits
+static uint64_t FrameCycles(void) {
+	uint32_t ubrr = ((uint32_t) UBRR0H << 8) | UBRR0L;
+	uint32_t bitCycles = ((UCSR0A & _BV(U2X0)) ? 8 : 16) * (ubrr + 1);
+	uint32_t bits = 1 + 5 + ((UCSR0C >> UCSZ00) & 0x03) + ((UCSR0B & _BV(UCSZ02)) ? 4 : 0);
+	if (UCSR0C & _BV(UPM01)) { bits++; }
+	bits += (UCSR0C & _BV(USBS0)) ? 2 : 1;
+	return (uint64_t) bits * bitCycles;
+}
+
+// The next byte from the host has finished arriving
+static void ReceiveByte(void) {
+	uint8_t data = RXQueue[RXQueueTail];
+	RXQueueTail = (RXQueueTail + 1) % SIM_SERIAL_SIZE;
+	RXArrival = Clock + FrameCycles();
+
+	if (!(UCSR0B & _BV(RXEN0))) { return; }
+	if (RXCount == SIM_RX_FIFO) {
+		// Firmware hasn't read the last bytes yet
+		SimSerialOverruns++;
+		UCSR0A |= _BV(DOR0);
+		return;
+	}
+	if (RXCount == 0) { Raised[SIM_USART_RX] = Clock; }
+	RXFIFO[RXCount++] = data;
+	UCSR0A |= _BV(RXC0);
+}
+
+static void TransmitDone(void) {
+	TXShifting = false;
+	int next = (TXQueueHead + 1) % SIM_SERIAL_SIZE;
+	if (next != TXQueueTail) {
+		TXQueue[TXQueueHead] = TXShift;
+		TXQueueHead = next;
+	}
+	UCSR0A |= _BV(TXC0);
+	StartTransmit();
+}
+
+// Move the holding register into the shift register if it's free
+static void StartTransmit(void) {
+	if (TXShifting || !TXHoldingFull) { return; }
+	TXShift = TXHolding;
+	TXHoldingFull = false;
+	TXShifting = true;
+	TXDone = Clock + FrameCycles();
+	UCSR0A |= _BV(UDRE0);
+}
+
+static void SyncTWI(void) {
+	if (TWCR & SIM_REG_UNWRITTEN) { return; }
+	uint8_t value = (uint8_t) TWCR;
+	TWIControl = value & ~(_BV(TWINT) | _BV(TWSTA) | _BV(TWSTO));
+	if (!(value & _BV(TWEN))) {
+		TWIFlag = TWIBusy = false;
+		TWIState = TWI_IDLE;
+	} else if ((value & _BV(TWINT)) && !TWIBusy) {
+		TWIFlag = false;
+		if (value & _BV(TWSTO)) { TWIRelease(); }
+		if (value & _BV(TWSTA)) {
+			bool repeated = (TWIState != TWI_IDLE);
+			TWIRelease();
+			TWIState = TWI_STARTED;
+			TWIOperation(repeated ? TW_REP_START : TW_START, 1);
+		} else if (!(value & _BV(TWSTO))) {
+			TWITransmit();
+		}
+	}
+	TWCR = SIM_REG_UNWRITTEN | TWIControl | (TWIFlag ? _BV(TWINT) : 0);
+}
+
+// Start something on the bus that takes bits SCL periods
+static void TWIOperation(uint8_t status, uint32_t bits) {
+	static const uint32_t prescalers[4] = { 1, 4, 16, 64 };
+	uint32_t bitCycles = 16 + 2 * TWBR * prescalers[TWSR & (_BV(TWPS1) | _BV(TWPS0))];
+	TWIStatus = status;
+	TWIBusy = true;
+	TWIDone = Clock + bits * bitCycles;
+}
+
+// Send TWDR: the address after a START, then data. Each byte takes 9 bits
+// with its ACK
+static void TWITransmit(void) {
+	uint8_t data = TWDR;
+	switch (TWIState) {
+		case TWI_STARTED:
+			if ((data >> 1) == SimTWIAddress && (data & 0x01) == TW_WRITE) {
+				TWIState = TWI_WRITING;
+				TWILength = 0;
+				TWIOperation(TW_MT_SLA_ACK, 9);
+			} else {
+				TWIState = TWI_NACKED;
+				TWIOperation((data & 0x01) == TW_READ ? TW_MR_SLA_NACK : TW_MT_SLA_NACK, 9);
+			}
+			break;
+		case TWI_WRITING:
+			if (TWILength < SIM_TWI_SIZE) { TWIData[TWILength++] = data; }
+			TWIOperation(TW_MT_DATA_ACK, 9);
+			break;
+		case TWI_NACKED:
+			TWIOperation(TW_MT_DATA_NACK, 9);
+			break;
+		case TWI_IDLE:
+			// Not the master, so nothing to send it to
+			break;
+	}
+}
+
+// A STOP (or repeated START) ends any write to the slave
+static void TWIRelease(void) {
+	if (TWIState == TWI_WRITING && SimTWIHook) { SimTWIHook(TWIData, TWILength, Clock); }
+	TWIState = TWI_IDLE;
+}
+
+static void TWIComplete(void) {
+	TWIBusy = false;
+	TWIFlag = true;
+	TWSR = (TWSR & (_BV(TWPS1) | _BV(TWPS0))) | TWIStatus;
+	TWCR = SIM_REG_UNWRITTEN | TWIControl | _BV(TWINT);
+	Raised[SIM_TWI] = Clock;
+}
+
+// Call ISRs for any interrupts that are pending and enabled, highest priority
+// (lowest vector number) first
+static void Dispatch(void) {
+	while (SREG & _BV(SREG_I)) {
+		uint8_t timer = TimerFlags & TIMSK2;
+		uint8_t pinChange = PinChangeFlags & PCICR;
+		if (pinChange) {
+			int i = (pinChange & _BV(PCIE0)) ? 0 : (pinChange & _BV(PCIE1)) ? 1 : 2;
+			static void (* const isrs[3])(void) = { PCINT0_vect, PCINT1_vect, PCINT2_vect };
+			PinChangeFlags &= ~_BV(i);
+			RunISR(SIM_PCINT0 + i, isrs[i]);
+		} else if (timer & _BV(OCF2A)) {
+			TimerFlags &= ~_BV(OCF2A);
+			RunISR(SIM_TIMER2_COMPA, TIMER2_COMPA_vect);
+		} else if (timer & _BV(OCF2B)) {
+			TimerFlags &= ~_BV(OCF2B);
+			RunISR(SIM_TIMER2_COMPB, TIMER2_COMPB_vect);
+		} else if (timer & _BV(TOV2)) {
+			TimerFlags &= ~_BV(TOV2);
+			RunISR(SIM_TIMER2_OVF, TIMER2_OVF_vect);
+		} else if (Timer0Overflow && (TIMSK0 & _BV(TOIE0))) {
+			Timer0Overflow = false;
+			RunISR(SIM_TIMER0_OVF, TIMER0_OVF_vect);
+		} else if (RXCount > 0 && (UCSR0B & _BV(RXCIE0))) {
+			// Reading UDR0 in the ISR takes the byte out of the FIFO
+			RXData = RXFIFO[0];
+			memmove(RXFIFO, RXFIFO + 1, --RXCount);
+			UDR0 = SIM_UDR_RECEIVED | RXData;
+			if (RXCount == 0) { UCSR0A &= ~(_BV(RXC0) | _BV(DOR0)); }
+			RunISR(SIM_USART_RX, USART_RX_vect);
+			// The next byte's been waiting since this one was read
+			Raised[SIM_USART_RX] = Clock;
+		} else if (!TXHoldingFull && (UCSR0B & _BV(UDRIE0)) && (UCSR0B & _BV(TXEN0))) {
+			Raised[SIM_USART_UDRE] = Clock;
+			RunISR(SIM_USART_UDRE, USART_UDRE_vect);
+		} else if (TWIFlag && (TWIControl & _BV(TWIE))) {
+			RunISR(SIM_TWI, TWI_vect);
+		} else {
+			break;
+		}
+	}
+}
+
+static void RunISR(sim_vector vector, void (*isr)(void)) {
+	uint64_t start = Clock;
+	uint32_t latency = start - Raised[vector];
+	SREG &= ~_BV(SREG_I);
+	isr();
+	if (vector == SIM_USART_RX && UDR0 == (SIM_UDR_RECEIVED | RXData)) { UDR0 = SIM_UDR_EMPTY; }
+	Advance(SIM_INTERRUPT_CYCLES + (SimISRCost ? SimISRCost(vector) : 0));
+	SREG |= _BV(SREG_I);
+	Sync();
+
+	sim_isr_stats *stats = &SimISRStats[vector];
+	uint32_t cycles = Clock - start;
+	stats->Count++;
+	stats->Cycles += cycles;
+	if (cycles > stats->MaxCycles) { stats->MaxCycles = cycles; }
+	if (latency > stats->MaxLatency) { stats->MaxLatency = latency; }
+}
+
+// Interrupts the firmware has enabled but not written an ISR for reset the
+// AVR, which is never what we wanted
+static void BadInterrupt(const char *vector) {
+	fprintf(stderr, "sim: %s fired with no ISR\n", vector);
+	exit(1);
+}
+
+__attribute__((weak)) ISR(PCINT0_vect) { BadInterrupt("PCINT0_vect"); }
+__attribute__((weak)) ISR(PCINT1_vect) { BadInterrupt("PCINT1_vect"); }
+__attribute__((weak)) ISR(PCINT2_vect) { BadInterrupt("PCINT2_vect"); }
+__attribute__((weak)) ISR(TIMER2_COMPA_vect) { BadInterrupt("TIMER2_COMPA_vect"); }
+__attribute__((weak)) ISR(TIMER2_COMPB_vect) { BadInterrupt("TIMER2_COMPB_vect"); }
+__attribute__((weak)) ISR(TIMER2_OVF_vect) { BadInterrupt("TIMER2_OVF_vect"); }
+__attribute__((weak)) ISR(TIMER0_OVF_vect) { BadInterrupt("TIMER0_OVF_vect"); }
+__attribute__((weak)) ISR(USART_RX_vect) { BadInterrupt("USART_RX_vect"); }
+__attribute__((weak)) ISR(USART_UDRE_vect) { BadInterrupt("USART_UDRE_vect"); }
+__attribute__((weak)) ISR(TWI_vect) { BadInterrupt("TWI_vect"); }
@@ -0,0 +1,60 @@
+#include <stdint.h>
+#include "stdbool.h"
+
+// Cycles of the (F_CPU) system clock since the simulated board was reset
+uint64_t SimCycles(void);
+
+// Reset the simulated hardware, then run the firmware's init()
+void SimBoot(void);
+// Run the firmware's main loop for the passed number of cycles, firing
+// interrupts as the simulated hardware raises them
+void SimRun(uint64_t cycles);
+// Run the main loop until done() returns true, or timeout cycles pass.
+// Returns whether done() returned true
+bool SimRunUntil(bool (*done)(void), uint64_t timeout);
+
+// Queue bytes to arrive on the USART from the host, one frame time apart
+void SimSerialSend(const uint8_t *data, int length);
+// Copy out (up to max) bytes the firmware has finished transmitting. Returns
+// the number copied
+int SimSerialReceive(uint8_t *data, int max);
+// Number of bytes queued with SimSerialSend that haven't arrived yet
+int SimSerialPending(void);
+// Bytes dropped because the firmware didn't read the last one in time
+extern uint32_t SimSerialOverruns;
+
+// Called whenever an output pin changes level. port is PORTB, PORTC or PORTD
+typedef void (*sim_pin_hook)(volatile uint8_t *port, uint8_t pin, bool level, uint64_t cycle);
+extern sim_pin_hook SimPinHook;
+
+// Drive an input pin (pin of PINB, PINC or PIND) from outside the board, like
+// a switch would. Pins nothing drives read their pull-up (their PORT bit)
+void SimDrivePin(volatile uint8_t *port, uint8_t pin, bool level);
+
+// The TWI bus has one slave, at SimTWIAddress, which ACKs everything written
+// to it. Each write to it is passed to SimTWIHook once the master ends it with
+// a STOP or repeated START. Anything else on the bus NACKs
+typedef void (*sim_twi_hook)(const uint8_t *data, int length, uint64_t cycle);
+extern sim_twi_hook SimTWIHook;
+extern uint8_t SimTWIAddress;
+
+// Interrupts the simulator raises, in priority order
+typedef enum { SIM_PCINT0, SIM_PCINT1, SIM_PCINT2, SIM_TIMER2_COMPA, SIM_TIMER2_COMPB, SIM_TIMER2_OVF, SIM_TIMER0_OVF, SIM_USART_RX, SIM_USART_UDRE, SIM_TWI, SIM_VECTORS } sim_vector;
+
+// How long each ISR has taken, and how long after its interrupt was raised it
+// started (latency is only tracked for the pin change, timer, RX and TWI
+// interrupts)
+typedef struct {
+	uint32_t Count;
+	uint64_t Cycles;
+	uint32_t MaxCycles;
+	uint32_t MaxLatency;
+} sim_isr_stats;
+extern sim_isr_stats SimISRStats[SIM_VECTORS];
+extern const char *SimVectorNames[SIM_VECTORS];
+
+// Called after each ISR returns, for the cycles its code should have taken.
+// We can't run AVR instructions, so without this ISRs only take as long as
+// their busy-waits and the interrupt itself (see SIM_INTERRUPT_CYCLES)
+typedef uint32_t (*sim_isr_cost)(sim_vector vector);
+extern sim_isr_cost SimISRCost;
@@ -0,0 +1,20 @@
+/* ****************************************************************************
+   avr/eeprom.h (simulator)
+
+	 EEMEM variables are ordinary variables on the host, so they keep their
+	 values across SimBoot like the EEPROM does, and reads and writes take no
+	 time at all.
+***************************************************************************** */
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+
+static inline uint8_t eeprom_read_byte(const uint8_t *p) { return *p; }
+static inline uint32_t eeprom_read_dword(const uint32_t *p) { return *p; }
+static inline void eeprom_read_block(void *dst, const void *src, size_t n) { memcpy(dst, src, n); }
+static inline void eeprom_update_byte(uint8_t *p, uint8_t value) { *p = value; }
+static inline void eeprom_update_dword(uint32_t *p, uint32_t value) { *p = value; }
+static inline void eeprom_update_block(const void *src, void *dst, size_t n) { memcpy(dst, src, n); }
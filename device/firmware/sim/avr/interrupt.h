@@ -0,0 +1,25 @@
+/* ****************************************************************************
+   avr/interrupt.h (simulator)
+
+	 ISRs become ordinary functions, which sim/Sim.c calls when their interrupt
+	 fires. sei() and cli() set and clear the I bit in the simulated SREG.
+***************************************************************************** */
+
+#pragma once
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+#define sei() (SREG |= _BV(SREG_I))
+#define cli() (SREG &= (uint8_t) ~_BV(SREG_I))
+
+// Interrupts the simulator knows how to raise
+ISR(PCINT0_vect);
+ISR(PCINT1_vect);
+ISR(PCINT2_vect);
+ISR(TIMER2_COMPA_vect);
+ISR(TIMER2_COMPB_vect);
+ISR(TIMER2_OVF_vect);
+ISR(TIMER0_OVF_vect);
+ISR(USART_RX_vect);
+ISR(USART_UDRE_vect);
+ISR(TWI_vect);
@@ -0,0 +1,109 @@
+/* ****************************************************************************
+   avr/io.h (simulator)
+
+	 Stands in for avr-libc's avr/io.h when building the firmware for the host.
+	 Registers are plain variables, read and written by sim/Sim.c between runs
+	 of firmware code, and bit numbers are the ATmega328p's.
+***************************************************************************** */
+
+#pragma once
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+// Status register
+extern volatile uint8_t SREG;
+#define SREG_I 7
+
+// GPIO
+extern volatile uint8_t PORTB, DDRB, PINB;
+extern volatile uint8_t PORTC, DDRC, PINC;
+extern volatile uint8_t PORTD, DDRD, PIND;
+
+// Pin change interrupts: PCINT0 is port B, PCINT1 port C, PCINT2 port D. Bits
+// in PCMSK0-2 are the port's pin numbers
+extern volatile uint8_t PCICR, PCMSK0, PCMSK1, PCMSK2;
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+
+// Timer0 (only overflowing in normal mode is simulated)
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, TIMSK0;
+#define WGM00 0
+#define WGM01 1
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM02 3
+#define TOIE0 0
+#define TOV0 0
+
+// Timer2
+extern volatile uint8_t TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2, ASSR;
+// Writing 1s to TIFR2 clears those flags, so each access gets a fresh copy of
+// the flags for Sim.c to look at (see SimTIFR2)
+volatile uint16_t *SimTIFR2(void);
+#define TIFR2 (*SimTIFR2())
+#define WGM20 0
+#define WGM21 1
+#define COM2B0 4
+#define COM2B1 5
+#define COM2A0 6
+#define COM2A1 7
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM22 3
+#define FOC2B 6
+#define FOC2A 7
+#define TOIE2 0
+#define OCIE2A 1
+#define OCIE2B 2
+#define TOV2 0
+#define OCF2A 1
+#define OCF2B 2
+#define AS2 5
+#define EXCLK 6
+
+// USART0. UDR0 is wider than on the AVR, so the simulator can tell a byte the
+// firmware writes from the received byte it reads (see Sim.c)
+extern volatile uint16_t UDR0;
+extern volatile uint8_t UCSR0A, UCSR0B, UCSR0C, UBRR0H, UBRR0L;
+#define MPCM0 0
+#define U2X0 1
+#define UPE0 2
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+#define TXB80 0
+#define RXB80 1
+#define UCSZ02 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+#define UCPOL0 0
+#define UCSZ00 1
+#define UCSZ01 2
+#define USBS0 3
+#define UPM00 4
+#define UPM01 5
+#define UMSEL00 6
+#define UMSEL01 7
+
+// TWI (I2C), as a master writing to slaves. TWCR is wider than on the AVR, so
+// the simulator can tell when the firmware writes it (see Sim.c)
+extern volatile uint8_t TWBR, TWSR, TWAR, TWDR;
+extern volatile uint16_t TWCR;
+#define TWPS0 0
+#define TWPS1 1
+#define TWIE 0
+#define TWEN 2
+#define TWWC 3
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA 6
+#define TWINT 7
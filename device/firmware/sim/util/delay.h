@@ -0,0 +1,13 @@
+/* ****************************************************************************
+   util/delay.h (simulator)
+
+	 Busy-waits advance the simulated clock instead of burning host time.
+***************************************************************************** */
+
+#pragma once
+#include <stdint.h>
+
+void SimDelayCycles(uint64_t cycles);
+
+#define _delay_us(us) SimDelayCycles((uint64_t) ((us) * (F_CPU / 1000000.0)))
+#define _delay_ms(ms) SimDelayCycles((uint64_t) ((ms) * (F_CPU / 1000.0)))
@@ -0,0 +1,15 @@
+/* ****************************************************************************
+   util/setbaud.h (simulator)
+
+	 Same calculation as avr-libc's, without the tolerance checks: always uses
+	 16x sampling, which is exact for the baud rates we use.
+***************************************************************************** */
+
+#ifndef BAUD
+#error "Define BAUD before including util/setbaud.h"
+#endif
+
+#define UBRR_VALUE (((F_CPU) + 8UL * (BAUD)) / (16UL * (BAUD)) - 1UL)
+#define UBRRL_VALUE (UBRR_VALUE & 0xff)
+#define UBRRH_VALUE (UBRR_VALUE >> 8)
+#define USE_2X 0
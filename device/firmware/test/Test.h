@@ -0,0 +1,27 @@
+/* ****************************************************************************
+   Test.h
+
+	 Minimal assertion helpers shared by the host-side tests. Each test file is
+	 its own executable, and exits non-zero if any check failed.
+***************************************************************************** */
+
+#include <stdio.h>
+
+static int TestChecks = 0;
+static int TestFailures = 0;
+
+#define CHECK(cond, ...) do { \
+	TestChecks++; \
+	if (!(cond)) { \
+		TestFailures++; \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while (0)
+
+// Print a summary, and return a suitable exit code for main
+static int TestReport(const char *name) {
+	printf("%s: %d checks, %d failures\n", name, TestChecks, TestFailures);
+	return TestFailures > 0;
+}
@@ -0,0 +1,212 @@
+/* ****************************************************************************
+   bench_steps.c
+
+	 Benchmarks step timing on the simulated board (see sim/Sim.c): makes a
+	 long movement on each stepper axis while serial traffic keeps arriving,
+	 then reports what each ISR cost, a histogram of how far each step interval
+	 was from the one the velocity profile asked for, and the fastest step rate
+	 the step ISR could keep up with.
+
+	 The simulator can't run AVR instructions, so the cycles each ISR's own
+	 code takes come from the estimates below (or the command line: see main).
+	 Busy-waits and the interrupts themselves are timed exactly. Run it before
+	 and after any motion or protocol change with 'make bench'.
+***************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include "../sim/Sim.h"
+#include "../UART.h"
+#include "../Planner.h"
+
+// Estimated cycles for each ISR's own code on the AVR
+#define STEP_ISR_CYCLES 1000  // A step: mostly the 32-bit division in PlannerNextInterval
+#define RELOAD_ISR_CYCLES 60  // Reloading OCR2A part way through a long interval
+#define RX_ISR_CYCLES 80
+#define UDRE_ISR_CYCLES 60
+#define PULSE_END_ISR_CYCLES 20  // Pulling the step pins back high
+#define CLOCK_ISR_CYCLES 50  // Counting milliseconds (see Clock.c)
+#define TWI_ISR_CYCLES 40  // Sending the next byte to the servo driver (see Servo.c)
+
+// Limits of the stepper axes (see Move.c), and their step pins (see Motor.c)
+#define X_MAX_VELOCITY 2000
+#define X_ACCELERATION 4000
+#define Y_MAX_VELOCITY 2000
+#define Y_ACCELERATION 4000
+#define X_STEP_PIN 0
+#define Y_STEP_PIN 2
+
+#define MOVE_ABS 0x01
+#define GET_POS 0x03
+
+// Steps in each benchmark movement
+#define BENCH_STEPS 4000
+
+// Histogram of step interval errors, in cycles
+#define HISTOGRAM_WIDTH 16
+#define HISTOGRAM_MIN -128
+#define HISTOGRAM_BUCKETS 24
+
+static uint32_t StepCycles = STEP_ISR_CYCLES;
+static uint32_t ReloadCycles = RELOAD_ISR_CYCLES;
+static uint32_t RXCycles = RX_ISR_CYCLES;
+static uint32_t UDRECycles = UDRE_ISR_CYCLES;
+static uint32_t PulseEndCycles = PULSE_END_ISR_CYCLES;
+static uint32_t ClockCycles = CLOCK_ISR_CYCLES;
+static uint32_t TWICycles = TWI_ISR_CYCLES;
+
+// Step pulses (falling edges) on the axis being benchmarked
+static uint8_t StepPin;
+static uint32_t Pulses;
+static uint64_t PulseTimes[BENCH_STEPS];
+// Whether the ISR that's running has taken a step
+static bool Stepped;
+
+static void OnPinChange(volatile uint8_t *port, uint8_t pin, bool level, uint64_t cycle) {
+	if (port != &PORTB || level) { return; }
+	if (pin == X_STEP_PIN || pin == Y_STEP_PIN) { Stepped = true; }
+	if (pin == StepPin && Pulses < BENCH_STEPS) { PulseTimes[Pulses++] = cycle; }
+}
+
+static uint32_t ISRCost(sim_vector vector) {
+	switch (vector) {
+		case SIM_TIMER2_COMPA: {
+			uint32_t cycles = Stepped ? StepCycles : ReloadCycles;
+			Stepped = false;
+			return cycles;
+		}
+		case SIM_TIMER2_COMPB: return PulseEndCycles;
+		case SIM_TIMER0_OVF: return ClockCycles;
+		case SIM_USART_RX: return RXCycles;
+		case SIM_USART_UDRE: return UDRECycles;
+		case SIM_TWI: return TWICycles;
+		default: return 0;
+	}
+}
+
+// Serial traffic to keep sending while we move: a line the firmware ignores
+// (so the RX ISR fires back to back), then a GET_POS so it has to reply
+static const uint8_t Traffic[] = {
+	0x00, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, LINE_END,
+	GET_POS, LINE_END
+};
+
+static void SendMove(position x, position y) {
+	position positions[4] = { x, y, 0, 0 };
+	uint8_t data[14];
+	int length = 0;
+	data[length++] = MOVE_ABS;
+	for (int axis = 0; axis < 4; axis++) {
+		position pos = positions[axis];
+		data[length++] = (uint8_t) ((pos >> 8) & 0xFE);
+		data[length++] = (uint8_t) (pos & 0xFE);
+		data[length++] = (uint8_t) ((pos & 0x01) | ((pos >> 7) & 0x02));
+	}
+	data[length++] = LINE_END;
+	SimSerialSend(data, length);
+}
+
+// Run until the movement's finished, keeping the serial line busy
+static void RunMovement(void) {
+	uint8_t discard[64];
+	uint64_t timeout = SimCycles() + 10ULL * F_CPU;
+	while (Pulses < BENCH_STEPS && SimCycles() < timeout) {
+		if (SimSerialPending() < (int) sizeof(Traffic)) { SimSerialSend(Traffic, sizeof(Traffic)); }
+		SimRun(500);
+		while (SimSerialReceive(discard, sizeof(discard)) > 0);
+	}
+}
+
+static void BenchAxis(const char *name, uint8_t pin, position x, position y, uint16_t velocity, uint16_t acceleration) {
+	StepPin = pin;
+	Pulses = 0;
+	SimBoot();
+	for (int vector = 0; vector < SIM_VECTORS; vector++) {
+		SimISRStats[vector] = (sim_isr_stats) { 0, 0, 0, 0 };
+	}
+	uint64_t start = SimCycles();
+	SendMove(x, y);
+	RunMovement();
+	uint64_t elapsed = SimCycles() - start;
+
+	printf("\nAxis %s: %u steps at up to %u steps/s\n", name, Pulses, velocity);
+	if (Pulses < BENCH_STEPS) {
+		printf("  movement didn't finish (%u of %u steps)\n", Pulses, BENCH_STEPS);
+		return;
+	}
+
+	printf("  %-18s %8s %12s %11s %12s\n", "ISR", "calls", "mean cycles", "max cycles", "max latency");
+	for (int vector = 0; vector < SIM_VECTORS; vector++) {
+		sim_isr_stats *stats = &SimISRStats[vector];
+		if (stats->Count == 0) { continue; }
+		printf("  %-18s %8u %12.1f %11u %12u\n", SimVectorNames[vector], stats->Count,
+				(double) stats->Cycles / stats->Count, stats->MaxCycles, stats->MaxLatency);
+	}
+
+	// Compare each interval against the profile the firmware should be
+	// following (a single movement from rest, so easy to recreate)
+	profile p;
+	PlannerPrepare(&p, BENCH_STEPS, 0, velocity, 0, acceleration);
+	uint32_t histogram[HISTOGRAM_BUCKETS] = { 0 };
+	uint32_t below = 0, above = 0, late = 0;
+	int64_t worst = 0;
+	for (uint32_t i = 1; i < BENCH_STEPS; i++) {
+		int64_t wanted = (int64_t) PlannerNextInterval(&p) * STEP_TIMER_PRESCALER;
+		int64_t error = (int64_t) (PulseTimes[i] - PulseTimes[i - 1]) - wanted;
+		if (llabs(error) > llabs(worst)) { worst = error; }
+		if (error >= STEP_TIMER_PRESCALER) { late++; }
+		int64_t bucket = (error - HISTOGRAM_MIN) / HISTOGRAM_WIDTH;
+		if (error < HISTOGRAM_MIN) {
+			below++;
+		} else if (bucket >= HISTOGRAM_BUCKETS) {
+			above++;
+		} else {
+			histogram[bucket]++;
+		}
+	}
+
+	printf("  step interval error (cycles, against the profile):\n");
+	if (below) { printf("    %6s < %-5d %6u\n", "", HISTOGRAM_MIN, below); }
+	for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		if (!histogram[bucket]) { continue; }
+		int low = HISTOGRAM_MIN + bucket * HISTOGRAM_WIDTH;
+		printf("    %6d..%-5d %6u ", low, low + HISTOGRAM_WIDTH - 1, histogram[bucket]);
+		for (uint32_t i = 0; i < (histogram[bucket] * 50 + BENCH_STEPS - 1) / BENCH_STEPS; i++) { putchar('#'); }
+		putchar('\n');
+	}
+	if (above) { printf("    %6s >= %-4d %6u\n", "", HISTOGRAM_MIN + HISTOGRAM_BUCKETS * HISTOGRAM_WIDTH, above); }
+	printf("  worst error %lld cycles, %u steps a tick or more late\n", (long long) worst, late);
+
+	// The step ISR (and the one ending its pulse, if any) have to finish
+	// before the next step's due, in whatever time the serial, clock and TWI
+	// ISRs leave them
+	uint32_t perStep = SimISRStats[SIM_TIMER2_COMPA].MaxCycles + SimISRStats[SIM_TIMER2_COMPB].MaxCycles;
+	double serial = (double) (SimISRStats[SIM_USART_RX].Cycles + SimISRStats[SIM_USART_UDRE].Cycles
+			+ SimISRStats[SIM_TIMER0_OVF].Cycles + SimISRStats[SIM_TWI].Cycles) / elapsed;
+	double sustainable = F_CPU * (1 - serial) / perStep;
+	printf("  serial, clock and TWI ISRs used %.1f%% of the CPU\n", 100 * serial);
+	printf("  sustainable step rate %.0f steps/s (%u cycles of ISRs a step), timer limit %u steps/s\n",
+			sustainable, perStep, STEP_TIMER_FREQ);
+}
+
+// Optional arguments override the estimated cycles for the step, reload, RX,
+// UDRE, pulse end, clock and TWI ISRs, in that order
+int main(int argc, char **argv) {
+	uint32_t *cycles[] = { &StepCycles, &ReloadCycles, &RXCycles, &UDRECycles, &PulseEndCycles, &ClockCycles, &TWICycles };
+	for (int i = 1; i < argc && i <= 7; i++) {
+		*cycles[i - 1] = strtoul(argv[i], NULL, 0);
+	}
+
+	SimPinHook = OnPinChange;
+	SimISRCost = ISRCost;
+
+	printf("Step timing benchmark (simulated %lu Hz ATmega328p)\n", (unsigned long) F_CPU);
+	printf("ISR code cycles: step %u, reload %u, RX %u, UDRE %u, pulse end %u, clock %u, TWI %u (plus interrupt entry and exit)\n",
+			StepCycles, ReloadCycles, RXCycles, UDRECycles, PulseEndCycles, ClockCycles, TWICycles);
+
+	BenchAxis("X", X_STEP_PIN, BENCH_STEPS, 0, X_MAX_VELOCITY, X_ACCELERATION);
+	BenchAxis("Y", Y_STEP_PIN, 0, BENCH_STEPS, Y_MAX_VELOCITY, Y_ACCELERATION);
+	printf("\nTheta and phi are servos, streamed over TWI (see Servo.c)\n");
+	return 0;
+}
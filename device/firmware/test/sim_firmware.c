@@ -0,0 +1,1162 @@
+/* ****************************************************************************
+   sim_firmware.c
+
+	 Runs the whole firmware on the simulated board (see sim/Sim.c), talking to
+	 it over serial the same way the Raspberry Pi does, and watching the step
+	 pins to check the movements it makes
+***************************************************************************** */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "Test.h"
+#include "../sim/Sim.h"
+#include "../Config.h"
+#include "../UART.h"
+#include "../Planner.h"
+#include "../Units.h"
+
+// Command opcodes (see Command.c)
+#define MOVE_ABS 0x01
+#define MOVE_REL 0x02
+#define GET_POS 0x03
+#define HOME_X 0x04
+#define HOME_Y 0x05
+#define POS_RETURN 0x09
+#define TARGET_RETURN 0x0A
+#define SUCCESS 0x0B
+#define FAILURE 0x0C
+#define MOVE_ABS_RETURN 0x0E
+#define GET_TARGET 0x0F
+#define MOVE_REL_RETURN 0x10
+#define START 0x06
+#define STOP 0x07
+#define ABORT 0x08
+#define PROTOCOL_RETURN 0x12
+#define MOVE_BATCH 0x15
+#define MOVE_BATCH_RETURN 0x16
+#define SUBSCRIBE 0x17
+#define POS_UPDATE 0x18
+#define QUEUE_SPACE 0x19
+#define GET_PARAM 0x1A
+#define SET_PARAM 0x1B
+#define PARAM_RETURN 0x1C
+#define PATH_CLEAR 0x1D
+#define PATH_ADD 0x1E
+#define PATH_RUN 0x1F
+#define PATH_RETURN 0x20
+#define TIME 0x21
+#define TIME_RETURN 0x22
+#define MOVE_AT 0x23
+#define HOME_RETURN 0x24
+
+// Step and direction pins, and endstops (see Motor.c)
+#define X_STEP_PIN 0
+#define X_DIR_PIN 1
+#define Y_STEP_PIN 2
+#define Y_DIR_PIN 3
+#define X_ENDSTOP_PIN 0
+#define Y_ENDSTOP_PIN 1
+
+// The servo driver, and the servo numbers and pulse widths it's sent (see
+// Servo.c)
+#define SERVO_ADDRESS 0x08
+#define PAN_SERVO 0
+#define TILT_SERVO 1
+#define SERVO_CENTRE 1500
+
+// Default scales (see Units.c): steps per millimetre, and per degree
+#define STEPS_PER_MM 80
+#define STEPS_PER_DEGREE 10
+
+// Where the carriage really is, from the steps it's taken, and where the
+// endstops are. Endstops are hit at their position or beyond, and we count
+// how many times they've been hit, and the step interval each last got hit at
+static int32_t PhysicalX, PhysicalY;
+#define X_ENDSTOP (-300)
+#define Y_ENDSTOP (-100)
+static int EndstopHits[2];
+static uint64_t EndstopInterval[2];
+static uint64_t LastStep[2];
+
+// Falling edges on the X step pin, and when the last few happened
+static uint32_t Pulses;
+static uint64_t PulseTimes[4096];
+// Shortest and longest step pulses
+static uint64_t ShortestPulse = UINT64_MAX, LongestPulse;
+
+static void StepAxis(int axis, int32_t *physical, int32_t endstop, uint8_t dirPin, uint8_t endstopPin, uint64_t cycle) {
+	bool wasHit = *physical <= endstop;
+	*physical += (PORTB & _BV(dirPin)) ? 1 : -1;
+	bool hit = *physical <= endstop;
+	if (hit && !wasHit) {
+		EndstopHits[axis]++;
+		EndstopInterval[axis] = cycle - LastStep[axis];
+	}
+	LastStep[axis] = cycle;
+	if (hit != wasHit) { SimDrivePin(&PINC, endstopPin, !hit); }
+}
+
+static void OnPinChange(volatile uint8_t *port, uint8_t pin, bool level, uint64_t cycle) {
+	if (port != &PORTB) { return; }
+	if (pin == Y_STEP_PIN && !level) { StepAxis(1, &PhysicalY, Y_ENDSTOP, Y_DIR_PIN, Y_ENDSTOP_PIN, cycle); }
+	if (pin != X_STEP_PIN) { return; }
+	if (!level) { StepAxis(0, &PhysicalX, X_ENDSTOP, X_DIR_PIN, X_ENDSTOP_PIN, cycle); }
+	if (!level) {
+		PulseTimes[Pulses % 4096] = cycle;
+		Pulses++;
+	} else if (Pulses > 0) {
+		uint64_t width = cycle - PulseTimes[(Pulses - 1) % 4096];
+		if (width < ShortestPulse) { ShortestPulse = width; }
+		if (width > LongestPulse) { LongestPulse = width; }
+	}
+}
+
+// Frames sent to the servo driver: when each arrived, what it said, and where
+// X was then
+typedef struct {
+	uint64_t Cycle;
+	int Length;
+	uint8_t Data[8];
+	int32_t X;
+} servo_frame;
+static servo_frame ServoFrames[256];
+static int ServoFrameCount;
+
+static void OnServoFrame(const uint8_t *data, int length, uint64_t cycle) {
+	if (ServoFrameCount == 256) { return; }
+	servo_frame *frame = &ServoFrames[ServoFrameCount++];
+	frame->Cycle = cycle;
+	frame->Length = length;
+	memcpy(frame->Data, data, length < 8 ? length : 8);
+	frame->X = PhysicalX;
+}
+
+static int ServoPulse(servo_frame *frame, int offset) { return (frame->Data[offset + 1] << 8) | frame->Data[offset + 2]; }
+
+static uint32_t PulsesWanted;
+static bool PulsesDone(void) { return Pulses >= PulsesWanted; }
+
+// Encode positions with the three byte scheme in UART.c
+static int EncodePosition(uint8_t *data, position pos) {
+	data[0] = (uint8_t) ((pos >> 8) & 0xFE);
+	data[1] = (uint8_t) (pos & 0xFE);
+	data[2] = (uint8_t) ((pos & 0x01) | ((pos >> 7) & 0x02));
+	return 3;
+}
+
+static void SendCommand(uint8_t command, int count, position *positions) {
+	uint8_t data[32];
+	int length = 0;
+	data[length++] = command;
+	for (int i = 0; i < count; i++) {
+		length += EncodePosition(&data[length], positions[i]);
+	}
+	data[length++] = LINE_END;
+	SimSerialSend(data, length);
+}
+
+// Run until a whole response line (or frame, ending with ResponseEnd) has
+// come back (up to 100ms). Returns its length, or 0 if nothing came
+static uint8_t Response[64];
+static int ResponseLength;
+static uint8_t ResponseEnd = LINE_END;
+static bool ResponseDone(void) {
+	// A byte at a time, so we stop at the end of the first one
+	while (ResponseLength < (int) sizeof(Response) && SimSerialReceive(&Response[ResponseLength], 1)) {
+		if (Response[ResponseLength++] == ResponseEnd) { return true; }
+	}
+	return false;
+}
+static int ReadResponse(void) {
+	ResponseLength = 0;
+	if (!SimRunUntil(ResponseDone, F_CPU / 10)) { return 0; }
+	return ResponseLength;
+}
+
+static position DecodePosition(uint8_t *data) {
+	uint8_t b1 = data[0] | ((data[2] & 0x02) >> 1);
+	uint8_t b2 = data[1] | (data[2] & 0x01);
+	return (position) ((b1 << 8) | b2);
+}
+
+// Ask for a position (GET_POS or GET_TARGET) and check it
+static void CheckPosition(uint8_t command, uint8_t reply, position x, position y, position theta, position phi) {
+	SendCommand(command, 0, NULL);
+	int length = ReadResponse();
+	CHECK(length == 14 && Response[0] == reply, "position reply %d bytes, opcode 0x%02x", length, Response[0]);
+	if (length != 14) { return; }
+	position wanted[4] = { x, y, theta, phi };
+	for (int axis = 0; axis < 4; axis++) {
+		position got = DecodePosition(&Response[1 + 3 * axis]);
+		CHECK(got == wanted[axis], "command 0x%02x: axis %d at %d, wanted %d", command, axis, got, wanted[axis]);
+	}
+}
+
+// Read the reply to homing (in lines), checking it's for axis and says result
+static void CheckHomeReply(uint8_t axis, uint8_t result) {
+	int length = ReadResponse();
+	CHECK(length == 4 && Response[0] == HOME_RETURN && Response[1] == axis && Response[2] == result,
+			"home reply %d bytes: 0x%02x axis %d 0x%02x", length, Response[0], Response[1], Response[2]);
+}
+
+static void Move(uint8_t command, uint8_t reply, position x, position y, position theta, position phi) {
+	position positions[4] = { x, y, theta, phi };
+	SendCommand(command, 4, positions);
+	int length = ReadResponse();
+	CHECK(length == 3 && Response[0] == reply && Response[1] == SUCCESS,
+			"move reply %d bytes: 0x%02x 0x%02x", length, Response[0], Response[1]);
+}
+
+// CRC-16/CCITT, as used in frames (see UART.c)
+static uint16_t CRC(uint8_t *data, int length) {
+	uint16_t crc = 0xFFFF;
+	for (int i = 0; i < length; i++) {
+		crc ^= (uint16_t) data[i] << 8;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+// Add the CRC to a frame (with room for it), and stuff it into wire. Returns
+// how many bytes it is on the wire
+static int EncodeFrame(uint8_t *wire, uint8_t *frame, int length) {
+	uint16_t crc = CRC(frame, length);
+	frame[length++] = crc >> 8;
+	frame[length++] = crc & 0xFF;
+
+	// Byte stuffing: each 0x00 (and the end) becomes the length of the block
+	// before it
+	int out = 0, code = out++;
+	for (int i = 0; i < length; i++) {
+		if (frame[i] == 0x00) {
+			wire[code] = out - code;
+			code = out++;
+		} else {
+			wire[out++] = frame[i];
+		}
+	}
+	wire[code] = out - code;
+	wire[out++] = FRAME_END;
+	return out;
+}
+
+// Build a frame carrying a command and its positions, with the passed
+// sequence bit
+static int BuildFrame(uint8_t *wire, uint8_t sequence, uint8_t command, int count, position *positions) {
+	uint8_t frame[32];
+	int length = 0;
+	frame[length++] = command | sequence;
+	for (int i = 0; i < count; i++) {
+		frame[length++] = (uint8_t) (positions[i] >> 8);
+		frame[length++] = (uint8_t) positions[i];
+	}
+	return EncodeFrame(wire, frame, length);
+}
+
+static void SendFrame(uint8_t sequence, uint8_t command, int count, position *positions) {
+	uint8_t wire[64];
+	SimSerialSend(wire, BuildFrame(wire, sequence, command, count, positions));
+}
+
+// Space in the movement queue the firmware last told us about
+// Home both axes part way through a queue of movements. Movements after homing
+// are from the homed position, and we carry on answering commands meanwhile
+static void CheckHoming(void) {
+	position before[4] = { 1300, 40, 0, 0 };
+	SendCommand(MOVE_ABS, 4, before);
+	ReadResponse();
+	SendCommand(HOME_X, 0, NULL);
+	CheckHomeReply(AXIS_X, SUCCESS);
+	SendCommand(HOME_Y, 0, NULL);
+	CheckHomeReply(AXIS_Y, SUCCESS);
+	position after[4] = { 100, 10, 0, 0 };
+	SendCommand(MOVE_REL, 4, after);
+	ReadResponse();
+	CheckPosition(GET_TARGET, TARGET_RETURN, 100, 10, 0, 0);
+	// Homing can only wait at one place in the queue, so not after this too
+	SendCommand(HOME_Y, 0, NULL);
+	CheckHomeReply(AXIS_Y, FAILURE);
+	CheckPosition(GET_TARGET, TARGET_RETURN, 100, 10, 0, 0);
+
+	// The fast seek takes over a second to get to X's endstop
+	Pulses = 0;
+	PulsesWanted = 1000;
+	CHECK(SimRunUntil(PulsesDone, 2 * F_CPU), "only %u of 1000 steps after 2s", Pulses);
+	CheckPosition(GET_TARGET, TARGET_RETURN, 100, 10, 0, 0);
+	CHECK(PhysicalX > X_ENDSTOP && PhysicalX < 1300, "X at %d part way through homing", PhysicalX);
+
+	SimRun(5 * F_CPU);
+	CheckPosition(GET_POS, POS_RETURN, 100, 10, 0, 0);
+	CHECK(PhysicalX == X_ENDSTOP + 100 && PhysicalY == Y_ENDSTOP + 10, "homed, then moved to %d, %d",
+			PhysicalX, PhysicalY);
+	// Hit once fast, then again slowly
+	for (int axis = 0; axis < 2; axis++) {
+		CHECK(EndstopHits[axis] == 2, "axis %d endstop hit %d times", axis, EndstopHits[axis]);
+		CHECK(EndstopInterval[axis] > F_CPU / 200, "axis %d endstop hit %llu cycles after the step before",
+				axis, (unsigned long long) EndstopInterval[axis]);
+	}
+	CHECK(SimISRStats[SIM_PCINT1].Count >= 4, "endstop interrupt fired %u times", SimISRStats[SIM_PCINT1].Count);
+
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 1200, 40, 0, 0);
+	SimRun(2 * F_CPU);
+	CheckPosition(GET_POS, POS_RETURN, 1200, 40, 0, 0);
+}
+
+// Abort part way through a movement at full speed, and again just before a
+// corner we're going through too fast to stop before. Each time we should
+// slow down rather than stop dead, and end up exactly where we say we are.
+// Backing up a little first gets the rest queued up before they start
+static void CheckAbort(position corner, uint32_t abortAt) {
+	int32_t offset = 1200 - PhysicalX;
+	Pulses = 0;
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 1100, 40, 0, 0);
+	Move(MOVE_ABS, MOVE_ABS_RETURN, corner, 40, 0, 0);
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 3200, 40, 0, 0);
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 3200, 1040, 0, 0);
+	PulsesWanted = 100 + abortAt;
+	CHECK(SimRunUntil(PulsesDone, 2 * F_CPU), "only %u of %u steps after 2s", Pulses, PulsesWanted);
+	SendCommand(ABORT, 0, NULL);
+	uint32_t aborted = Pulses;
+	uint64_t abortTime = SimCycles();
+	SimRun(F_CPU);
+
+	// 2000 steps/s takes 500 steps and 0.5s to stop at 4000 steps/s^2
+	uint64_t last = PulseTimes[(Pulses - 1) % 4096];
+	uint64_t lastGap = last - PulseTimes[(Pulses - 2) % 4096];
+	CHECK(Pulses - aborted <= 510, "took %u steps to stop", Pulses - aborted);
+	CHECK(last - abortTime < 6 * F_CPU / 10, "took %llu cycles to stop", (unsigned long long) (last - abortTime));
+	CHECK(lastGap > F_CPU / 200, "last step only %llu cycles after the one before", (unsigned long long) lastGap);
+	CheckPosition(GET_POS, POS_RETURN, PhysicalX + offset, 40, 0, 0);
+	CheckPosition(GET_TARGET, TARGET_RETURN, PhysicalX + offset, 40, 0, 0);
+
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 1200, 40, 0, 0);
+	SimRun(2 * F_CPU);
+	CheckPosition(GET_POS, POS_RETURN, 1200, 40, 0, 0);
+}
+
+// Pan and tilt as X moves: the servo driver gets where they are every 20ms,
+// numbered in order, and they move in step with X, no faster than they can
+static void CheckServos(void) {
+	int32_t start = PhysicalX;
+	ServoFrameCount = 0;
+	SimRun(F_CPU / 10);
+	CHECK(ServoFrameCount >= 4, "%d servo frames in 100ms", ServoFrameCount);
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 1400, 40, 100, -50);
+	SimRun(F_CPU);
+	CHECK(ServoFrameCount > 50, "%d servo frames in 1.1s", ServoFrameCount);
+
+	for (int i = 0; i < ServoFrameCount; i++) {
+		servo_frame *frame = &ServoFrames[i];
+		CHECK(frame->Length == 7 && frame->Data[1] == TILT_SERVO && frame->Data[4] == PAN_SERVO,
+				"servo frame %d bytes, servos %u and %u", frame->Length, frame->Data[1], frame->Data[4]);
+		if (frame->Length != 7) { return; }
+		// Theta goes half as far as X, and phi a quarter as far back
+		int theta = ServoPulse(frame, 1) - SERVO_CENTRE;
+		int phi = ServoPulse(frame, 4) - SERVO_CENTRE;
+		int32_t x = frame->X - start;
+		CHECK(abs(2 * theta - x) <= 6 && abs(-4 * phi - x) <= 8, "servos at %d, %d with X %d steps along",
+				theta, phi, x);
+		if (i == 0) { continue; }
+		servo_frame *last = &ServoFrames[i - 1];
+		uint64_t gap = frame->Cycle - last->Cycle;
+		CHECK(gap > F_CPU / 50 - F_CPU / 1000 && gap < F_CPU / 50 + F_CPU / 1000, "servo frames %llu cycles apart",
+				(unsigned long long) gap);
+		CHECK(frame->Data[0] == (uint8_t) (last->Data[0] + 1), "servo frame %u after %u", frame->Data[0], last->Data[0]);
+		// 1000 steps/s is 20 steps a frame
+		CHECK(abs(ServoPulse(frame, 1) - ServoPulse(last, 1)) <= 21, "tilt jumped from %d to %d",
+				ServoPulse(last, 1), ServoPulse(frame, 1));
+	}
+	servo_frame *end = &ServoFrames[ServoFrameCount - 1];
+	CHECK(ServoPulse(end, 1) == SERVO_CENTRE + 100 && ServoPulse(end, 4) == SERVO_CENTRE - 50,
+			"servos ended at %d, %d", ServoPulse(end, 1), ServoPulse(end, 4));
+	CheckPosition(GET_POS, POS_RETURN, 1400, 40, 100, -50);
+
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 1200, 40, 0, 0);
+	SimRun(F_CPU);
+	CheckPosition(GET_POS, POS_RETURN, 1200, 40, 0, 0);
+}
+
+static int QueueSpace = -1;
+
+// Read a reply frame into Reply, checking it arrived intact. Returns the
+// length of its opcode and data, or 0 if it didn't come or was corrupted.
+// Frames pushed without being asked for are skipped, after noting the queue
+// space from any QUEUE_SPACE
+static uint8_t Reply[64];
+static int ReadFrame(void) {
+	ResponseEnd = FRAME_END;
+	int length = ReadResponse();
+	ResponseEnd = LINE_END;
+	if (length == 0) { return 0; }
+
+	int decoded = 0;
+	for (int i = 0; i < length - 1; ) {
+		int code = Response[i++];
+		for (int j = 1; j < code && i < length - 1; j++) { Reply[decoded++] = Response[i++]; }
+		if (code < 0xFF && i < length - 1) { Reply[decoded++] = 0x00; }
+	}
+	if (decoded < 3 || CRC(Reply, decoded) != 0) { return 0; }
+	if (Reply[0] == QUEUE_SPACE) { QueueSpace = Reply[1]; }
+	return decoded - 2;
+}
+static int ReadFrameReply(void) {
+	int length;
+	while ((length = ReadFrame()) > 0 && (Reply[0] == QUEUE_SPACE || Reply[0] == POS_UPDATE));
+	return length;
+}
+
+static void CheckFramePosition(uint8_t sequence, uint8_t command, uint8_t reply, position x, position y) {
+	SendFrame(sequence, command, 0, NULL);
+	int length = ReadFrameReply();
+	CHECK(length == 9 && Reply[0] == (reply | sequence), "framed position reply %d bytes, opcode 0x%02x", length, Reply[0]);
+	if (length != 9) { return; }
+	position wanted[4] = { x, y, 0, 0 };
+	for (int axis = 0; axis < 4; axis++) {
+		position got = (position) ((Reply[1 + 2 * axis] << 8) | Reply[2 + 2 * axis]);
+		CHECK(got == wanted[axis], "framed command 0x%02x: axis %d at %d, wanted %d", command, axis, got, wanted[axis]);
+	}
+}
+
+static void CheckFrameReply(uint8_t sequence, uint8_t reply, int length) {
+	int got = ReadFrameReply();
+	CHECK(got == length && Reply[0] == (reply | sequence), "frame reply %d bytes, opcode 0x%02x, wanted 0x%02x",
+			got, Reply[0], reply | sequence);
+}
+
+// Talk to the firmware in frames, then switch back to lines
+static void CheckFrames(void) {
+	uint8_t hello[] = { PROTOCOL, PROTOCOL_FRAMES, LINE_END };
+	SimSerialSend(hello, sizeof(hello));
+	int length = ReadResponse();
+	CHECK(length == 3 && Response[0] == PROTOCOL_RETURN && Response[1] == PROTOCOL_FRAMES,
+			"protocol reply %d bytes: 0x%02x 0x%02x", length, Response[0], Response[1]);
+
+	CheckFramePosition(0x80, GET_POS, POS_RETURN, 1200, 40);
+
+	// Positions take two bytes, and the whole of a moveAbs fits in 13
+	uint8_t wire[64];
+	position positions[4] = { 1000, 0, 0, 0 };
+	length = BuildFrame(wire, 0, MOVE_ABS, 4, positions);
+	CHECK(length <= 13, "moveAbs is %d bytes framed", length);
+
+	// Sending a command again with the same sequence bit (because the reply
+	// didn't make it) just gets the reply again
+	positions[0] = -200;
+	positions[1] = -40;
+	Pulses = 0;
+	SendFrame(0, MOVE_REL, 4, positions);
+	CheckFrameReply(0, MOVE_REL_RETURN, 3);
+	CHECK(Reply[1] == SUCCESS, "framed move failed");
+	SendFrame(0, MOVE_REL, 4, positions);
+	CheckFrameReply(0, MOVE_REL_RETURN, 3);
+	CheckFramePosition(0x80, GET_TARGET, TARGET_RETURN, 1000, 0);
+
+	// Corrupted frames are rejected, and nothing happens until they're sent
+	// again intact
+	positions[0] = 300;
+	positions[1] = 300;
+	length = BuildFrame(wire, 0, MOVE_ABS, 4, positions);
+	wire[3] ^= 0x10;
+	SimSerialSend(wire, length);
+	CheckFrameReply(0, FRAME_ERROR, 1);
+	CheckFramePosition(0, GET_TARGET, TARGET_RETURN, 1000, 0);
+	// Losing the end of a frame loses that frame, not the one after it too
+	SimSerialSend(wire, 4);
+	uint8_t end = FRAME_END;
+	SimSerialSend(&end, 1);
+	CheckFrameReply(0, FRAME_ERROR, 1);
+	SendFrame(0x80, MOVE_ABS, 4, positions);
+	CheckFrameReply(0x80, MOVE_ABS_RETURN, 3);
+	CheckFramePosition(0, GET_TARGET, TARGET_RETURN, 300, 300);
+
+	// Commands that don't reply in lines are acknowledged
+	SendFrame(0x80, START, 0, NULL);
+	CheckFrameReply(0x80, FRAME_ACK, 1);
+
+	// Back 200 steps, then 700 to 300
+	PulsesWanted = 900;
+	CHECK(SimRunUntil(PulsesDone, 2 * F_CPU), "only %u of 900 steps after 2s", Pulses);
+	SimRun(F_CPU / 100);
+	CheckFramePosition(0, GET_POS, POS_RETURN, 300, 300);
+
+	// A batch is one frame and one reply. Batches stop being queued once the
+	// queue's full, and the reply says how many were
+	int accepted = 0;
+	uint8_t sequence = 0x80;
+	for (int batch = 0; batch < 4; batch++) {
+		uint8_t frame[128];
+		int length = 0;
+		frame[length++] = MOVE_BATCH | sequence;
+		frame[length++] = (15 << 4) | 0x01;
+		for (int i = 0; i < 15; i++) {
+			position segment[4] = { 0, 10, 0, 0 };
+			for (int axis = 0; axis < 4; axis++) {
+				frame[length++] = (uint8_t) (segment[axis] >> 8);
+				frame[length++] = (uint8_t) segment[axis];
+			}
+		}
+		SimSerialSend(wire, EncodeFrame(wire, frame, length));
+		CheckFrameReply(sequence, MOVE_BATCH_RETURN, 3);
+		accepted += Reply[1] >> 4;
+		sequence ^= 0x80;
+	}
+	CHECK(accepted >= 31 && accepted < 60, "%d of 60 batched movements queued", accepted);
+	CheckFramePosition(sequence, GET_TARGET, TARGET_RETURN, 300, 300 + 10 * accepted);
+	sequence ^= 0x80;
+	SimRun(2 * F_CPU);
+	CheckFramePosition(sequence, GET_POS, POS_RETURN, 300, 300 + 10 * accepted);
+	position y = 300 + 10 * accepted;
+
+	// Back to lines: the reply's still a frame
+	uint8_t goodbye[4] = { PROTOCOL | 0x80, PROTOCOL_LINES };
+	SimSerialSend(wire, EncodeFrame(wire, goodbye, 2));
+	CheckFrameReply(0x80, PROTOCOL_RETURN, 2);
+	CHECK(Reply[1] == PROTOCOL_LINES, "switched to protocol %u", Reply[1]);
+	CheckPosition(GET_POS, POS_RETURN, 300, y, 0, 0);
+
+	// Batches work in lines too
+	uint8_t line[64];
+	length = 0;
+	line[length++] = MOVE_BATCH;
+	line[length++] = 3 << 4;
+	position batch[3][4] = { { 400, 0, 0, 0 }, { 400, 100, 0, 0 }, { 0, 0, 0, 0 } };
+	for (int i = 0; i < 3; i++) {
+		for (int axis = 0; axis < 4; axis++) { length += EncodePosition(&line[length], batch[i][axis]); }
+	}
+	line[length++] = LINE_END;
+	SimSerialSend(line, length);
+	length = ReadResponse();
+	CHECK(length == 3 && Response[0] == MOVE_BATCH_RETURN && Response[1] == 3 << 4,
+			"batch reply %d bytes: 0x%02x 0x%02x", length, Response[0], Response[1]);
+	SimRun(2 * F_CPU);
+	CheckPosition(GET_POS, POS_RETURN, 0, 0, 0, 0);
+}
+
+// Position updates pushed by the firmware, and when each finished arriving
+static position Updates[256];
+static uint64_t UpdateTimes[256];
+static int UpdateCount;
+static uint8_t UpdateLine[32];
+static int UpdateLineLength;
+static void CollectUpdates(uint64_t cycles) {
+	for (uint64_t end = SimCycles() + cycles; SimCycles() < end; ) {
+		SimRun(F_CPU / 10000);
+		uint8_t b;
+		while (SimSerialReceive(&b, 1)) {
+			if (b != LINE_END) {
+				if (UpdateLineLength < (int) sizeof(UpdateLine)) { UpdateLine[UpdateLineLength++] = b; }
+				continue;
+			}
+			if (UpdateLineLength == 13 && UpdateLine[0] == POS_UPDATE && UpdateCount < 256) {
+				UpdateTimes[UpdateCount] = SimCycles();
+				Updates[UpdateCount++] = DecodePosition(&UpdateLine[1]);
+			}
+			UpdateLineLength = 0;
+		}
+	}
+}
+
+// Subscribing to the position gets it pushed while it changes, no more often
+// than asked
+static void CheckTelemetry(void) {
+	position period = 20;
+	SendCommand(SUBSCRIBE, 1, &period);
+	UpdateCount = 0;
+	CollectUpdates(F_CPU / 100);
+	CHECK(UpdateCount == 1 && Updates[0] == 0, "%d updates on subscribing, at %d", UpdateCount, Updates[0]);
+
+	// Nothing more while we're not moving
+	CollectUpdates(F_CPU / 10);
+	CHECK(UpdateCount == 1, "%d updates while stationary", UpdateCount);
+
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 400, 0, 0, 0);
+	UpdateCount = 0;
+	CollectUpdates(F_CPU);
+	// The movement takes about 0.63s
+	CHECK(UpdateCount >= 28 && UpdateCount <= 33, "%d updates while moving", UpdateCount);
+	uint64_t shortest = UINT64_MAX;
+	for (int i = 1; i < UpdateCount; i++) {
+		CHECK(Updates[i] > Updates[i - 1], "update %d went from %d to %d", i, Updates[i - 1], Updates[i]);
+		if (UpdateTimes[i] - UpdateTimes[i - 1] < shortest) { shortest = UpdateTimes[i] - UpdateTimes[i - 1]; }
+	}
+	CHECK(shortest >= F_CPU / 1000 * 19, "updates only %llu cycles apart", (unsigned long long) shortest);
+	CHECK(UpdateCount > 0 && Updates[UpdateCount - 1] == 400, "last update at %d", Updates[UpdateCount - 1]);
+
+	// Unsubscribing stops them
+	period = 0;
+	SendCommand(SUBSCRIBE, 1, &period);
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 0, 0, 0, 0);
+	UpdateCount = 0;
+	CollectUpdates(F_CPU);
+	CHECK(UpdateCount == 0, "%d updates after unsubscribing", UpdateCount);
+	CheckPosition(GET_POS, POS_RETURN, 0, 0, 0, 0);
+}
+
+// Build and send a frame in PROTOCOL_UNITS, with count positions in Q16.16
+// millimetres and degrees
+static void SendUnitsFrame(uint8_t sequence, uint8_t command, int count, fixed *values) {
+	uint8_t frame[32], wire[48];
+	int length = 0;
+	frame[length++] = command | sequence;
+	for (int i = 0; i < count; i++) {
+		for (int shift = 24; shift >= 0; shift -= 8) { frame[length++] = (uint8_t) (values[i] >> shift); }
+	}
+	SimSerialSend(wire, EncodeFrame(wire, frame, length));
+}
+
+static fixed Millimetres(int32_t steps) { return (fixed) llround(steps * 65536.0 / STEPS_PER_MM); }
+static fixed Degrees(int32_t steps) { return (fixed) llround(steps * 65536.0 / STEPS_PER_DEGREE); }
+
+// Ask for a position in PROTOCOL_UNITS, and check it's the passed steps to
+// within the last bit
+static void CheckUnitsPosition(uint8_t sequence, uint8_t command, uint8_t reply, int32_t x, int32_t y, int32_t theta) {
+	SendUnitsFrame(sequence, command, 0, NULL);
+	int length = ReadFrameReply();
+	CHECK(length == 17 && Reply[0] == (reply | sequence), "units position reply %d bytes, opcode 0x%02x", length, Reply[0]);
+	if (length != 17) { return; }
+	fixed wanted[4] = { Millimetres(x), Millimetres(y), Degrees(theta), 0 };
+	for (int axis = 0; axis < 4; axis++) {
+		uint8_t *data = &Reply[1 + 4 * axis];
+		fixed got = (fixed) (((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | (data[2] << 8) | data[3]);
+		CHECK(labs(got - wanted[axis]) <= 1, "command 0x%02x: axis %d at 0x%08x, wanted 0x%08x", command, axis,
+				(unsigned) got, (unsigned) wanted[axis]);
+	}
+}
+
+static void CheckUnitsMove(uint8_t sequence, uint8_t command, uint8_t reply, fixed x, fixed y, fixed theta, uint8_t result) {
+	fixed values[4] = { x, y, theta, 0 };
+	SendUnitsFrame(sequence, command, 4, values);
+	int length = ReadFrameReply();
+	CHECK(length == 3 && Reply[0] == (reply | sequence) && Reply[1] == result,
+			"units move reply %d bytes: 0x%02x 0x%02x", length, Reply[0], Reply[1]);
+}
+
+// Positions in millimetres and degrees, finer than a step. Relative movements
+// add up to the distance asked for, rather than each rounding to a whole step
+static void CheckUnits(void) {
+	// Hosts asking for a newer protocol than we have get the newest we have,
+	// told in lines
+	uint8_t hello[] = { PROTOCOL, 5, LINE_END };
+	SimSerialSend(hello, sizeof(hello));
+	int length = ReadResponse();
+	CHECK(length == 3 && Response[0] == PROTOCOL_RETURN && Response[1] == PROTOCOL_UNITS,
+			"protocol reply %d bytes: 0x%02x 0x%02x", length, Response[0], Response[1]);
+	CheckUnitsPosition(0x80, GET_POS, POS_RETURN, 1200, 40, 0);
+
+	// Eight lots of one and a half steps on X, and two and a half on theta
+	uint8_t sequence = 0;
+	for (int i = 0; i < 8; i++) {
+		CheckUnitsMove(sequence, MOVE_REL, MOVE_REL_RETURN, (fixed) (0.01875 * 65536), 0, (fixed) (0.25 * 65536), SUCCESS);
+		sequence ^= 0x80;
+	}
+	CheckUnitsPosition(sequence, GET_TARGET, TARGET_RETURN, 1212, 40, 20);
+	sequence ^= 0x80;
+
+	// 500mm is further than a position goes
+	CheckUnitsMove(sequence, MOVE_ABS, MOVE_ABS_RETURN, 500 << FIXED_SHIFT, 0, 0, FAILURE);
+	sequence ^= 0x80;
+	CheckUnitsPosition(sequence, GET_TARGET, TARGET_RETURN, 1212, 40, 20);
+	sequence ^= 0x80;
+
+	CheckUnitsMove(sequence, MOVE_ABS, MOVE_ABS_RETURN, 15 << FIXED_SHIFT, 1 << (FIXED_SHIFT - 1), 0, SUCCESS);
+	sequence ^= 0x80;
+	SimRun(F_CPU);
+	CheckUnitsPosition(sequence, GET_POS, POS_RETURN, 1200, 40, 0);
+	sequence ^= 0x80;
+
+	// Stopping leaves the end of the queue on a whole step, so what rounding
+	// left of a movement before it isn't carried into the next: two lots of
+	// five sixteenths of a step either side of a STOP go nowhere
+	CheckUnitsMove(sequence, MOVE_REL, MOVE_REL_RETURN, 256, 0, 0, SUCCESS);
+	sequence ^= 0x80;
+	SendUnitsFrame(sequence, STOP, 0, NULL);
+	CheckFrameReply(sequence, FRAME_ACK, 1);
+	sequence ^= 0x80;
+	CheckUnitsMove(sequence, MOVE_REL, MOVE_REL_RETURN, 256, 0, 0, SUCCESS);
+	sequence ^= 0x80;
+	CheckUnitsPosition(sequence, GET_TARGET, TARGET_RETURN, 1200, 40, 0);
+	sequence ^= 0x80;
+
+	uint8_t goodbye[4] = { PROTOCOL | sequence, PROTOCOL_LINES };
+	uint8_t wire[16];
+	SimSerialSend(wire, EncodeFrame(wire, goodbye, 2));
+	CheckFrameReply(sequence, PROTOCOL_RETURN, 2);
+	CheckPosition(GET_POS, POS_RETURN, 1200, 40, 0, 0);
+}
+
+// Read or change a setting (with command SET_PARAM, to value), checking the
+// reply says it worked as wanted and it's now wanted
+static void CheckParam(uint8_t sequence, uint8_t command, uint8_t param, uint32_t value, uint8_t result, uint32_t wanted) {
+	uint8_t frame[8] = { command | sequence, param };
+	int length = 2;
+	if (command == SET_PARAM) {
+		for (int shift = 24; shift >= 0; shift -= 8) { frame[length++] = (uint8_t) (value >> shift); }
+	}
+	uint8_t wire[16];
+	SimSerialSend(wire, EncodeFrame(wire, frame, length));
+	length = ReadFrameReply();
+	CHECK(length == 7 && Reply[0] == (PARAM_RETURN | sequence) && Reply[1] == param && Reply[2] == result,
+			"param 0x%02x reply %d bytes: 0x%02x 0x%02x 0x%02x", param, length, Reply[0], Reply[1], Reply[2]);
+	if (length != 7) { return; }
+	uint32_t got = ((uint32_t) Reply[3] << 24) | ((uint32_t) Reply[4] << 16) | (Reply[5] << 8) | Reply[6];
+	CHECK(got == wanted, "param 0x%02x is %u, wanted %u", param, got, wanted);
+}
+
+// Change settings at runtime: they should take effect on the next movement,
+// and be loaded again on the next boot
+static void CheckParams(void) {
+	// Settings can contain the end of a line, so lines don't get them
+	uint8_t line[] = { GET_PARAM, PARAM_MAX_VELOCITY + AXIS_X, LINE_END };
+	SimSerialSend(line, sizeof(line));
+	int length = ReadResponse();
+	CHECK(length == 8 && Response[0] == PARAM_RETURN && Response[2] == FAILURE,
+			"param reply in lines %d bytes: 0x%02x 0x%02x", length, Response[0], Response[2]);
+
+	uint8_t hello[] = { PROTOCOL, PROTOCOL_FRAMES, LINE_END };
+	SimSerialSend(hello, sizeof(hello));
+	ReadResponse();
+	uint8_t sequence = 0x80;
+	CheckParam(sequence, GET_PARAM, PARAM_MAX_VELOCITY + AXIS_X, 0, SUCCESS, 2000);
+	sequence ^= 0x80;
+	CheckParam(sequence, GET_PARAM, PARAM_HOME_BACK_OFF, 0, SUCCESS, 100);
+	sequence ^= 0x80;
+	CheckParam(sequence, GET_PARAM, 0x40, 0, FAILURE, 0);
+	sequence ^= 0x80;
+
+	// Out of range changes are refused, leaving things as they were
+	CheckParam(sequence, SET_PARAM, PARAM_MAX_VELOCITY + AXIS_X, 50000, FAILURE, 2000);
+	sequence ^= 0x80;
+	CheckParam(sequence, SET_PARAM, PARAM_SCALE + AXIS_Y, 1 << FIXED_SHIFT, FAILURE, 80 << FIXED_SHIFT);
+	sequence ^= 0x80;
+	CheckParam(sequence, SET_PARAM, PARAM_DIR_REVERSE, _BV(AXIS_THETA), FAILURE, 0);
+	sequence ^= 0x80;
+
+	// 400 steps at 400 steps/s takes at least a second
+	CheckParam(sequence, SET_PARAM, PARAM_MAX_VELOCITY + AXIS_X, 400, SUCCESS, 400);
+	sequence ^= 0x80;
+	position step[4] = { 400, 0, 0, 0 };
+	Pulses = 0;
+	SendFrame(sequence, MOVE_REL, 4, step);
+	CheckFrameReply(sequence, MOVE_REL_RETURN, 3);
+	sequence ^= 0x80;
+	PulsesWanted = 400;
+	CHECK(SimRunUntil(PulsesDone, 2 * F_CPU), "only %u of 400 steps after 2s", Pulses);
+	CHECK(PulseTimes[399] - PulseTimes[0] >= F_CPU * 399ULL / 400,
+			"400 steps took %llu cycles at 400 steps/s", (unsigned long long) (PulseTimes[399] - PulseTimes[0]));
+
+	// Reversed, X steps the other way for the same movement
+	CheckParam(sequence, SET_PARAM, PARAM_DIR_REVERSE, _BV(AXIS_X), SUCCESS, _BV(AXIS_X));
+	sequence ^= 0x80;
+	int32_t start = PhysicalX;
+	step[0] = -400;
+	SendFrame(sequence, MOVE_REL, 4, step);
+	CheckFrameReply(sequence, MOVE_REL_RETURN, 3);
+	sequence ^= 0x80;
+	SimRun(2 * F_CPU);
+	CHECK(PhysicalX == start + 400, "reversed X moved %d steps, wanted 400", PhysicalX - start);
+	CheckFramePosition(sequence, GET_POS, POS_RETURN, 0, 0);
+	sequence ^= 0x80;
+
+	// What's saved is what's loaded next time
+	ConfigInit();
+	CHECK(Config.MaxVelocity[AXIS_X] == 400 && Config.DirReverse == _BV(AXIS_X),
+			"loaded velocity %u, reversed 0x%02x", Config.MaxVelocity[AXIS_X], Config.DirReverse);
+
+	CheckParam(sequence, SET_PARAM, PARAM_DIR_REVERSE, 0, SUCCESS, 0);
+	sequence ^= 0x80;
+	CheckParam(sequence, SET_PARAM, PARAM_MAX_VELOCITY + AXIS_X, 2000, SUCCESS, 2000);
+	sequence ^= 0x80;
+
+	// Homing X leaves it at its latch position, which can be negative. Only X
+	// and Y home, so only they have one
+	CheckParam(sequence, GET_PARAM, PARAM_HOME_LATCH + AXIS_X, 0, SUCCESS, 0);
+	sequence ^= 0x80;
+	CheckParam(sequence, GET_PARAM, PARAM_HOME_LATCH + AXIS_THETA, 0, FAILURE, 0);
+	sequence ^= 0x80;
+	CheckParam(sequence, SET_PARAM, PARAM_HOME_LATCH + AXIS_X, (uint32_t) -30000, FAILURE, 0);
+	sequence ^= 0x80;
+	CheckParam(sequence, SET_PARAM, PARAM_HOME_LATCH + AXIS_X, (uint32_t) -50, SUCCESS, (uint32_t) -50);
+	sequence ^= 0x80;
+	SendFrame(sequence, HOME_X, 0, NULL);
+	CheckFrameReply(sequence, HOME_RETURN, 3);
+	sequence ^= 0x80;
+	SimRun(5 * F_CPU);
+	CHECK(PhysicalX == X_ENDSTOP, "homed X to %d, wanted the endstop at %d", PhysicalX, X_ENDSTOP);
+	CheckFramePosition(sequence, GET_POS, POS_RETURN, -50, 0);
+	sequence ^= 0x80;
+	CheckParam(sequence, SET_PARAM, PARAM_HOME_LATCH + AXIS_X, 0, SUCCESS, 0);
+	sequence ^= 0x80;
+	SendFrame(sequence, HOME_X, 0, NULL);
+	CheckFrameReply(sequence, HOME_RETURN, 3);
+	sequence ^= 0x80;
+	SimRun(5 * F_CPU);
+	CheckFramePosition(sequence, GET_POS, POS_RETURN, 0, 0);
+	sequence ^= 0x80;
+	uint8_t goodbye[4] = { PROTOCOL | sequence, PROTOCOL_LINES };
+	uint8_t wire[16];
+	SimSerialSend(wire, EncodeFrame(wire, goodbye, 2));
+	CheckFrameReply(sequence, PROTOCOL_RETURN, 2);
+}
+
+// Send a path command (with PATH_ADD, a keyframe duration ms after the last),
+// checking the reply says it worked as wanted and how many keyframes there are
+static void CheckPathCommand(uint8_t sequence, uint8_t command, int16_t duration, position *positions,
+		uint8_t result, uint8_t keyframes) {
+	position data[5] = { duration };
+	if (command == PATH_ADD) {
+		for (int axis = 0; axis < 4; axis++) { data[1 + axis] = positions[axis]; }
+	}
+	SendFrame(sequence, command, (command == PATH_ADD) ? 5 : 0, data);
+	int length = ReadFrameReply();
+	CHECK(length == 3 && Reply[0] == (PATH_RETURN | sequence) && Reply[1] == result && Reply[2] == keyframes,
+			"path command 0x%02x reply %d bytes: 0x%02x 0x%02x %d keyframes", command, length, Reply[0], Reply[1], Reply[2]);
+}
+
+// Follow a path through keyframes a second apart: it should pass through
+// each of them on time, without stopping in between
+static void CheckPath(void) {
+	uint8_t hello[] = { PROTOCOL, PROTOCOL_FRAMES, LINE_END };
+	SimSerialSend(hello, sizeof(hello));
+	ReadResponse();
+	uint8_t sequence = 0x80;
+
+	position keyframes[4][4] = { { 0, 0, 0, 0 }, { 400, 100, 0, 0 }, { 200, 300, 0, 0 }, { 0, 0, 0, 0 } };
+	CheckPathCommand(sequence, PATH_CLEAR, 0, NULL, SUCCESS, 0);
+	sequence ^= 0x80;
+	CheckPathCommand(sequence, PATH_RUN, 0, NULL, FAILURE, 0);
+	sequence ^= 0x80;
+	for (int i = 0; i < 4; i++) {
+		CheckPathCommand(sequence, PATH_ADD, 1000, keyframes[i], SUCCESS, i + 1);
+		sequence ^= 0x80;
+	}
+	// Keyframes have to come after the one before
+	CheckPathCommand(sequence, PATH_ADD, 0, keyframes[0], FAILURE, 4);
+	sequence ^= 0x80;
+
+	int32_t startX = PhysicalX, startY = PhysicalY;
+	CheckPathCommand(sequence, PATH_RUN, 0, NULL, SUCCESS, 4);
+	sequence ^= 0x80;
+	uint64_t start = SimCycles();
+	// The path has the queue to itself
+	position step[4] = { 10, 0, 0, 0 };
+	SendFrame(sequence, MOVE_REL, 4, step);
+	CHECK(ReadFrameReply() == 3 && Reply[1] == FAILURE, "moved while following a path");
+	sequence ^= 0x80;
+
+	// Where we are every 10ms, until we've been still for half a second
+	int32_t x[500], y[500];
+	int samples = 0, still = 0;
+	while (samples < 500 && still < 50) {
+		SimRun(start + (uint64_t) (samples + 1) * F_CPU / 100 - SimCycles());
+		x[samples] = PhysicalX - startX;
+		y[samples] = PhysicalY - startY;
+		still = (samples > 0 && x[samples] == x[samples - 1] && y[samples] == y[samples - 1]) ? still + 1 : 0;
+		samples++;
+	}
+	int finished = samples - still;
+	CHECK(finished >= 295 && finished <= 330, "path took %d0ms, wanted 3000ms", finished);
+	for (int i = 1; i < 3; i++) {
+		int32_t dx = x[100 * i - 1] - keyframes[i][0], dy = y[100 * i - 1] - keyframes[i][1];
+		CHECK(abs(dx) <= 20 && abs(dy) <= 20, "%dms into the path at (%d, %d), wanted (%d, %d)",
+				1000 * i, x[100 * i - 1], y[100 * i - 1], keyframes[i][0], keyframes[i][1]);
+	}
+	// Easing in and out, there can be more than 10ms between steps
+	int stops = 0;
+	for (int i = 20; i < finished - 20; i++) {
+		if (x[i] == x[i - 1] && y[i] == y[i - 1]) { stops++; }
+	}
+	CHECK(stops == 0, "stopped %d times along the path", stops);
+	CHECK(x[samples - 1] == 0 && y[samples - 1] == 0, "path ended at (%d, %d)", x[samples - 1], y[samples - 1]);
+
+	// Aborting stops the path, and movements work again
+	CheckPathCommand(sequence, PATH_RUN, 0, NULL, SUCCESS, 4);
+	sequence ^= 0x80;
+	SimRun(F_CPU / 2);
+	SendFrame(sequence, ABORT, 0, NULL);
+	CheckFrameReply(sequence, FRAME_ACK, 1);
+	sequence ^= 0x80;
+	SimRun(F_CPU);
+	position home[4] = { 0, 0, 0, 0 };
+	SendFrame(sequence, MOVE_ABS, 4, home);
+	CHECK(ReadFrameReply() == 3 && Reply[1] == SUCCESS, "couldn't move after aborting a path");
+	sequence ^= 0x80;
+	SimRun(F_CPU);
+	CheckFramePosition(sequence, GET_POS, POS_RETURN, 0, 0);
+	sequence ^= 0x80;
+
+	// Homing is refused while the path's running, like movements. Stopping
+	// stops the path as aborting does: nothing more is queued after it, and
+	// movements work again
+	CheckPathCommand(sequence, PATH_RUN, 0, NULL, SUCCESS, 4);
+	sequence ^= 0x80;
+	SimRun(F_CPU / 2);
+	SendFrame(sequence, HOME_X, 0, NULL);
+	CHECK(ReadFrameReply() == 3 && Reply[0] == (HOME_RETURN | sequence) && Reply[1] == AXIS_X && Reply[2] == FAILURE,
+			"home while following a path: 0x%02x axis %d 0x%02x", Reply[0], Reply[1], Reply[2]);
+	sequence ^= 0x80;
+	SendFrame(sequence, STOP, 0, NULL);
+	CheckFrameReply(sequence, FRAME_ACK, 1);
+	sequence ^= 0x80;
+	SimRun(F_CPU / 2);
+	int32_t stoppedX = PhysicalX, stoppedY = PhysicalY;
+	SimRun(F_CPU);
+	CHECK(PhysicalX == stoppedX && PhysicalY == stoppedY, "moved from (%d, %d) to (%d, %d) after stopping a path",
+			stoppedX, stoppedY, PhysicalX, PhysicalY);
+	SendFrame(sequence, MOVE_ABS, 4, home);
+	CHECK(ReadFrameReply() == 3 && Reply[1] == SUCCESS && Reply[2] == 30,
+			"move after stopping a path: 0x%02x with %d slots left", Reply[1], Reply[2]);
+	sequence ^= 0x80;
+	SimRun(F_CPU);
+	CheckFramePosition(sequence, GET_POS, POS_RETURN, 0, 0);
+	sequence ^= 0x80;
+
+	uint8_t goodbye[4] = { PROTOCOL | sequence, PROTOCOL_LINES };
+	uint8_t wire[16];
+	SimSerialSend(wire, EncodeFrame(wire, goodbye, 2));
+	CheckFrameReply(sequence, PROTOCOL_RETURN, 2);
+}
+
+// Ask for the device clock, checking it's the simulated time (ms) to within
+// the time the reply takes to send
+static uint32_t CheckTime(uint8_t sequence) {
+	SendFrame(sequence, TIME, 0, NULL);
+	int length = ReadFrameReply();
+	uint32_t now = (uint32_t) (SimCycles() / (F_CPU / 1000));
+	CHECK(length == 6 && Reply[0] == (TIME_RETURN | sequence) && Reply[1] == SUCCESS,
+			"time reply %d bytes: 0x%02x 0x%02x", length, Reply[0], Reply[1]);
+	uint32_t time = ((uint32_t) Reply[2] << 24) | ((uint32_t) Reply[3] << 16) | (Reply[4] << 8) | Reply[5];
+	CHECK(now - time <= 2, "device clock at %ums, simulated time %ums", time, now);
+	return time;
+}
+
+// Move to x at a time on the device clock, checking the reply says it worked
+// as wanted
+static void MoveAt(uint8_t sequence, uint32_t time, position x, uint8_t result) {
+	uint8_t frame[16] = { MOVE_AT | sequence, time >> 24, time >> 16, time >> 8, time, x >> 8, x };
+	uint8_t wire[32];
+	SimSerialSend(wire, EncodeFrame(wire, frame, 13));
+	int length = ReadFrameReply();
+	CHECK(length == 3 && Reply[0] == (MOVE_ABS_RETURN | sequence) && Reply[1] == result,
+			"move at %ums reply %d bytes: 0x%02x 0x%02x", time, length, Reply[0], Reply[1]);
+}
+
+// Start movements at times on the device clock: they should start within a
+// millisecond of it, with movements after them following on
+static void CheckSchedule(void) {
+	// The clock can contain the end of a line, so lines don't get it
+	uint8_t line[] = { TIME, LINE_END };
+	SimSerialSend(line, sizeof(line));
+	int length = ReadResponse();
+	CHECK(length == 7 && Response[0] == TIME_RETURN && Response[1] == FAILURE,
+			"time reply in lines %d bytes: 0x%02x 0x%02x", length, Response[0], Response[1]);
+
+	uint8_t hello[] = { PROTOCOL, PROTOCOL_FRAMES, LINE_END };
+	SimSerialSend(hello, sizeof(hello));
+	ReadResponse();
+	uint8_t sequence = 0x80;
+	uint32_t now = CheckTime(sequence);
+	sequence ^= 0x80;
+
+	// Only one movement can wait for its time at once
+	uint32_t at = now + 300;
+	Pulses = 0;
+	MoveAt(sequence, at, 100, SUCCESS);
+	sequence ^= 0x80;
+	MoveAt(sequence, at + 100, 200, FAILURE);
+	sequence ^= 0x80;
+	position step[4] = { 50, 0, 0, 0 };
+	SendFrame(sequence, MOVE_REL, 4, step);
+	CheckFrameReply(sequence, MOVE_REL_RETURN, 3);
+	sequence ^= 0x80;
+
+	PulsesWanted = 1;
+	CHECK(SimRunUntil(PulsesDone, F_CPU), "didn't start within a second");
+	double started = (double) PulseTimes[0] / (F_CPU / 1000);
+	CHECK(started >= at && started < at + 1, "started at %.2fms, wanted %ums", started, at);
+	PulsesWanted = 150;
+	CHECK(SimRunUntil(PulsesDone, F_CPU), "only %u of 150 steps after a second", Pulses);
+	SimRun(F_CPU / 10);
+	CheckFramePosition(sequence, GET_POS, POS_RETURN, 150, 0);
+	sequence ^= 0x80;
+
+	// Aborting cancels the wait
+	now = CheckTime(sequence);
+	sequence ^= 0x80;
+	MoveAt(sequence, now + 10000, 0, SUCCESS);
+	sequence ^= 0x80;
+	SendFrame(sequence, ABORT, 0, NULL);
+	CheckFrameReply(sequence, FRAME_ACK, 1);
+	sequence ^= 0x80;
+	position home[4] = { 0, 0, 0, 0 };
+	SendFrame(sequence, MOVE_ABS, 4, home);
+	CheckFrameReply(sequence, MOVE_ABS_RETURN, 3);
+	sequence ^= 0x80;
+	SimRun(F_CPU);
+	CheckFramePosition(sequence, GET_POS, POS_RETURN, 0, 0);
+	sequence ^= 0x80;
+
+	uint8_t goodbye[4] = { PROTOCOL | sequence, PROTOCOL_LINES };
+	uint8_t wire[16];
+	SimSerialSend(wire, EncodeFrame(wire, goodbye, 2));
+	CheckFrameReply(sequence, PROTOCOL_RETURN, 2);
+}
+
+// Stream movements as fast as the firmware has room for them: none should
+// fail, and the queue should never run dry, so we never stop
+static void CheckFlowControl(void) {
+	uint8_t hello[] = { PROTOCOL, PROTOCOL_FRAMES, LINE_END };
+	SimSerialSend(hello, sizeof(hello));
+	ReadResponse();
+	// The space's pushed as soon as we switch
+	QueueSpace = -1;
+	CheckFramePosition(0x80, GET_POS, POS_RETURN, 0, 0);
+	CHECK(QueueSpace == 31, "queue space %d", QueueSpace);
+
+	Pulses = 0;
+	int failures = 0, fewest = QueueSpace;
+	uint8_t sequence = 0;
+	position step[4] = { 10, 0, 0, 0 };
+	for (int i = 0; i < 60; i++) {
+		while (QueueSpace == 0) {
+			if (!ReadFrame()) { break; }
+		}
+		SendFrame(sequence, MOVE_REL, 4, step);
+		int length = ReadFrameReply();
+		if (length != 3 || Reply[0] != (MOVE_REL_RETURN | sequence) || Reply[1] != SUCCESS) { failures++; }
+		QueueSpace = Reply[2];
+		if (QueueSpace < fewest) { fewest = QueueSpace; }
+		sequence ^= 0x80;
+	}
+	CHECK(failures == 0, "%d of 60 streamed movements failed", failures);
+	CHECK(fewest == 0, "queue never filled up (space down to %d)", fewest);
+
+	PulsesWanted = 600;
+	CHECK(SimRunUntil(PulsesDone, 2 * F_CPU), "only %u of 600 steps after 2s", Pulses);
+	uint64_t longest = 0;
+	for (uint32_t i = 50; i < 550; i++) {
+		uint64_t gap = PulseTimes[i] - PulseTimes[i - 1];
+		if (gap > longest) { longest = gap; }
+	}
+	CHECK(longest < F_CPU / 500, "stalled for %llu cycles", (unsigned long long) longest);
+	SimRun(F_CPU / 100);
+	CheckFramePosition(sequence, GET_POS, POS_RETURN, 600, 0);
+}
+
+int main(void) {
+	SimPinHook = OnPinChange;
+	SimTWIHook = OnServoFrame;
+	SimTWIAddress = SERVO_ADDRESS;
+	SimBoot();
+
+	// 250k baud, and the step timer in CTC mode with a /64 prescaler
+	CHECK(UBRR0H == 0 && UBRR0L == 3, "UBRR0 is %u", (UBRR0H << 8) | UBRR0L);
+	CHECK((TCCR2A & (_BV(WGM21) | _BV(WGM20))) == _BV(WGM21), "Timer2 not in CTC mode");
+	CHECK((TCCR2B & 0x07) == _BV(CS22), "Timer2 prescaler bits %u", TCCR2B & 0x07);
+
+	CheckPosition(GET_POS, POS_RETURN, 0, 0, 0, 0);
+
+	// A single movement from rest: right number of steps, never faster than X
+	// can go, and it finishes
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 400, 0, 0, 0);
+	CheckPosition(GET_TARGET, TARGET_RETURN, 400, 0, 0, 0);
+	PulsesWanted = 400;
+	CHECK(SimRunUntil(PulsesDone, F_CPU), "only %u of 400 steps after 1s", Pulses);
+	uint64_t shortest = UINT64_MAX;
+	for (uint32_t i = 1; i < 400; i++) {
+		uint64_t gap = PulseTimes[i] - PulseTimes[i - 1];
+		if (gap < shortest) { shortest = gap; }
+	}
+	// 2000 steps/s, less a tick of rounding
+	CHECK(shortest + STEP_TIMER_PRESCALER >= F_CPU / 2000, "stepped %llu cycles apart", (unsigned long long) shortest);
+	// The first interval is timed from the first step, however long the timer's
+	// been running
+	profile p;
+	PlannerPrepare(&p, 400, 0, 2000, 0, 4000);
+	uint64_t wanted = (uint64_t) PlannerNextInterval(&p) * STEP_TIMER_PRESCALER;
+	uint64_t gap = PulseTimes[1] - PulseTimes[0];
+	CHECK(gap + STEP_TIMER_PRESCALER > wanted && gap < wanted + STEP_TIMER_PRESCALER,
+			"first interval %llu cycles, wanted %llu", (unsigned long long) gap, (unsigned long long) wanted);
+	SimRun(F_CPU / 100);
+	CHECK(Pulses == 400, "took %u steps, wanted 400", Pulses);
+	// Step pulses last 2us or more (without holding up the step ISR for that
+	// long), and all of them finish
+	CHECK(ShortestPulse >= F_CPU / 500000, "step pulse only %llu cycles", (unsigned long long) ShortestPulse);
+	CHECK(LongestPulse <= 2 * STEP_TIMER_PRESCALER, "step pulse %llu cycles", (unsigned long long) LongestPulse);
+	CHECK(SimISRStats[SIM_TIMER2_COMPA].MaxCycles < F_CPU / 500000, "step ISR took %u cycles",
+			SimISRStats[SIM_TIMER2_COMPA].MaxCycles);
+	CHECK(PORTB & _BV(X_STEP_PIN), "X step pin left low");
+	CheckPosition(GET_POS, POS_RETURN, 400, 0, 0, 0);
+
+	// Movements queued up while we're moving run into each other without
+	// stopping when they're in a straight line, so the gap between them is much
+	// shorter than the first step from rest
+	Pulses = 0;
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 500, 0, 0, 0);
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 800, 0, 0, 0);
+	Move(MOVE_ABS, MOVE_ABS_RETURN, 1100, 0, 0, 0);
+	PulsesWanted = 700;
+	CHECK(SimRunUntil(PulsesDone, 2 * F_CPU), "only %u of 700 steps after 2s", Pulses);
+	uint64_t first = PulseTimes[1] - PulseTimes[0];
+	uint64_t join = PulseTimes[400] - PulseTimes[399];
+	CHECK(join * 4 < first, "%llu cycles between movements, %llu for the first step",
+			(unsigned long long) join, (unsigned long long) first);
+	SimRun(F_CPU / 100);
+	CHECK(Pulses == 700, "took %u steps, wanted 700", Pulses);
+	CheckPosition(GET_POS, POS_RETURN, 1100, 0, 0, 0);
+
+	// Relative movements are from the end of the queue
+	Pulses = 0;
+	Move(MOVE_REL, MOVE_REL_RETURN, 50, 20, 0, 0);
+	Move(MOVE_REL, MOVE_REL_RETURN, 50, 20, 0, 0);
+	CheckPosition(GET_TARGET, TARGET_RETURN, 1200, 40, 0, 0);
+	PulsesWanted = 100;
+	CHECK(SimRunUntil(PulsesDone, F_CPU), "only %u of 100 steps after 1s", Pulses);
+	SimRun(F_CPU / 100);
+	CheckPosition(GET_POS, POS_RETURN, 1200, 40, 0, 0);
+
+	// A command cut short reads zeros rather than running on into the next
+	// one, and half a command waiting for the rest doesn't hold up stepping
+	position shortMove[1] = { 50 };
+	Pulses = 0;
+	SendCommand(MOVE_REL, 1, shortMove);
+	int length = ReadResponse();
+	CHECK(length == 3 && Response[0] == MOVE_REL_RETURN && Response[1] == SUCCESS,
+			"short move reply %d bytes: 0x%02x 0x%02x", length, Response[0], Response[1]);
+	uint8_t half[7] = { MOVE_ABS };
+	EncodePosition(&half[1], 1200);
+	EncodePosition(&half[4], 40);
+	SimSerialSend(half, sizeof(half));
+	PulsesWanted = 50;
+	CHECK(SimRunUntil(PulsesDone, F_CPU), "only %u of 50 steps after 1s", Pulses);
+	uint8_t rest[7];
+	EncodePosition(&rest[0], 0);
+	EncodePosition(&rest[3], 0);
+	rest[6] = LINE_END;
+	SimSerialSend(rest, sizeof(rest));
+	length = ReadResponse();
+	CHECK(length == 3 && Response[0] == MOVE_ABS_RETURN && Response[1] == SUCCESS,
+			"finished move reply %d bytes: 0x%02x 0x%02x", length, Response[0], Response[1]);
+	CheckPosition(GET_TARGET, TARGET_RETURN, 1200, 40, 0, 0);
+	PulsesWanted = 100;
+	CHECK(SimRunUntil(PulsesDone, F_CPU), "only %u of 100 steps after 1s", Pulses);
+	SimRun(F_CPU / 100);
+
+	CheckHoming();
+	CheckAbort(3200, 1000);
+	CheckAbort(1400, 150);
+	CheckServos();
+	CheckUnits();
+	CheckFrames();
+	CheckTelemetry();
+	CheckParams();
+	CheckPath();
+	CheckSchedule();
+	CheckFlowControl();
+
+	CHECK(SimSerialOverruns == 0, "%u bytes overran", SimSerialOverruns);
+	return TestReport("firmware");
+}
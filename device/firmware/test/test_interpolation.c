@@ -0,0 +1,146 @@
+/* ****************************************************************************
+   test_interpolation.c
+
+	 Checks the 4D Bresenham lines generated by Planner.c: every axis takes
+	 exactly the right number of steps, they all finish together, and no
+	 axis strays more than half a step from the ideal straight line
+
+	 Also checks the splines paths follow: each segment passes through its
+	 keyframes, stays within a step of the exact curve, and carries its
+	 velocity smoothly on into the next
+***************************************************************************** */
+
+#include <math.h>
+#include <stdlib.h>
+#include "stdbool.h"
+#include "Test.h"
+#include "../Planner.h"
+
+static void CheckLine(uint16_t distance[AXES]) {
+	line l;
+	PlannerLinePrepare(&l, distance);
+
+	uint16_t dominant = 0;
+	for (int axis = 0; axis < AXES; axis++) {
+		if (distance[axis] > dominant) { dominant = distance[axis]; }
+	}
+	CHECK(l.Steps == dominant, "line has %u ticks, dominant axis moves %u", l.Steps, dominant);
+
+	uint32_t taken[AXES] = {0, 0, 0, 0};
+	uint32_t lastStep[AXES] = {0, 0, 0, 0};
+	double maxDeviation = 0;
+	uint32_t ticks = 0;
+	uint8_t mask;
+	bool counted = true;
+	while (ticks < dominant) {
+		mask = PlannerLineStep(&l);
+		ticks++;
+		for (int axis = 0; axis < AXES; axis++) {
+			if (mask & (1 << axis)) {
+				taken[axis]++;
+				lastStep[axis] = ticks;
+			}
+			// Where this axis would be if it moved continuously along the line
+			double ideal = (double) distance[axis] * ticks / dominant;
+			double deviation = fabs(ideal - taken[axis]);
+			if (deviation > maxDeviation) { maxDeviation = deviation; }
+			if (PlannerLineAxisSteps(&l, axis, ticks) != taken[axis]) { counted = false; }
+		}
+	}
+	CHECK(counted, "steps worked out without stepping don't match (%u, %u, %u, %u)",
+			distance[0], distance[1], distance[2], distance[3]);
+	CHECK(PlannerLineStep(&l) == 0, "line still stepping after %u ticks", dominant);
+
+	for (int axis = 0; axis < AXES; axis++) {
+		CHECK(taken[axis] == distance[axis], "axis %d took %u steps, wanted %u", axis, taken[axis], distance[axis]);
+		// Every moving axis takes its last step within half of its own step
+		// period of the end, so they all arrive together
+		if (distance[axis] > 0) {
+			CHECK(dominant - lastStep[axis] <= dominant / (2 * distance[axis]),
+					"axis %d finished on tick %u of %u", axis, lastStep[axis], dominant);
+		}
+	}
+	CHECK(maxDeviation <= 0.5 + 1e-9, "deviated %.3f steps from the ideal line (%u, %u, %u, %u)",
+			maxDeviation, distance[0], distance[1], distance[2], distance[3]);
+}
+
+// Exact cubic Hermite segment (see PlannerHermite)
+static double Hermite(double p0, double p1, double t0, double t1, double s) {
+	double s2 = s * s, s3 = s2 * s;
+	return (2 * s3 - 3 * s2 + 1) * p0 + (s3 - 2 * s2 + s) * t0 + (-2 * s3 + 3 * s2) * p1 + (s3 - s2) * t1;
+}
+
+// A Catmull-Rom spline through keyframes at the passed positions, duration
+// ms apart, sampled every millisecond. Unless smooth is false (keyframes too
+// close together to be), the speed shouldn't jump through them
+static void CheckSpline(int32_t *keyframes, uint16_t *durations, int count, bool smooth) {
+	double maxError = 0, maxJump = 0;
+	bool throughKeyframes = true;
+	double lastVelocity = 0;
+	for (int i = 0; i + 1 < count; i++) {
+		uint16_t duration = durations[i + 1];
+		int32_t t0 = 0, t1 = 0;
+		if (i > 0) { t0 = PlannerCatmullRomTangent(keyframes[i - 1], keyframes[i + 1], durations[i] + duration, duration); }
+		if (i + 2 < count) { t1 = PlannerCatmullRomTangent(keyframes[i], keyframes[i + 2], duration + durations[i + 2], duration); }
+
+		int32_t previous = keyframes[i];
+		for (uint32_t ms = 1; ms <= duration; ms++) {
+			uint32_t s = (ms << SPLINE_SHIFT) / duration;
+			int32_t p = PlannerHermite(keyframes[i], keyframes[i + 1], t0, t1, s);
+			double exact = Hermite(keyframes[i], keyframes[i + 1], t0, t1, (double) s / (1 << SPLINE_SHIFT));
+			if (fabs(p - exact) > maxError) { maxError = fabs(p - exact); }
+			// Speed (steps/ms) either side of each keyframe
+			if (ms == 1 && i > 0) {
+				double jump = fabs((p - previous) - lastVelocity);
+				if (jump > maxJump) { maxJump = jump; }
+			}
+			if (ms == duration) {
+				lastVelocity = p - previous;
+				if (p != keyframes[i + 1]) { throughKeyframes = false; }
+			}
+			previous = p;
+		}
+		if (PlannerHermite(keyframes[i], keyframes[i + 1], t0, t1, 0) != keyframes[i]) { throughKeyframes = false; }
+	}
+	CHECK(throughKeyframes, "spline through %d keyframes missed one", count);
+	CHECK(maxError <= 0.5 + 1e-6, "spline strayed %.3f steps from the exact curve", maxError);
+	// Whole steps a millisecond apart can't be smoother than a couple of steps
+	CHECK(!smooth || maxJump <= 2, "speed jumped %.1f steps/ms through a keyframe", maxJump);
+}
+
+int main(void) {
+	// Stationary, single axis, and diagonal lines
+	uint16_t still[AXES] = {0, 0, 0, 0};
+	CheckLine(still);
+	uint16_t xOnly[AXES] = {100, 0, 0, 0};
+	CheckLine(xOnly);
+	uint16_t diagonal[AXES] = {100, 100, 0, 0};
+	CheckLine(diagonal);
+	uint16_t everything[AXES] = {1000, 999, 1, 500};
+	CheckLine(everything);
+
+	// Random 4D lines (fixed seed, so failures are reproducible)
+	srand(1);
+	for (int i = 0; i < 2000; i++) {
+		uint16_t distance[AXES];
+		uint16_t range = (i % 2) ? 50 : 20000;
+		for (int axis = 0; axis < AXES; axis++) {
+			distance[axis] = rand() % range;
+		}
+		CheckLine(distance);
+	}
+
+	// Splines: a dolly shot, uneven timing, a reversal, and the extremes of
+	// positions and durations
+	int32_t dolly[] = {0, 400, 1200, 1600};
+	uint16_t dollyDurations[] = {0, 1000, 1000, 1000};
+	CheckSpline(dolly, dollyDurations, 4, true);
+	int32_t uneven[] = {-300, 0, 50, 2000, 1990};
+	uint16_t unevenDurations[] = {0, 200, 3000, 700, 100};
+	CheckSpline(uneven, unevenDurations, 5, true);
+	int32_t extremes[] = {INT16_MIN, INT16_MAX, INT16_MIN, 0};
+	uint16_t extremeDurations[] = {0, 32767, 1, 32767};
+	CheckSpline(extremes, extremeDurations, 4, false);
+
+	return TestReport("interpolation");
+}
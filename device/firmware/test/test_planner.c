@@ -0,0 +1,250 @@
+/* ****************************************************************************
+   test_planner.c
+
+	 Checks the step interval sequences generated by Planner.c against the ideal
+	 continuous trapezoidal velocity profile, and the look-ahead planning of
+	 speeds between movements
+***************************************************************************** */
+
+#include <math.h>
+#include <stdlib.h>
+#include "stdbool.h"
+#include "Test.h"
+#include "../Planner.h"
+
+// Position (in steps) at time t of an ideal movement over distance steps,
+// accelerating at a up to velocity v then decelerating at a to a stop
+static double IdealPosition(double t, double distance, double v, double a) {
+	double accelDistance = v * v / (2 * a);
+	if (2 * accelDistance > distance) {
+		// Triangular: never reaches v
+		accelDistance = distance / 2;
+		v = sqrt(2 * a * accelDistance);
+	}
+	double accelTime = v / a;
+	double cruiseTime = (distance - 2 * accelDistance) / v;
+	double total = 2 * accelTime + cruiseTime;
+
+	if (t <= 0) { return 0; }
+	if (t < accelTime) { return a * t * t / 2; }
+	if (t < accelTime + cruiseTime) { return accelDistance + v * (t - accelTime); }
+	if (t < total) {
+		double remaining = total - t;
+		return distance - a * remaining * remaining / 2;
+	}
+	return distance;
+}
+
+static double IdealDuration(double distance, double v, double a) {
+	double accelDistance = v * v / (2 * a);
+	if (2 * accelDistance > distance) { return 2 * sqrt(distance / a); }
+	return 2 * v / a + (distance - 2 * accelDistance) / v;
+}
+
+static void CheckProfile(uint32_t steps, uint16_t velocity, uint16_t acceleration) {
+	profile p;
+	PlannerPrepare(&p, steps, 0, velocity, 0, acceleration);
+
+	// The first step is taken straight away; the profile then gives us each
+	// interval until the next one
+	uint32_t taken = 1;
+	uint64_t ticks = 0;
+	interval previous = 0;
+	interval minDelay = STEP_TIMER_FREQ / velocity;
+	double maxPositionError = 0;
+	bool monotonic;
+	uint32_t phaseChanges = 0;
+	int lastDirection = -1;
+	// AVR446 shortens the first interval to correct the ramp that follows, so
+	// the whole profile runs slightly ahead of the ideal one (and the mirrored
+	// deceleration ramp finishes the same amount early again)
+	double lead = (1 - 0.676) * sqrt(2.0 / acceleration);
+
+	interval i;
+	while ((i = PlannerNextInterval(&p)) != 0) {
+		ticks += i;
+		taken++;
+
+		// Never step faster than the maximum velocity
+		CHECK(i + 1 >= minDelay, "steps=%u: interval %u below cruise interval %u", steps, i, minDelay);
+
+		// Intervals only ever shrink, stay the same, then grow (ignoring the
+		// tick of jitter from rounding to whole ticks)
+		if (previous != 0) {
+			int direction = (i + 1 < previous) ? -1 : ((i > previous + 1) ? 1 : 0);
+			if (direction != 0 && direction != lastDirection) {
+				phaseChanges++;
+				lastDirection = direction;
+			}
+		}
+		previous = i;
+
+		// Compare against where an ideal profile would be by now
+		double t = (double) ticks / STEP_TIMER_FREQ + lead;
+		double error = fabs(IdealPosition(t, steps - 1, velocity, acceleration) - (taken - 1));
+		if (error > maxPositionError) { maxPositionError = error; }
+	}
+	monotonic = (phaseChanges <= 1);
+
+	double duration = (double) ticks / STEP_TIMER_FREQ;
+	double ideal = IdealDuration(steps - 1, velocity, acceleration);
+
+	CHECK(taken == steps, "steps=%u: took %u steps", steps, taken);
+	CHECK(p.Phase == PROFILE_DONE, "steps=%u: profile not finished", steps);
+	CHECK(monotonic, "steps=%u: intervals not accelerate/cruise/decelerate", steps);
+	CHECK(maxPositionError < 1.5, "steps=%u v=%u a=%u: %.2f steps from ideal profile",
+			steps, velocity, acceleration, maxPositionError);
+	CHECK(fabs(duration + 2 * lead - ideal) < 0.01 * ideal + lead,
+			"steps=%u v=%u a=%u: took %.4fs, ideal %.4fs", steps, velocity, acceleration, duration, ideal);
+}
+
+// A movement entering and leaving at speed should start and finish at those
+// speeds, without ever going over its maximum velocity
+static void CheckJunctionProfile(uint32_t steps, uint16_t entry, uint16_t velocity, uint16_t exit, uint16_t acceleration) {
+	profile p;
+	PlannerPrepare(&p, steps, entry, velocity, exit, acceleration);
+
+	interval minDelay = STEP_TIMER_FREQ / velocity;
+	interval first = PlannerEntryInterval(&p);
+	interval last = 0;
+	uint32_t taken = 1;
+	interval i;
+	while ((i = PlannerNextInterval(&p)) != 0) {
+		CHECK(i + 1 >= minDelay, "steps=%u: interval %u below cruise interval %u", steps, i, minDelay);
+		last = i;
+		taken++;
+	}
+	CHECK(taken == steps, "steps=%u: took %u steps", steps, taken);
+
+	double entryInterval = (double) STEP_TIMER_FREQ / entry;
+	double exitInterval = (double) STEP_TIMER_FREQ / exit;
+	CHECK(fabs(first - entryInterval) < 0.05 * entryInterval, "entering at %u ticks, wanted %.0f", first, entryInterval);
+	CHECK(fabs(last - exitInterval) < 0.05 * exitInterval, "leaving at %u ticks, wanted %.0f", last, exitInterval);
+}
+
+// Stopping part way through a movement slows straight down to a standstill,
+// never speeding up again (after the next interval, which was already worked
+// out), and takes about as many steps as it took to get up to speed
+static void CheckStop(uint32_t steps, uint16_t entry, uint16_t velocity, uint16_t exit, uint16_t acceleration, uint32_t stopAt) {
+	profile p;
+	PlannerPrepare(&p, steps, entry, velocity, exit, acceleration);
+	uint32_t taken = 1;
+	interval i = PlannerEntryInterval(&p);
+	while (taken < stopAt && (i = PlannerNextInterval(&p)) != 0) { taken++; }
+	double speed = (double) STEP_TIMER_FREQ / i;
+	uint32_t stopSteps = PlannerStopSteps(&p);
+	PlannerStop(&p);
+
+	uint32_t stoppedAt = taken;
+	interval previous = 0, last = i;
+	bool slowing = true;
+	while ((i = PlannerNextInterval(&p)) != 0) {
+		if (i + 1 < previous) { slowing = false; }
+		previous = last = i;
+		taken++;
+	}
+	CHECK(slowing, "steps=%u stopped at %u: sped up again", steps, stoppedAt);
+	CHECK(taken <= stopSteps && taken <= steps, "steps=%u stopped at %u: took %u steps, expected %u",
+			steps, stoppedAt, taken, stopSteps);
+	if (taken < steps) {
+		CHECK(taken - stoppedAt <= speed * speed / (2 * acceleration) + 4, "steps=%u stopped at %u: took %u steps to stop from %.0f steps/s",
+				steps, stoppedAt, taken - stoppedAt, speed);
+		double finalSpeed = (double) STEP_TIMER_FREQ / last;
+		CHECK(finalSpeed <= sqrt(2.0 * acceleration * 4), "steps=%u stopped at %u: still going %.0f steps/s",
+				steps, stoppedAt, finalSpeed);
+	}
+}
+
+// Fastest entry speeds for a queue of blocks, found by brute force: every
+// block has to be able to stop by the end of the queue, and the first block
+// starts at whatever speed it already has
+static void OptimalEntrySpeeds(plan_block *blocks, int count, uint32_t *optimal) {
+	for (int i = 0; i < count; i++) { optimal[i] = blocks[i].MaxEntrySpeedSqr; }
+	optimal[0] = blocks[0].EntrySpeedSqr;
+	uint32_t exit = 0;
+	for (int i = count - 1; i > 0; i--) {
+		if (exit + blocks[i].AccelDistance < optimal[i]) { optimal[i] = exit + blocks[i].AccelDistance; }
+		exit = optimal[i];
+	}
+	for (int i = 1; i < count; i++) {
+		if (optimal[i-1] + blocks[i-1].AccelDistance < optimal[i]) { optimal[i] = optimal[i-1] + blocks[i-1].AccelDistance; }
+	}
+}
+
+// Add blocks one at a time, checking the incremental look-ahead always ends up
+// with the same speeds as planning the whole queue from scratch
+static void CheckLookahead(void) {
+	plan_block blocks[16];
+	uint32_t optimal[16];
+	uint8_t planned = 0;
+
+	srand(2);
+	blocks[0].EntrySpeedSqr = 0;
+	blocks[0].MaxEntrySpeedSqr = 0;
+	blocks[0].AccelDistance = 2 * 2000 * (1 + rand() % 200);
+	for (int count = 1; count < 16; count++) {
+		if (count > 1) {
+			blocks[count-1].EntrySpeedSqr = 0;
+			blocks[count-1].MaxEntrySpeedSqr = (uint32_t) (rand() % 1000) * (rand() % 1000);
+			blocks[count-1].AccelDistance = 2 * 2000 * (1 + rand() % 200);
+		}
+		planned = PlannerRecalculate(blocks, 15, planned, count);
+		OptimalEntrySpeeds(blocks, count, optimal);
+
+		for (int i = 0; i < count; i++) {
+			CHECK(blocks[i].EntrySpeedSqr == optimal[i], "%d blocks: block %d enters at %u, optimal %u",
+					count, i, blocks[i].EntrySpeedSqr, optimal[i]);
+		}
+		CHECK(planned < count, "planned index %u past the %d blocks", planned, count);
+	}
+}
+
+int main(void) {
+	// Stationary and single-step movements
+	profile p;
+	PlannerPrepare(&p, 0, 0, 1000, 0, 2000);
+	CHECK(PlannerNextInterval(&p) == 0, "zero step movement should finish immediately");
+	PlannerPrepare(&p, 1, 0, 1000, 0, 2000);
+	CHECK(PlannerNextInterval(&p) == 0, "one step movement should finish after one step");
+
+	// Triangular profiles (too short to reach maximum velocity)
+	CheckProfile(2, 1000, 2000);
+	CheckProfile(10, 1000, 2000);
+	CheckProfile(200, 2000, 2000);
+	// Trapezoidal profiles
+	CheckProfile(1000, 1000, 2000);
+	CheckProfile(5000, 2000, 4000);
+	CheckProfile(20000, 3000, 8000);
+	// Acceleration high enough to start at cruise velocity
+	CheckProfile(500, 200, 60000);
+
+	// Movements following on from each other without stopping
+	CheckJunctionProfile(1000, 500, 1000, 500, 2000);
+	CheckJunctionProfile(1000, 200, 1000, 800, 2000);
+	CheckJunctionProfile(300, 900, 1000, 100, 2000);
+	CheckJunctionProfile(1000, 1000, 1000, 1000, 2000);
+
+	// Stopping while accelerating, cruising, decelerating, and when it's too
+	// late to stop before the end
+	CheckStop(5000, 0, 2000, 0, 4000, 100);
+	CheckStop(5000, 0, 2000, 0, 4000, 2000);
+	CheckStop(5000, 0, 2000, 0, 4000, 4700);
+	CheckStop(1000, 1000, 2000, 1000, 4000, 2);
+	CheckStop(1000, 1000, 1000, 1000, 2000, 600);
+	CheckStop(1000, 1000, 1000, 1000, 2000, 990);
+	for (uint32_t at = 1; at < 200; at += 7) { CheckStop(200, 0, 2000, 0, 2000, at); }
+
+	// Corners
+	float east[AXES] = {1, 0, 0, 0};
+	float north[AXES] = {0, 1, 0, 0};
+	float west[AXES] = {-1, 0, 0, 0};
+	float northEast[AXES] = {0.7071, 0.7071, 0, 0};
+	CHECK(PlannerJunctionSpeedSqr(east, east, 2000) == UINT32_MAX, "straight on should be unlimited");
+	CHECK(PlannerJunctionSpeedSqr(east, west, 2000) == 0, "reversing should stop");
+	CHECK(PlannerJunctionSpeedSqr(east, northEast, 2000) > PlannerJunctionSpeedSqr(east, north, 2000),
+			"gentle corners should be faster than right angles");
+
+	CheckLookahead();
+
+	return TestReport("planner");
+}
@@ -19,8 +19,23 @@
 #define TILT_PIN 5
 #define PAN_PIN 6
 
-// Arbitrary, but make sure it matches on the master
-#define I2C_ADDRESS 0
+// Arbitrary, but make sure it matches on the master (see Servo.c). Address 0
+// is the general call address, which every slave answers
+#define I2C_ADDRESS 0x08
+
+// Servo numbers in frames
+#define PAN_SERVO 0
+#define TILT_SERVO 1
+
+// Each servo in a frame takes its number and a 2-byte pulse width, after the
+// sequence number
+#define FRAME_HEADER 1
+#define FRAME_SERVO 3
+#define FRAME_MAX (FRAME_HEADER + 2 * FRAME_SERVO)
+
+// After this long without a frame (ms), take whatever sequence number comes
+// next, so we pick up again after the master resets
+#define SEQUENCE_TIMEOUT 500
 
 // Notification LED
 #define LED_PIN 13
@@ -29,6 +44,11 @@
 Servo tiltServo;
 Servo panServo;
 
+// Sequence number of the last frame we acted on, and when it came
+byte lastSequence;
+unsigned long lastFrame;
+bool haveSequence = false;
+
 void setup() {
   // Initialise servos
   tiltServo.attach(TILT_PIN);
@@ -47,44 +67,50 @@ void loop() {
   delay(100);
 }
 
-// Called whenever we receive I2C data. Data formatted into 2-byte
-// commands. For now (TODO) we require both bytes to be sent simultaneously
-// and not with any other data.
-// Bit 0: 0 for tilt servo, 1 for pan servo
-// Bits 1-12: number of microseconds to move servo to
+// Called whenever we receive I2C data. Each frame is:
+// Byte 0: sequence number, one more than the frame before
+// Then for each servo, 3 bytes:
+//   Byte 0: servo number (PAN_SERVO or TILT_SERVO)
+//   Bytes 1-2: number of microseconds to move servo to, most significant
+//   byte first
+// The master streams a frame every 20ms as it moves, so we just jump each
+// servo to where it says. Frames we've already had (or older ones) are
+// ignored, as are malformed ones: the next frame will be along soon.
 void receiveDataEvent(int numBytes) {
-  if (numBytes == 2) {
-    byte b1 = Wire.read();
-    byte b2 = Wire.read();
-    
-    // int is 16-bit signed (vs. standard 8-bit 'unsigned' byte)
-    // Want bits 1 through 7 of byte 0, and bits 0 through 4 of byte 1
-    // 0b11111000 = 0xF8
-    // 0b10000000 = 0x7F
-    int value = ((b1 & 0x7F) << 5) | ((b2 & 0xF8) >> 3);
-    byte address = (b1 >> 7);
-    
-    // Toggle LED
-    digitalWrite(LED_PIN, !digitalRead(LED_PIN));
+  byte frame[FRAME_MAX];
+  int length = 0;
+  while (Wire.available()) {
+    byte data = Wire.read();
+    if (length < FRAME_MAX) {
+      frame[length] = data;
+    }
+    length++;
+  }
+  if (length > FRAME_MAX || length < FRAME_HEADER + FRAME_SERVO || (length - FRAME_HEADER) % FRAME_SERVO != 0) {
+    return;
+  }
+
+  // Only ever move forwards through the sequence (comparing the difference
+  // as signed, so it wraps around)
+  unsigned long now = millis();
+  byte sequence = frame[0];
+  if (haveSequence && now - lastFrame < SEQUENCE_TIMEOUT && (signed char) (sequence - lastSequence) <= 0) {
+    return;
+  }
+  haveSequence = true;
+  lastSequence = sequence;
+  lastFrame = now;
+
+  // Toggle LED
+  digitalWrite(LED_PIN, !digitalRead(LED_PIN));
 
+  for (int i = FRAME_HEADER; i < length; i += FRAME_SERVO) {
+    int value = (frame[i + 1] << 8) | frame[i + 2];
     // Move required servo, capping at min/max values for that servo
-    if (address) {
-      if (value < TILT_MIN) {
-        value = TILT_MIN;
-      } else if (value > TILT_MAX) {
-        value = TILT_MAX;
-      }
-      tiltServo.writeMicroseconds(value);
-    } else {
-      if (value < PAN_MIN) {
-        value = PAN_MIN;
-      } else if (value > PAN_MAX) {
-        value = PAN_MAX;
-      }
-      panServo.writeMicroseconds(value);
+    if (frame[i] == TILT_SERVO) {
+      tiltServo.writeMicroseconds(constrain(value, TILT_MIN, TILT_MAX));
+    } else if (frame[i] == PAN_SERVO) {
+      panServo.writeMicroseconds(constrain(value, PAN_MIN, PAN_MAX));
     }
-  } else {
-    // TODO: Handle the error case here
-    // Can we really do anything without implementing (needlessly) bidirectional comms?
   }
 }
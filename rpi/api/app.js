@@ -10,53 +10,24 @@ function log(msg) {
 	}
 }
 
-// All our different commands
-var commands = require('./command.js').commands;
-
-// Setup serial port
-var util = require("util");
-var serialport = require("serialport");
-var SerialPort = serialport.SerialPort;
-// Data returned as raw hex characters, with each line split by a newline (0x0D)
-var serialPort = new SerialPort("/dev/tty.usbmodem1421", {
-	baudrate: 250000,
-	parity: 'odd',
-	parser: serialport.parsers.readline("0d", "hex")
+// Every rig plugged into this Pi, from devices.json (or the file
+// HOLOCAM_DEVICES names): each is {name, port, baudrate}. Users of each connect
+// to the socket.io namespace /<name>. The first also has the default
+// namespace, so clients that only know about one rig still work
+var Device = require('./device.js').Device;
+var config = require(process.env.HOLOCAM_DEVICES || './devices.json');
+var devices = config.devices.map(function(device, i) {
+	var namespaces = [io.of('/' + device.name)];
+	if (i == 0) { namespaces.push(io.of('/')); }
+	return new Device(device, namespaces, log);
 });
 
-serialPort.on("open", function() {
-	log("serial open");
-
-	// Setup socket
-	io.on('connection', function(socket) {
-		log('socket connected');
-
-		// Bind each of our commands to transmit from web to arduino
-		commands.forEach(function(command) {
-			command.bindTransmit(socket, serialPort, undefined, log);
-		});
-
-		// Repeatedly request the current position
-		// TODO: Is repeated polling really the best way to do this
-		setInterval(function() {
-			require('./command.js').currentPosition.transmit(undefined, log);
-		}, 100);
-	});
-
-	// When we receive data from the serial port
-	serialPort.on('data', function(data) {
-		// Pass it into each of our commands, and they'll handle the rest
-		// TODO: Pass in callback for errors
-		commands.forEach(function(command) {
-			var output = command.receive(data, serialPort, io, log);
-			if (output != false && output != -1 && typeof(output) != 'undefined')  {
-				io.emit(command.receiveSlug, output);
-			}
-		});
-	});
+// Which rigs there are, so clients know which namespaces to connect to
+app.get('/devices', function(req, res) {
+	res.json(devices.map(function(device) { return device.name; }));
 });
 
 // Listen on port 3001
 http.listen(3001, '0.0.0.0', function() {
-	console.log("Listening on 0.0.0.0:3001");
+	console.log("Listening on 0.0.0.0:3001 for " + devices.map(function(d) { return d.name; }).join(", "));
 });
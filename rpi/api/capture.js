@@ -0,0 +1,91 @@
+// Records a serial port's traffic both ways to a file (a device in
+// devices.json with "capture": a path), each chunk with when it was written or
+// read, so it can be replayed later (see virtualdevice.js) or picked through:
+//
+//   node capture.js <file>
+//
+// prints it. The file's MAGIC, then a record for each chunk: its direction
+// (TO_DEVICE or FROM_DEVICE), the time since the record before (µs, BE uint32),
+// its length (BE uint16), then its bytes.
+var fs = require('fs');
+
+var MAGIC = new Buffer('HCAP1');
+var TO_DEVICE = 0;
+var FROM_DEVICE = 1;
+var HEADER = 7;
+var MAX_CHUNK = 0xFFFF;
+
+function Capture(path) {
+	this.stream = fs.createWriteStream(path);
+	this.stream.write(MAGIC);
+	this.last = process.hrtime();
+}
+
+// Record everything written to and read from a serial port from now on
+Capture.prototype.attach = function(sp) {
+	var write = sp.write;
+	sp.write = function(data) {
+		this.record(TO_DEVICE, data);
+		return write.apply(sp, arguments);
+	}.bind(this);
+	sp.on('data', this.record.bind(this, FROM_DEVICE));
+}
+
+Capture.prototype.record = function(direction, data) {
+	if (!Buffer.isBuffer(data)) { data = new Buffer(data); }
+	var elapsed = process.hrtime(this.last);
+	this.last = process.hrtime();
+	var micros = Math.min(0xFFFFFFFF, elapsed[0] * 1e6 + Math.round(elapsed[1] / 1e3));
+	// Chunks are never near MAX_CHUNK long, but in case, split them up
+	var start = 0;
+	do {
+		var chunk = data.slice(start, start + MAX_CHUNK);
+		var record = new Buffer(HEADER + chunk.length);
+		record[0] = direction;
+		record.writeUInt32BE(micros, 1);
+		record.writeUInt16BE(chunk.length, 5);
+		chunk.copy(record, HEADER);
+		this.stream.write(record);
+		start += MAX_CHUNK;
+		micros = 0;
+	} while (start < data.length);
+}
+
+Capture.prototype.close = function() {
+	this.stream.end();
+}
+
+// Read a capture back, as a list of {direction, delay (ms since the record
+// before), data}
+var read = function(path) {
+	var file = fs.readFileSync(path);
+	if (file.length < MAGIC.length || file.slice(0, MAGIC.length).toString() != MAGIC.toString()) {
+		throw new Error(path + " isn't a capture");
+	}
+	var records = [];
+	var i = MAGIC.length;
+	while (i + HEADER <= file.length) {
+		var length = file.readUInt16BE(i + 5);
+		if (i + HEADER + length > file.length) { break; }
+		records.push({
+			direction: file[i],
+			delay: file.readUInt32BE(i + 1) / 1000,
+			data: file.slice(i + HEADER, i + HEADER + length)
+		});
+		i += HEADER + length;
+	}
+	return records;
+}
+
+exports.Capture = Capture;
+exports.read = read;
+exports.TO_DEVICE = TO_DEVICE;
+exports.FROM_DEVICE = FROM_DEVICE;
+
+if (require.main === module) {
+	var time = 0;
+	read(process.argv[2]).forEach(function(record) {
+		time += record.delay;
+		console.log(time.toFixed(3) + "ms " + (record.direction == TO_DEVICE ? "> " : "< ") + record.data.toString('hex'));
+	});
+}
@@ -0,0 +1,104 @@
+// Works out how the firmware's clock (ms since it started: see
+// firmware/Clock.c) lines up with ours, so movements can start at a time we
+// choose (see TransmitCommand.moveAt), and so line up with camera frames or
+// with other rigs whose clocks are synced to ours.
+//
+// Every SYNC_PERIOD we ask the firmware for its time, NTP style: it read its
+// clock somewhere between us sending the frame and getting the reply, so we
+// take it as the middle, give or take half the round trip. The quickest round
+// trips are the most certain, so a line is fitted through just those of the
+// last few, giving the offset between the clocks and how fast they drift
+// apart.
+var TIME = 0x21;
+var TIME_RETURN = 0x22;
+var SUCCESS = 0x0B;
+// The request never changes, so it's only made once
+var TIME_REQUEST = new Buffer([TIME]);
+
+var SYNC_PERIOD = 2000;
+// Samples kept (so the drift's worked out over the last half a minute), and
+// how much slower than the quickest a round trip can be and still be used
+var SAMPLES = 16;
+var ROUND_TRIP_SLACK = 2;
+
+function ClockSync(link, log) {
+	this.link = link;
+	this.log = log;
+	this.samples = [];
+	this.timer = null;
+	// Device time = Device + Rate * (host time - Host), once we have samples
+	this.device = null;
+	this.host = null;
+	this.rate = 1;
+	// The firmware's clock wraps after 49 days: how many times it has
+	this.wraps = 0;
+	this.last = null;
+}
+
+// Start syncing (only on frames: lines can't carry the time)
+ClockSync.prototype.start = function() {
+	this.link.on('data', this.receive.bind(this));
+	this.request();
+	this.timer = setInterval(this.request.bind(this), SYNC_PERIOD);
+}
+
+ClockSync.prototype.request = function() {
+	this.link.write(TIME_REQUEST);
+}
+
+ClockSync.prototype.receive = function(raw) {
+	if (raw.length != 6 || raw[0] != TIME_RETURN || raw[1] != SUCCESS) { return; }
+	// The link times the frame in flight, which was our request
+	if (this.link.sentAt === null) { return; }
+	var elapsed = process.hrtime(this.link.sentAt);
+	var roundTrip = elapsed[0] * 1000 + elapsed[1] / 1e6;
+
+	var device = raw.readUInt32BE(2);
+	if (this.last !== null && device < this.last) { this.wraps++; }
+	this.last = device;
+	this.samples.push({
+		host: Date.now() - roundTrip / 2,
+		device: device + this.wraps * 0x100000000,
+		roundTrip: roundTrip
+	});
+	if (this.samples.length > SAMPLES) { this.samples.shift(); }
+	this.fit();
+}
+
+// Least squares line through the quickest samples
+ClockSync.prototype.fit = function() {
+	var quickest = Math.min.apply(null, this.samples.map(function(s) { return s.roundTrip; }));
+	var used = this.samples.filter(function(s) { return s.roundTrip <= quickest + ROUND_TRIP_SLACK; });
+	var host = 0, device = 0;
+	used.forEach(function(s) { host += s.host; device += s.device; });
+	host /= used.length;
+	device /= used.length;
+	var covariance = 0, variance = 0;
+	used.forEach(function(s) {
+		covariance += (s.host - host) * (s.device - device);
+		variance += (s.host - host) * (s.host - host);
+	});
+	this.host = host;
+	this.device = device;
+	// Too close together to tell the drift: assume there isn't any
+	this.rate = (variance > 0) ? covariance / variance : 1;
+}
+
+ClockSync.prototype.synced = function() {
+	return this.device !== null;
+}
+
+// The firmware's clock (wrapped to 32 bits, as it keeps it) at a time of ours
+// (ms, as Date.now)
+ClockSync.prototype.toDevice = function(hostTime) {
+	var device = this.device + this.rate * (hostTime - this.host);
+	return ((Math.round(device) % 0x100000000) + 0x100000000) % 0x100000000;
+}
+
+// Difference between the clocks (ms) now, and how fast it's changing (parts
+// per million)
+ClockSync.prototype.status = function() {
+	return {offset: this.toDevice(Date.now()) - Date.now(), drift: (this.rate - 1) * 1e6};
+}
+
+exports.ClockSync = ClockSync;
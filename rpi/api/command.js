@@ -3,19 +3,26 @@ function WebCommand(transmitSlug, transmitCommand, receiveSlug, receiveCommand)
 	this.transmitCommand = transmitCommand;
 	this.receiveSlug = receiveSlug;
 	this.receiveCommand = receiveCommand;
+	// Whether anyone can send it (it only reads from the rig), or only whoever
+	// has control of it (see control.js)
+	this.readOnly = false;
+	// Movements the scheduler coalesces (see scheduler.js): the name of its
+	// method for them
+	this.coalesce = undefined;
+	// Whether it stops the rig, so movements the bridge is still holding
+	// shouldn't go after it (see Device.prototype.cancelMoves)
+	this.stops = false;
 }
 
-// When the slug is received over the socket, send whatever data
-// needs to be sent to the Arduino
-WebCommand.prototype.bindTransmit = function(socket, sp, callback, err_callback) {
+// When the slug is received over the socket, have transmit (the device's:
+// see device.js) send whatever data needs to be sent to the Arduino. Commands
+// are shared by every device, so nothing about the socket or link is kept here
+WebCommand.prototype.bindTransmit = function(socket, transmit, err_callback) {
 	try {
-		this.socket = socket;
-		this.sp = sp;
-		if (typeof(callback) === 'undefined') { callback = function(x) { return x; } }
-		if (typeof(this.transmitCommand != 'undefined')) {
+		if (typeof(this.transmitCommand) != 'undefined') {
 			socket.on(this.transmitSlug, function(data) {
 				try {
-					callback(this.transmitCommand.transmit(sp, data));
+					transmit(this, data);
 				} catch (e) {
 					err_callback(e);
 				}
@@ -25,22 +32,22 @@ WebCommand.prototype.bindTransmit = function(socket, sp, callback, err_callback)
 		err_callback(e);
 	}
 }
-WebCommand.prototype.transmit = function(data, err_callback) {
-	if (typeof(this.transmitCommand != 'undefined')) {
+WebCommand.prototype.transmit = function(link, data, err_callback) {
+	if (typeof(this.transmitCommand) != 'undefined') {
 		try {
-			this.transmitCommand.transmit(this.sp, data);
+			this.transmitCommand.transmit(link, data);
 		} catch (e) {
 			err_callback(e);
 		}
 	}
 }
 
-// When a serial line is received, process it and potentially send out
-// something over the socket
-WebCommand.prototype.receive = function(data, sp, err_callback) {
+// When a serial line (or frame) is received, process it and potentially send
+// out something over the socket
+WebCommand.prototype.receive = function(data, link, err_callback) {
 	if (typeof(this.receiveCommand) != 'undefined') {
 		try {
-			var output = this.receiveCommand.receiveSerialLine(data);
+			var output = this.receiveCommand.receiveSerialLine(data, link.protocol);
 			return output;
 		} catch(e) {
 			err_callback(e);
@@ -54,13 +61,40 @@ ReceiveCommand = require('./receivecommand.js');
 
 moveAbs = new WebCommand('moveAbs', TransmitCommand.moveAbs);
 moveRel = new WebCommand('moveRel', TransmitCommand.moveRel);
+moveAt = new WebCommand('moveAt', TransmitCommand.moveAt);
+moveBatch = new WebCommand('moveBatch', TransmitCommand.moveBatch, 'batchUpdate', ReceiveCommand.batchUpdate);
 currentPosition = new WebCommand('currentPosition', TransmitCommand.currentPosition, 'positionUpdate', ReceiveCommand.positionUpdate);
+// Position updates the Arduino pushes to us by itself (see app.js)
+positionStream = new WebCommand(undefined, undefined, 'positionUpdate', ReceiveCommand.positionPush);
 targetPosition = new WebCommand('targetPosition', TransmitCommand.targetPosition, 'targetUpdate', ReceiveCommand.targetUpdate);
-homeX = new WebCommand('homeX', TransmitCommand.homeX);
+pathClear = new WebCommand('pathClear', TransmitCommand.pathClear, 'pathUpdate', ReceiveCommand.pathUpdate);
+pathAdd = new WebCommand('pathAdd', TransmitCommand.pathAdd);
+pathRun = new WebCommand('pathRun', TransmitCommand.pathRun);
+getParam = new WebCommand('getParam', TransmitCommand.getParam, 'paramUpdate', ReceiveCommand.paramUpdate);
+setParam = new WebCommand('setParam', TransmitCommand.setParam);
+homeX = new WebCommand('homeX', TransmitCommand.homeX, 'homeUpdate', ReceiveCommand.homeUpdate);
 homeY = new WebCommand('homeY', TransmitCommand.homeY);
 start = new WebCommand('start', TransmitCommand.start);
 stop = new WebCommand('stop', TransmitCommand.stop);
 abort = new WebCommand('abort', TransmitCommand.abort);
 
-exports.commands = [moveAbs, moveRel, currentPosition, targetPosition, homeX, homeY, start, stop, abort];
+currentPosition.readOnly = true;
+targetPosition.readOnly = true;
+getParam.readOnly = true;
+moveAbs.coalesce = 'moveAbs';
+moveRel.coalesce = 'moveRel';
+stop.stops = true;
+abort.stops = true;
+
+exports.commands = [moveAbs, moveRel, moveAt, moveBatch, currentPosition, positionStream, targetPosition, pathClear, pathAdd, pathRun, getParam, setParam, homeX, homeY, start, stop, abort];
+
+// The commands that receive each opcode, so each line or frame only goes to
+// those (see device.js)
+var receivers = [];
+exports.commands.forEach(function(command) {
+	if (typeof(command.receiveCommand) == 'undefined') { return; }
+	var opcode = command.receiveCommand.commandByte;
+	receivers[opcode] = (receivers[opcode] || []).concat([command]);
+});
+exports.receivers = receivers;
 exports.currentPosition = currentPosition;
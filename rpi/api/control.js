@@ -0,0 +1,41 @@
+// Who gets to drive a rig: only the user whose timeslot it is. The web app
+// (see TimedQueue::QueueManager#control_token) gives them a token saying so,
+// signed with a secret it shares with us (HOLOCAM_CONTROL_SECRET), which their
+// browser sends us (the control event: see device.js). Tokens are
+// "<user>.<issued>.<until>.<signature>", the times in ms since the epoch: they
+// only last a little while, so the browser asks for a new one every so often,
+// and stops getting them once its timeslot's over.
+//
+// Without a secret, anyone can drive (as before tokens), which is only for
+// development.
+var crypto = require('crypto');
+
+var SECRET = process.env.HOLOCAM_CONTROL_SECRET;
+
+exports.enabled = function() {
+	return typeof(SECRET) != 'undefined' && SECRET.length > 0;
+}
+
+// The grant {user, issued, until} a token's for, or null if it's not valid
+// (or has run out)
+exports.verify = function(token) {
+	if (!exports.enabled() || typeof(token) != 'string') { return null; }
+	var parts = token.split('.');
+	if (parts.length != 4) { return null; }
+	var payload = parts.slice(0, 3).join('.');
+	var signature = crypto.createHmac('sha256', SECRET).update(payload).digest('hex');
+	if (!sameString(signature, parts[3])) { return null; }
+	var grant = {user: parts[0], issued: parseInt(parts[1], 10), until: parseInt(parts[2], 10)};
+	if (!(grant.until > Date.now())) { return null; }
+	return grant;
+}
+
+// Compare without giving away how much matched by how long it took
+var sameString = function(a, b) {
+	if (a.length != b.length) { return false; }
+	var difference = 0;
+	for (var i = 0; i < a.length; i++) {
+		difference |= a.charCodeAt(i) ^ b.charCodeAt(i);
+	}
+	return difference == 0;
+}
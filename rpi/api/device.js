@@ -0,0 +1,218 @@
+// One rig: its serial port, the link over it (see link.js) with its own queue
+// of frames waiting to go, and the socket.io namespaces its users talk to it
+// through. Each device only ever waits on its own serial port, so a
+// slow or unplugged rig holds up nobody but its own users.
+var serialport = require("serialport");
+var SerialPort = serialport.SerialPort;
+var Link = require('./link.js').Link;
+var ClockSync = require('./clocksync.js').ClockSync;
+var commands = require('./command.js').commands;
+var receivers = require('./command.js').receivers;
+var TransmitCommand = require('./transmitcommand.js');
+var Scheduler = require('./scheduler.js').Scheduler;
+var TokenBucket = require('./scheduler.js').TokenBucket;
+var control = require('./control.js');
+var VirtualDevice = require('./virtualdevice.js').VirtualDevice;
+var Capture = require('./capture.js').Capture;
+
+// How often (ms) we want the position while it's changing. It's sent to every
+// socket, however many there are
+var POSITION_PERIOD = 20;
+
+// How many commands a second each socket can send, and how many at once:
+// moveAbs and moveRel (which are coalesced anyway, so can come as fast as a
+// browser can drag, with room to spare so the last of a drag isn't dropped),
+// and everything else (which goes straight to the Arduino)
+var MOVE_RATE = 120;
+var MOVE_BURST = 120;
+var COMMAND_RATE = 10;
+var COMMAND_BURST = 20;
+
+// config is {name, port, baudrate}, and optionally virtual (true to simulate
+// the Arduino: see virtualdevice.js), replay (a capture to replay instead) and
+// capture (a file to record the serial traffic to: see capture.js). Users connect through any of namespaces
+// (socket.io namespaces), and anything the Arduino sends back goes to all of
+// them
+function Device(config, namespaces, log) {
+	this.name = config.name;
+	this.namespaces = namespaces;
+	this.log = function(msg) { log(config.name + ": " + msg); };
+	// The last position we had, for sockets that connect while it's not changing
+	this.lastPosition = undefined;
+
+	// Raw data, split up into lines or frames by the link, which gives us each
+	// as a Buffer
+	if (config.virtual || config.replay) {
+		this.serialPort = new VirtualDevice(config);
+	} else {
+		this.serialPort = new SerialPort(config.port, {
+			baudrate: config.baudrate || 250000,
+			parity: 'odd'
+		});
+	}
+	if (config.capture) {
+		new Capture(config.capture).attach(this.serialPort);
+	}
+	this.link = new Link(this.serialPort, this.log);
+	// Users' movements, coalesced so only one's ever waiting
+	this.scheduler = new Scheduler(this.link);
+	// The session (see connect) with control of the rig, and when its grant
+	// (see control.js) was issued
+	this.driver = null;
+	this.driverIssued = 0;
+	if (!control.enabled()) {
+		this.log("HOLOCAM_CONTROL_SECRET isn't set, so anyone can drive");
+	}
+
+	this.serialPort.on("open", this.open.bind(this));
+	this.serialPort.on("error", function(e) { this.log("serial error: " + e); }.bind(this));
+	this.link.on('data', this.receive.bind(this));
+	this.link.on('lost', this.lost.bind(this));
+	namespaces.forEach(function(namespace) {
+		namespace.on('connection', this.connect.bind(this));
+	}.bind(this));
+}
+
+Device.prototype.open = function() {
+	this.log("serial open");
+	var link = this.link;
+
+	// Ask for frames in millimetres and degrees, falling back to steps (and
+	// lines) with old firmware
+	link.negotiate(function(version) {
+		this.log("speaking protocol version " + version);
+		// We've just reset the Arduino by opening the port, so it doesn't know
+		// where it is
+		TransmitCommand.homeX.transmit(link);
+		TransmitCommand.homeY.transmit(link);
+		if (version > 0) {
+			// Have the position pushed to us
+			TransmitCommand.subscribe.transmit(link, POSITION_PERIOD);
+			// Keep track of the firmware's clock, for moveAt
+			link.clock = new ClockSync(link, this.log);
+			link.clock.start();
+		} else {
+			// Old firmware can't push, so poll it (once for everyone)
+			setInterval(function() {
+				TransmitCommand.currentPosition.transmit(link);
+			}, 100);
+		}
+	}.bind(this));
+}
+
+// Another socket's connected to this device: bind each of our commands to
+// transmit from it to this Arduino, each socket with its own limits
+Device.prototype.connect = function(socket) {
+	this.log('socket connected');
+	var session = {
+		socket: socket,
+		// When its control of the rig runs out
+		until: 0,
+		moves: new TokenBucket(MOVE_RATE, MOVE_BURST),
+		commands: new TokenBucket(COMMAND_RATE, COMMAND_BURST)
+	};
+	var transmit = this.transmit.bind(this, session);
+	commands.forEach(function(command) {
+		command.bindTransmit(socket, transmit, this.log);
+	}.bind(this));
+	socket.on('control', this.takeControl.bind(this, session));
+	socket.on('disconnect', function() {
+		if (this.driver === session) { this.releaseControl(); }
+	}.bind(this));
+
+	if (typeof(this.lastPosition) != 'undefined') {
+		socket.emit('positionUpdate', this.lastPosition);
+	}
+}
+
+// A session's sent a command: send it on if it's allowed to, and hasn't sent
+// too many lately
+Device.prototype.transmit = function(session, command, data) {
+	if (!command.readOnly && !this.drives(session)) {
+		session.socket.emit('refused', {command: command.transmitSlug});
+		return -1;
+	}
+	var limit = (typeof(command.coalesce) != 'undefined') ? session.moves : session.commands;
+	if (!limit.take()) { return -1; }
+	if (command.stops) { this.cancelMoves(); }
+	if (typeof(command.coalesce) != 'undefined') {
+		return this.scheduler[command.coalesce](data);
+	}
+	return command.transmitCommand.transmit(this.link, data);
+}
+
+// Whether a session can drive the rig
+Device.prototype.drives = function(session) {
+	if (!control.enabled()) { return true; }
+	return this.driver === session && Date.now() < session.until;
+}
+
+// A session's sent a token (see control.js). The newest grant wins, so the
+// next user in the queue takes over from the last, who can't take it back
+// with a token from before
+Device.prototype.takeControl = function(session, token) {
+	var grant = control.verify(token);
+	var current = this.driver !== null && Date.now() < this.driver.until;
+	if (grant === null || (current && this.driver !== session && grant.issued < this.driverIssued)) {
+		session.socket.emit('control', {ok: false});
+		return;
+	}
+	if (this.driver !== session) {
+		if (this.driver !== null) { this.driver.socket.emit('control', {ok: false}); }
+		// Nothing the last driver asked for should still happen
+		this.cancelMoves();
+	}
+	this.driver = session;
+	this.driverIssued = grant.issued;
+	session.until = grant.until;
+	session.socket.emit('control', {ok: true, until: grant.until});
+}
+
+Device.prototype.releaseControl = function() {
+	this.driver = null;
+	this.cancelMoves();
+}
+
+// Forget the movements we're holding back, coalesced or waiting for room in
+// the firmware's queue, so they never reach the rig
+Device.prototype.cancelMoves = function() {
+	this.scheduler.clear();
+	this.link.flushMoves();
+}
+
+// The link dropped a command without the firmware answering it (see link.js):
+// tell the sockets, as they're told its replies
+Device.prototype.lost = function(command) {
+	var slug = null;
+	for (var i = 0; i < commands.length; i++) {
+		var transmitCommand = commands[i].transmitCommand;
+		if (typeof(transmitCommand) != 'undefined' && transmitCommand.commandByte == command[0]) {
+			slug = commands[i].transmitSlug;
+			break;
+		}
+	}
+	if (slug === null) { return; }
+	for (var j = 0; j < this.namespaces.length; j++) {
+		this.namespaces[j].emit('failed', {command: slug});
+	}
+}
+
+// When we receive a line or frame from the serial port, pass it into the
+// commands that receive its opcode, and they'll handle the rest. Plain loops,
+// as this runs for every position pushed to us
+Device.prototype.receive = function(data) {
+	var handlers = receivers[data[0]];
+	if (typeof(handlers) == 'undefined') { return; }
+	for (var i = 0; i < handlers.length; i++) {
+		var command = handlers[i];
+		var output = command.receive(data, this.link, this.log);
+		if (output != false && output != -1 && typeof(output) != 'undefined')  {
+			if (command.receiveSlug == 'positionUpdate') { this.lastPosition = output; }
+			for (var j = 0; j < this.namespaces.length; j++) {
+				this.namespaces[j].emit(command.receiveSlug, output);
+			}
+		}
+	}
+}
+
+exports.Device = Device;
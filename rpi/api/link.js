@@ -0,0 +1,361 @@
+// The serial link to the Arduino. Starts off speaking the line protocol
+// (commands ended by 0x0D), then asks the firmware for frames with positions
+// in millimetres and degrees: see firmware/UART.c. Firmware without units
+// answers with plain frames, and old firmware doesn't answer at all, so we
+// stay on lines with it.
+//
+// Emits 'data' with each line or frame received, as a Buffer of its opcode
+// and data. Bytes are gathered into a Buffer kept for the purpose, so
+// receiving allocates just the one Buffer per line or frame.
+//
+// On frames, movements are held back until the firmware's queue has room for
+// them: it tells us how many slots it has free when we connect, after each
+// movement, and whenever it frees some up, so we only ever send what it can
+// take and never leave it idle with movements waiting here.
+//
+// Emits 'lost' with each command (a Buffer, as written) that was dropped
+// without the firmware answering it (see retry), so whoever sent it can be
+// told it failed.
+var util = require('util');
+var EventEmitter = require('events').EventEmitter;
+
+var LINE_END = 0x0D;
+var FRAME_END = 0x00;
+// Longest line or frame we'll take: anything longer is garbage, and dropped
+var RECEIVE_SIZE = 512;
+
+var PROTOCOL = 0x11;
+var PROTOCOL_RETURN = 0x12;
+var FRAME_ACK = 0x13;
+var FRAME_ERROR = 0x14;
+// Frames the firmware sends without being asked, which aren't replies
+var PUSHED = [0x18];
+var QUEUE_SPACE = 0x19;
+var PROTOCOL_LINES = 0;
+var PROTOCOL_FRAMES = 1;
+var PROTOCOL_UNITS = 2;
+
+// Top bit of the opcode, flipped on each new frame we send
+var FRAME_SEQUENCE = 0x80;
+
+// How long to wait for the firmware to reply, and how many times to ask
+var NEGOTIATE_TIMEOUT = 500;
+var NEGOTIATE_TRIES = 5;
+var FRAME_TIMEOUT = 50;
+var FRAME_TRIES = 5;
+// How many times to start over (see retry) before giving up on the firmware
+var RESYNC_TRIES = 3;
+
+// Commands that do the same whether the firmware acts on them once or twice:
+// moveAbs, getPos, start, stop, abort, getTarget, subscribe, getParam,
+// setParam, pathClear, time and moveAt. Only these are sent again after
+// starting over, as we can't tell whether the firmware acted on them before
+var REPEATABLE = [0x01, 0x03, 0x06, 0x07, 0x08, 0x0F, 0x17, 0x1A, 0x1B, 0x1D, 0x21, 0x23];
+
+function Link(sp, log) {
+	EventEmitter.call(this);
+	this.sp = sp;
+	this.log = log;
+	// Protocol version we're speaking (see encoders in transmitcommand.js)
+	this.protocol = PROTOCOL_LINES;
+	this.framed = false;
+	this.received = new Buffer(RECEIVE_SIZE);
+	this.receivedLength = 0;
+
+	// Frames waiting to be sent, and the one waiting for a reply. Movements
+	// wait separately until the firmware has room for them
+	this.queue = [];
+	this.moves = [];
+	this.inFlight = null;
+	this.space = 0;
+	this.sequence = 0;
+	this.tries = 0;
+	this.timer = null;
+	// Whether we've given up on the firmware (see giveUp), so have to start
+	// over before sending anything else
+	this.stale = false;
+	// When (process.hrtime) the frame in flight was last sent, so replies can
+	// be timed (see clocksync.js)
+	this.sentAt = null;
+
+	sp.on('data', this.receive.bind(this));
+}
+util.inherits(Link, EventEmitter);
+
+// Ask the firmware for the newest protocol, calling back with the version we
+// end up speaking
+Link.prototype.negotiate = function(callback) {
+	var tries = 0;
+	var timer = null;
+	var onLine = function(raw) {
+		if (raw.length != 2 || raw[0] != PROTOCOL_RETURN) { return; }
+		clearTimeout(timer);
+		this.removeListener('data', onLine);
+		this.protocol = raw[1];
+		this.framed = (raw[1] >= PROTOCOL_FRAMES);
+		this.sequence = 0;
+		this.space = 0;
+		callback(raw[1]);
+	}.bind(this);
+	var ask = function() {
+		if (tries++ >= NEGOTIATE_TRIES) {
+			this.removeListener('data', onLine);
+			callback(PROTOCOL_LINES);
+			return;
+		}
+		this.sp.write(new Buffer([PROTOCOL, PROTOCOL_UNITS, LINE_END]));
+		timer = setTimeout(ask, NEGOTIATE_TIMEOUT);
+	}.bind(this);
+
+	this.on('data', onLine);
+	ask();
+}
+
+// Send a command (a Buffer of its opcode and encoded data, which is only
+// read), which adds movements movements to the firmware's queue
+Link.prototype.write = function(command, movements) {
+	if (!this.framed) {
+		var line = new Buffer(command.length + 1);
+		command.copy(line);
+		line[command.length] = LINE_END;
+		return this.sp.write(line);
+	}
+	// One frame at a time, so that we know which one each reply is to
+	var entry = {command: command, movements: movements || 0};
+	(entry.movements > 0 ? this.moves : this.queue).push(entry);
+	this.sendNext();
+}
+
+// How many frames with movements are waiting for room in the firmware's queue
+// (see scheduler.js). On lines, they're never held back
+Link.prototype.movesWaiting = function() {
+	return this.moves.length;
+}
+
+// Forget the movements waiting for room (when aborting, or someone else takes
+// control), so they aren't sent as soon as there is
+Link.prototype.flushMoves = function() {
+	this.moves = [];
+}
+
+Link.prototype.sendNext = function() {
+	if (this.inFlight !== null) { return; }
+	if (this.stale && (this.queue.length > 0 || this.moves.length > 0)) {
+		// Just the once: if it still doesn't answer, we give up again
+		this.stale = false;
+		this.inFlight = {command: new Buffer([PROTOCOL, this.protocol]), movements: 0, resyncs: RESYNC_TRIES, resend: null};
+	} else if (this.queue.length > 0) {
+		this.inFlight = this.queue.shift();
+	} else if (this.moves.length > 0 && this.moves[0].movements <= this.space) {
+		this.inFlight = this.moves.shift();
+		// Until its reply tells us exactly
+		this.space -= this.inFlight.movements;
+	} else {
+		return;
+	}
+	this.tries = 0;
+	this.transmitFrame();
+}
+
+Link.prototype.transmitFrame = function() {
+	this.sp.write(encodeFrame(this.inFlight.command, this.sequence));
+	this.sentAt = process.hrtime();
+	this.timer = setTimeout(this.retry.bind(this), FRAME_TIMEOUT);
+}
+
+// Send the frame in flight again with the same sequence bit: if the firmware
+// already acted on it, it just replies again
+Link.prototype.retry = function() {
+	clearTimeout(this.timer);
+	if (++this.tries < FRAME_TRIES) {
+		this.transmitFrame();
+		return;
+	}
+	var given = this.inFlight;
+	// We don't know whether the firmware acted on it, so don't know which
+	// sequence bit it's expecting next. Asking for the protocol again always
+	// gets acted on, and starts the sequence over. Once it has, the frame we
+	// gave up on goes first again (see receiveFrame) if it's repeatable:
+	// otherwise it might be acted on twice, so it's lost
+	var resync = {command: new Buffer([PROTOCOL, this.protocol]), movements: 0, resyncs: 1, resend: null};
+	if (typeof(given.resyncs) != 'undefined') {
+		resync.resyncs = given.resyncs + 1;
+		resync.resend = given.resend;
+	} else {
+		this.log("frame 0x" + given.command[0].toString(16) + " never got a reply");
+		if (REPEATABLE.indexOf(given.command[0]) != -1) {
+			resync.resend = given;
+		} else {
+			this.emit('lost', given.command);
+		}
+	}
+	if (resync.resyncs > RESYNC_TRIES) {
+		this.giveUp(resync.resend);
+		return;
+	}
+	this.inFlight = resync;
+	this.tries = 0;
+	this.transmitFrame();
+}
+
+// We've started over after giving up on a frame (see retry): put it back at
+// the front of its queue
+Link.prototype.resend = function(entry) {
+	if (entry.movements > 0) {
+		this.moves.unshift(entry);
+	} else {
+		this.queue.unshift(entry);
+	}
+}
+
+// The firmware isn't answering at all (it's been unplugged, say): drop
+// everything waiting, rather than retrying for ever. The next command written
+// starts over first, in case it's back
+Link.prototype.giveUp = function(resend) {
+	this.log("firmware isn't answering: dropping " + (this.queue.length + this.moves.length + (resend ? 1 : 0)) +
+		" commands");
+	var lost = (resend ? [resend] : []).concat(this.queue, this.moves);
+	this.inFlight = null;
+	this.queue = [];
+	this.moves = [];
+	this.stale = true;
+	lost.forEach(function(entry) { this.emit('lost', entry.command); }.bind(this));
+}
+
+// Split what we receive up into lines or frames
+Link.prototype.receive = function(data) {
+	var delimiter = this.framed ? FRAME_END : LINE_END;
+	for (var i = 0; i < data.length; i++) {
+		if (data[i] != delimiter) {
+			// Drop what we have if it's too long to be anything
+			if (this.receivedLength == RECEIVE_SIZE) { this.receivedLength = 0; }
+			this.received[this.receivedLength++] = data[i];
+			continue;
+		}
+		var length = this.receivedLength;
+		this.receivedLength = 0;
+		if (this.framed) {
+			this.receiveFrame(decodeFrame(this.received, length));
+		} else {
+			var line = new Buffer(length);
+			this.received.copy(line, 0, 0, length);
+			this.emit('data', line);
+		}
+	}
+}
+
+Link.prototype.receiveFrame = function(frame) {
+	if (frame === null) {
+		// Corrupted reply: ask again (see retry)
+		if (this.inFlight !== null) { this.retry(); }
+		return;
+	}
+	var opcode = frame[0] & ~FRAME_SEQUENCE;
+	if (opcode == FRAME_ERROR) {
+		// The firmware got a corrupted frame from us
+		if (this.inFlight !== null) { this.retry(); }
+		return;
+	}
+	if (opcode == QUEUE_SPACE && frame.length == 2) {
+		this.space = frame[1];
+		this.sendNext();
+		return;
+	}
+	if (PUSHED.indexOf(opcode) != -1) {
+		this.emit('data', frame);
+		return;
+	}
+	// Anything else is a reply, unless it's late and we've sent again since
+	if (this.inFlight === null || (frame[0] & FRAME_SEQUENCE) != this.sequence) { return; }
+	clearTimeout(this.timer);
+	// Replies to movements end with how much room the queue has left, which
+	// is just for us: strip it so they look the same as on lines
+	if (this.inFlight.movements > 0 && opcode != FRAME_ACK && frame.length > 1) {
+		this.space = frame[frame.length - 1];
+		frame = frame.slice(0, frame.length - 1);
+	}
+	frame[0] = opcode;
+	var answered = this.inFlight;
+	this.inFlight = null;
+	this.sequence ^= FRAME_SEQUENCE;
+	if (typeof(answered.resyncs) != 'undefined') {
+		// The firmware tells us its queue space again once it's started over,
+		// so movements wait for that
+		this.space = 0;
+		if (answered.resend) { this.resend(answered.resend); }
+	}
+	// Replies to restarting after a lost frame (see retry) are just for us
+	if (opcode != FRAME_ACK && opcode != PROTOCOL_RETURN) {
+		this.emit('data', frame);
+	}
+	this.sendNext();
+}
+
+// CRC-16/CCITT (polynomial 0x1021, starting at 0xFFFF), a byte at a time
+var CRC_START = 0xFFFF;
+var crc16Update = function(crc, byte) {
+	crc ^= byte << 8;
+	for (var bit = 0; bit < 8; bit++) {
+		crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+		crc &= 0xFFFF;
+	}
+	return crc;
+}
+
+// Add the CRC to a command (with the sequence bit set in its opcode), and COBS
+// stuff it so it has no 0x00s but the end. Commands are far shorter than the
+// 254 bytes a COBS block can hold, so that's one byte of stuffing, the CRC and
+// the end on top of the command
+var encodeFrame = function(command, sequence) {
+	var wire = new Buffer(command.length + 4);
+	var crc = CRC_START;
+	var code = 0;
+	var out = 1;
+	for (var i = 0; i < command.length + 2; i++) {
+		var byte;
+		if (i < command.length) {
+			byte = (i == 0) ? (command[0] | (sequence || 0)) : command[i];
+			crc = crc16Update(crc, byte);
+		} else {
+			byte = (i == command.length) ? (crc >> 8) : (crc & 0xFF);
+		}
+		if (byte == 0x00) {
+			wire[code] = out - code;
+			code = out++;
+		} else {
+			wire[out++] = byte;
+		}
+	}
+	wire[code] = out - code;
+	wire[out++] = FRAME_END;
+	return wire;
+}
+
+// Undo the stuffing of the first length bytes of wire (all of it by default),
+// and check and remove the CRC. Returns the frame in a Buffer of its own, or
+// null if it's corrupted
+var decodeFrame = function(wire, length) {
+	if (typeof(length) == 'undefined') { length = wire.length; }
+	var frame = new Buffer(length);
+	var size = 0;
+	var crc = CRC_START;
+	var i = 0;
+	while (i < length) {
+		var code = wire[i++];
+		if (code == 0 || i + code - 1 > length) { return null; }
+		for (var j = 1; j < code; j++) {
+			crc = crc16Update(crc, wire[i]);
+			frame[size++] = wire[i++];
+		}
+		if (code < 0xFF && i < length) {
+			crc = crc16Update(crc, 0x00);
+			frame[size++] = 0x00;
+		}
+	}
+	if (size < 3 || crc != 0) { return null; }
+	return frame.slice(0, size - 2);
+}
+
+exports.Link = Link;
+exports.encodeFrame = encodeFrame;
+exports.decodeFrame = decodeFrame;
@@ -0,0 +1,111 @@
+// Load test a bridge (app.js): connect clients to a rig's namespace, each asking
+// for the target position rate times a second, as browsers watching it would,
+// and report how long the replies take and how many come back. Best pointed at
+// a bridge whose rig is virtual (see virtualdevice.js), so it can be run
+// without the hardware, and again and again with the same results:
+//
+//   node loadtest.js [--url http://localhost:3001/holocam] [--clients 50]
+//                    [--seconds 10] [--rate 5]
+//
+// With HOLOCAM_CONTROL_SECRET set (the bridge's), the first client also takes
+// control and drags the rig about, as the user whose timeslot it is would.
+//
+// Keep the rate under the bridge's limit for each socket (see device.js): it
+// drops what's over without a reply, which would be counted as lost.
+var crypto = require('crypto');
+var io = require('socket.io-client');
+
+// How often the driver sends a movement while dragging (ms)
+var DRAG_PERIOD = 16;
+
+var options = {url: 'http://localhost:3001/holocam', clients: 50, seconds: 10, rate: 5};
+for (var i = 2; i + 1 < process.argv.length; i += 2) {
+	var name = process.argv[i].replace(/^--/, '');
+	if (!(name in options)) {
+		console.error("Unknown option " + process.argv[i]);
+		process.exit(1);
+	}
+	options[name] = (name == 'url') ? process.argv[i + 1] : parseFloat(process.argv[i + 1]);
+}
+
+// Replies go to every socket in the namespace, and come back in the order
+// their commands were sent (see link.js), so listen on one socket and match
+// each reply to the oldest request waiting
+var waiting = [];
+var latencies = [];
+var sent = 0;
+var timers = [];
+var sockets = [];
+var started;
+
+var now = function() {
+	var time = process.hrtime();
+	return time[0] * 1000 + time[1] / 1e6;
+}
+
+// A token for the driver, as the web app would give them (see control.js)
+var controlToken = function() {
+	var secret = process.env.HOLOCAM_CONTROL_SECRET;
+	if (typeof(secret) == 'undefined' || secret.length == 0) { return null; }
+	var payload = ['loadtest', Date.now(), Date.now() + options.seconds * 1000 + 60000].join('.');
+	return payload + '.' + crypto.createHmac('sha256', secret).update(payload).digest('hex');
+}
+
+var connect = function(index) {
+	var socket = io(options.url, {forceNew: true, transports: ['websocket']});
+	sockets.push(socket);
+	socket.on('connect', function() {
+		timers.push(setInterval(function() {
+			waiting.push(now());
+			sent++;
+			socket.emit('targetPosition');
+		}, 1000 / options.rate));
+		if (index == 0) { drive(socket); }
+	});
+	if (index == 0) {
+		socket.on('targetUpdate', function() {
+			if (waiting.length > 0) { latencies.push(now() - waiting.shift()); }
+		});
+	}
+}
+
+// Take control, then drag in circles
+var drive = function(socket) {
+	var token = controlToken();
+	if (token === null) { return; }
+	socket.on('control', function(reply) {
+		if (!reply.ok) {
+			console.error("Refused control: is HOLOCAM_CONTROL_SECRET the bridge's?");
+			return;
+		}
+		var angle = 0;
+		timers.push(setInterval(function() {
+			angle += 0.05;
+			socket.emit('moveAbs', {x: 50 + 40 * Math.cos(angle), y: 50 + 40 * Math.sin(angle), theta: 0, phi: 0});
+		}, DRAG_PERIOD));
+	});
+	socket.emit('control', token);
+}
+
+// The value at fraction p of the way through sorted
+var percentile = function(sorted, p) {
+	if (sorted.length == 0) { return NaN; }
+	return sorted[Math.min(sorted.length - 1, Math.floor(p * sorted.length))];
+}
+
+var report = function() {
+	timers.forEach(clearInterval);
+	sockets.forEach(function(socket) { socket.disconnect(); });
+	var elapsed = (now() - started) / 1000;
+	var sorted = latencies.slice().sort(function(a, b) { return a - b; });
+	console.log(options.clients + " clients for " + elapsed.toFixed(1) + "s against " + options.url);
+	console.log("sent " + sent + ", answered " + latencies.length + " (" + (latencies.length / elapsed).toFixed(1) +
+		"/s), unanswered " + waiting.length);
+	console.log("latency ms: p50 " + percentile(sorted, 0.5).toFixed(1) + ", p90 " + percentile(sorted, 0.9).toFixed(1) +
+		", p99 " + percentile(sorted, 0.99).toFixed(1) + ", max " + percentile(sorted, 1).toFixed(1));
+	process.exit(0);
+}
+
+started = now();
+for (var i = 0; i < options.clients; i++) { connect(i); }
+setTimeout(report, options.seconds * 1000);
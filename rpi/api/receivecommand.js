@@ -1,9 +1,11 @@
+var TransmitCommand = require('./transmitcommand.js');
+
 // Represents a type of command that is received from the Arduino over
 // serial
 function ReceiveCommand(commandByte, decodeData, processData) {
 	this.commandByte = commandByte;
 
-	// By default, don't decode data (so just output raw hex data),
+	// By default, don't decode data (so just output a Buffer of it),
 	// and don't process it
 	if (typeof(decodeData) != 'undefined') {
 		this.decodeData = decodeData;
@@ -17,18 +19,15 @@ function ReceiveCommand(commandByte, decodeData, processData) {
 	}
 }
 
-// Given a line of serial, check if the command byte matches
-// and if it does, do whatever needs to be done
-ReceiveCommand.prototype.receiveSerialLine = function(hexstr) {
-	// Split up the hex string into command and data bytes
-	var raw = new Buffer(hexstr, "hex");
+// Given a line or frame of serial (a Buffer, in the passed protocol version),
+// check if the command byte matches and if it does, do whatever needs to be
+// done
+ReceiveCommand.prototype.receiveSerialLine = function(raw, protocol) {
 	if (raw.length < 1) { return false; }
-	var command = raw[0];
-	var data = raw.slice(1);
 
-	if (command == this.commandByte) {
-		// Decode and process the data
-		var decoded = this.decodeData(data);
+	if (raw[0] == this.commandByte) {
+		// Decode and process the data (a view of raw, not a copy)
+		var decoded = this.decodeData(raw.slice(1), protocol);
 		if (decoded == -1) { return -1; }
 		var process = this.processData(decoded);
 		if (process == -1) { return -1; }
@@ -52,16 +51,43 @@ var threeByteDecoder = function(buffer) {
 			var b2 = buffer[3*i+1];
 			var b3 = buffer[3*i+2];
 
-			// Decode using the encoding defined in firmware/
+			// Decode using the encoding defined in firmware/, then sign
+			// extend the BE int16_t
 			b1 |= ((b3 & 0x02) >> 1);
 			b2 |= (b3 & 0x01);
-			var buf = new Buffer([b1, b2]);
-			nums.push(buf.readInt16BE(0));
+			nums.push(((b1 << 8) | b2) << 16 >> 16);
 		}
 		return nums;
 	}
 }
 
+// Frames carry positions as plain BE int16_ts
+var twoByteDecoder = function(buffer) {
+	if (buffer.length % 2 != 0) { return -1; }
+	var nums = [];
+	for (var i=0; i<buffer.length/2; i++) {
+		nums.push(buffer.readInt16BE(2*i));
+	}
+	return nums;
+}
+
+// From protocol version 2, positions are millimetres and degrees as BE
+// int32_ts in Q16.16 fixed point
+var FIXED_ONE = 0x10000;
+var fixedDecoder = function(buffer) {
+	if (buffer.length % 4 != 0) { return -1; }
+	var nums = [];
+	for (var i=0; i<buffer.length/4; i++) {
+		nums.push(buffer.readInt32BE(4*i) / FIXED_ONE);
+	}
+	return nums;
+}
+
+var positionDecoder = function(buffer, protocol) {
+	if (protocol >= 2) { return fixedDecoder(buffer); }
+	return protocol > 0 ? twoByteDecoder(buffer) : threeByteDecoder(buffer);
+}
+
 // PROCESSORS
 // Turn a 4-element tuple into a position dictionary
 var positionProcessor = function(data) {
@@ -69,7 +95,55 @@ var positionProcessor = function(data) {
 }
 
 
+// A setting, whether reading or changing it worked, and its value (see
+// TransmitCommand.getParam/setParam)
+var SUCCESS = 0x0B;
+var paramProcessor = function(data) {
+	if (data.length != 6) { return -1; }
+	var param = data[0];
+	var value = data.readUInt32BE(2);
+	for (var name in TransmitCommand.PARAMS) {
+		var info = TransmitCommand.PARAMS[name];
+		var axes = info.axes ? TransmitCommand.AXES.length : 1;
+		if (param < info.param || param >= info.param + axes) { continue; }
+		if (info.signed) { value = data.readInt32BE(2); }
+		var result = {name: name, ok: data[1] == SUCCESS, value: info.fixed ? value / FIXED_ONE : value};
+		if (info.axes) { result.axis = TransmitCommand.AXES[param - info.param]; }
+		return result;
+	}
+	return -1;
+}
+
+// Whether a path command worked, and how many keyframes the path has now
+var pathProcessor = function(data) {
+	if (data.length != 2) { return -1; }
+	return {ok: data[0] == SUCCESS, keyframes: data[1]};
+}
+
+// Which axis is to be homed, and whether it will be
+var homeProcessor = function(data) {
+	if (data.length != 2) { return -1; }
+	return {axis: TransmitCommand.AXES[data[0]], ok: data[1] == SUCCESS};
+}
+
+// Number of movements queued out of a batch (in the top four bits)
+var batchProcessor = function(data) {
+	if (data.length != 1) { return -1; }
+	return {accepted: data[0] >> 4};
+}
+
+
 // When we receive an update to the current position
-exports.positionUpdate = new ReceiveCommand(0x09, threeByteDecoder, positionProcessor);
+exports.positionUpdate = new ReceiveCommand(0x09, positionDecoder, positionProcessor);
+// When the current position is pushed to us (see TransmitCommand.subscribe)
+exports.positionPush = new ReceiveCommand(0x18, positionDecoder, positionProcessor);
 // When we receive an update to the targeted position
-exports.targetUpdate = new ReceiveCommand(0x0A, threeByteDecoder, positionProcessor);
+exports.targetUpdate = new ReceiveCommand(0x0A, positionDecoder, positionProcessor);
+// When a batch of movements has been queued
+exports.batchUpdate = new ReceiveCommand(0x16, undefined, batchProcessor);
+// When a setting's been read or changed
+exports.paramUpdate = new ReceiveCommand(0x1C, undefined, paramProcessor);
+// When a path's keyframes have been cleared or added to, or it's been run
+exports.pathUpdate = new ReceiveCommand(0x20, undefined, pathProcessor);
+// When homing an axis has been queued, or refused
+exports.homeUpdate = new ReceiveCommand(0x24, undefined, homeProcessor);
@@ -0,0 +1,75 @@
+// Holds users' movements back so the serial link only ever has one waiting
+// (see link.js), however fast they're sent. Every TICK, if the link's taken
+// the last one, we send what's been asked for since, coalesced into one:
+// the newest moveAbs target, with any moveRels since added on (the firmware
+// takes moveRels relative to the last movement queued, so the sum of a few
+// is the same as each in turn). Dragging something in a browser sends far
+// more than the link can take, and the rig should go where it was dragged
+// to, not through every point on the way. So the rig is never more than a
+// tick behind the user, rather than a backlog behind.
+var TransmitCommand = require('./transmitcommand.js');
+
+var TICK = 20;
+var AXES = ['x', 'y', 'theta', 'phi'];
+
+function Scheduler(link) {
+	this.link = link;
+	// The movement waiting to be sent: its command, and position {x, y, theta, phi}
+	this.pending = null;
+	this.timer = setInterval(this.tick.bind(this), TICK);
+}
+
+Scheduler.prototype.moveAbs = function(position) {
+	this.pending = {command: TransmitCommand.moveAbs, position: copyPosition(position)};
+}
+
+Scheduler.prototype.moveRel = function(delta) {
+	if (this.pending === null) {
+		this.pending = {command: TransmitCommand.moveRel, position: copyPosition(delta)};
+		return;
+	}
+	// Onto a target or another delta, it's the same sum
+	AXES.forEach(function(axis) {
+		this.pending.position[axis] += +(delta[axis] || 0);
+	}.bind(this));
+}
+
+// Forget what's waiting (when someone else takes control)
+Scheduler.prototype.clear = function() {
+	this.pending = null;
+}
+
+Scheduler.prototype.tick = function() {
+	if (this.pending === null || this.link.movesWaiting() > 0) { return; }
+	var pending = this.pending;
+	this.pending = null;
+	pending.command.transmit(this.link, pending.position);
+}
+
+var copyPosition = function(position) {
+	var copy = {};
+	AXES.forEach(function(axis) { copy[axis] = +(position[axis] || 0); });
+	return copy;
+}
+
+// A token bucket: lets through up to burst at once, and rate a second after
+// that
+function TokenBucket(rate, burst) {
+	this.rate = rate;
+	this.burst = burst;
+	this.tokens = burst;
+	this.last = Date.now();
+}
+
+// Whether one more can go through now
+TokenBucket.prototype.take = function() {
+	var now = Date.now();
+	this.tokens = Math.min(this.burst, this.tokens + (now - this.last) * this.rate / 1000);
+	this.last = now;
+	if (this.tokens < 1) { return false; }
+	this.tokens -= 1;
+	return true;
+}
+
+exports.Scheduler = Scheduler;
+exports.TokenBucket = TokenBucket;
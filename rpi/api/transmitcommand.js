@@ -1,14 +1,17 @@
 // Represents a type of command that can be transmitted over serial to
 // the Arduino
-function TransmitCommand(commandByte, encodeData, preprocessData) {
+function TransmitCommand(commandByte, encodeData, preprocessData, movements) {
 	this.commandByte = commandByte;
+	// How many movements the command adds to the firmware's queue, so the
+	// Link can hold it back until there's room
+	this.movements = movements || 0;
 
-	// By default, don't encode data (so require hex data to be
+	// By default, don't encode data (so require an array of bytes to be
 	// passed in), and don't preprocess it
 	if (typeof(encodeData) != 'undefined') {
 		this.encodeData = encodeData;
 	} else {
-		this.encodeData = function(data) { return data; }
+		this.encodeData = bytesEncoder;
 	}
 	if (typeof(preprocessData) != 'undefined') {
 		this.preprocessData = preprocessData;
@@ -17,50 +20,150 @@ function TransmitCommand(commandByte, encodeData, preprocessData) {
 	}
 }
 
-// Given some data, format a whole command (with command
-// byte and newline) to be sent
-TransmitCommand.prototype.formatSerialCommand = function(data) {
+// Commands are encoded here, then copied out into a Buffer of exactly their
+// size, so sending one allocates nothing else. Big enough for the biggest
+// (a full batch: see batchEncoder)
+var SCRATCH = new Buffer(256);
+
+// Given some data, format a whole command (command byte and data) to be sent
+// (the Link ends it with a newline or frames it), as a Buffer. Data is encoded
+// for the protocol version the Link's speaking
+TransmitCommand.prototype.formatSerialCommand = function(data, protocol) {
+	SCRATCH[0] = this.commandByte;
+	var length = 1;
 	// Handle case when no data is being sent
 	if (typeof(data) != 'undefined' && data !== null) {
 		// Call encoder and preprocessor on data first
 		var preprocessed = this.preprocessData(data);
 		if (preprocessed == -1) { return -1; }
-		var encoded = this.encodeData(preprocessed);
-		if (encoded == -1) { return -1; }
-
-		return [this.commandByte].concat(encoded.concat([0x0D]));
-	} else {
-		return [this.commandByte, 0x0D];
+		length = this.encodeData(SCRATCH, 1, preprocessed, protocol);
+		if (length == -1) { return -1; }
 	}
+	var command = new Buffer(length);
+	SCRATCH.copy(command, 0, 0, length);
+	return command;
 }
 
-// Given a SerialPort and some data, transmit that data
-TransmitCommand.prototype.transmit = function(sp, data) {
-	var command = this.formatSerialCommand(data);
+// Given a Link (see link.js) and some data, transmit that data
+TransmitCommand.prototype.transmit = function(link, data) {
+	var command = this.formatSerialCommand(data, link.protocol);
 	if (command == -1) { return -1; }
-	return sp.write(command);
+	return link.write(command, this.movements);
 }
 
 
 // ENCODERS
-// Given an array of numbers, turn them into the three-byte data format
-// specified in firmware/
-var threeByteEncoder = function(nums) {
-	var data = [];
-	for (var i=0; i<nums.length; i++) {
-		// if number is too big for an int16_t, return an error
-		if (Math.abs(Math.round(nums[i])) > 32767) { return -1; }
-
-		// Use node buffers to encode to BE int16_t
-		var buf = new Buffer(2);
-		buf.writeInt16BE(Math.round(nums[i]), 0);
-
-		// See firmware/
-		data = data.concat(buf[0] & 0xFE);
-		data = data.concat(buf[1] & 0xFE);
-		data = data.concat((buf[1] & 0x01) | ((buf[0] << 1) & 0x02));
+// Each writes its data into buf from offset, and returns the offset just
+// after it (or -1 if the data can't be sent)
+
+// An array of bytes, as is
+var bytesEncoder = function(buf, offset, bytes) {
+	if (offset + bytes.length > buf.length) { return -1; }
+	for (var i=0; i<bytes.length; i++) {
+		buf[offset++] = bytes[i];
 	}
-	return data;
+	return offset;
+}
+
+// WRITERS
+// Each writes one number into buf at offset, and returns the offset just
+// after it (or -1 if it's out of range)
+
+// The three-byte data format specified in firmware/
+var threeByteWriter = function(buf, offset, num) {
+	num = Math.round(num);
+	// if number is too big for an int16_t, return an error
+	if (Math.abs(num) > 32767) { return -1; }
+
+	// The bytes of a BE int16_t, spread over three (see firmware/)
+	var high = (num >> 8) & 0xFF;
+	var low = num & 0xFF;
+	buf[offset] = high & 0xFE;
+	buf[offset+1] = low & 0xFE;
+	buf[offset+2] = (low & 0x01) | ((high << 1) & 0x02);
+	return offset + 3;
+}
+
+// Frames don't need the three-byte format: just send BE int16_ts
+var twoByteWriter = function(buf, offset, num) {
+	num = Math.round(num);
+	if (Math.abs(num) > 32767) { return -1; }
+	buf.writeInt16BE(num, offset);
+	return offset + 2;
+}
+
+// From protocol version 2, positions are millimetres and degrees in Q16.16
+// fixed point: BE int32_ts with 16 fractional bits
+var FIXED_ONE = 0x10000;
+var fixedWriter = function(buf, offset, num) {
+	var fixed = Math.round(num * FIXED_ONE);
+	if (Math.abs(fixed) > 0x7FFFFFFF) { return -1; }
+	buf.writeInt32BE(fixed, offset);
+	return offset + 4;
+}
+
+// Whole numbers (steps, or a period): three bytes each on lines, two in frames
+var wholeWriter = function(protocol) {
+	return protocol > 0 ? twoByteWriter : threeByteWriter;
+}
+
+var positionWriter = function(protocol) {
+	return protocol >= 2 ? fixedWriter : wholeWriter(protocol);
+}
+
+// Write nums, from start, one after the other
+var writeAll = function(writer, buf, offset, nums, start) {
+	for (var i=start || 0; i<nums.length && offset != -1; i++) {
+		offset = writer(buf, offset, nums[i]);
+	}
+	return offset;
+}
+
+var wholeEncoder = function(buf, offset, nums, protocol) {
+	return writeAll(wholeWriter(protocol), buf, offset, nums);
+}
+
+var positionEncoder = function(buf, offset, nums, protocol) {
+	return writeAll(positionWriter(protocol), buf, offset, nums);
+}
+
+// A batch of movements: the number of them in the top four bits of the first
+// byte (flags in the bottom ones), then all their positions. See
+// firmware/Command.c
+var MOVE_BATCH_MAX = 15;
+var MOVE_BATCH_RELATIVE = 0x01;
+var batchEncoder = function(buf, offset, batch, protocol) {
+	var count = batch.length / 4;
+	if (count < 1 || count > MOVE_BATCH_MAX) { return -1; }
+	buf[offset] = (count << 4) | (batch.relative ? MOVE_BATCH_RELATIVE : 0);
+	return positionEncoder(buf, offset + 1, batch, protocol);
+}
+
+// A movement at a time on the firmware's clock: the time as a BE uint32, then
+// its position
+var timedEncoder = function(buf, offset, nums, protocol) {
+	if (nums[0] < 0 || nums[0] > 0xFFFFFFFF) { return -1; }
+	buf.writeUInt32BE(nums[0], offset);
+	return writeAll(positionWriter(protocol), buf, offset + 4, nums, 1);
+}
+
+// A path keyframe: how long after the keyframe before it (ms, a whole number),
+// then its position
+var keyframeEncoder = function(buf, offset, nums, protocol) {
+	offset = wholeWriter(protocol)(buf, offset, nums[0]);
+	return writeAll(positionWriter(protocol), buf, offset, nums, 1);
+}
+
+// Settings (see firmware/Config.c): the setting's number, then for
+// setParam its value as a BE uint32
+var paramEncoder = function(buf, offset, nums) {
+	buf[offset++] = nums[0];
+	if (nums.length > 1) {
+		if (nums[1] < 0 || nums[1] > 0xFFFFFFFF) { return -1; }
+		buf.writeUInt32BE(nums[1], offset);
+		offset += 4;
+	}
+	return offset;
 }
 
 // PREPROCESSERS
@@ -70,10 +173,96 @@ var positionProcessor = function(position) {
 }
 
 
+// Given a keyframe {duration, x, y, theta, phi}, turn it into a 5-element tuple
+var keyframeProcessor = function(keyframe) {
+	return [keyframe.duration || 0].concat(positionProcessor(keyframe));
+}
+
+// Given {relative: bool, positions: [position dictionaries]}, turn the
+// positions into one long list of tuples (remembering whether they're relative)
+var batchProcessor = function(batch) {
+	var nums = [];
+	batch.positions.forEach(function(position) {
+		nums = nums.concat(positionProcessor(position));
+	});
+	nums.relative = batch.relative;
+	return nums;
+}
+
+// Settings by name. Those with an axis add it (x, y, theta, phi) to their
+// number, and scales (steps per mm or degree) are sent in Q16.16
+var PARAMS = {
+	maxVelocity: {param: 0x00, axes: true},
+	acceleration: {param: 0x04, axes: true},
+	scale: {param: 0x08, axes: true, fixed: true},
+	dirReverse: {param: 0x0C},
+	homeFastVelocity: {param: 0x0D},
+	homeSlowVelocity: {param: 0x0E},
+	homeBackOff: {param: 0x0F},
+	// X and Y only
+	homeLatch: {param: 0x10, axes: true, signed: true}
+};
+var AXES = ['x', 'y', 'theta', 'phi'];
+
+// Given {name, axis} (and for setParam, value), turn it into the setting's
+// number (and its value as the firmware keeps it)
+var paramProcessor = function(param) {
+	var info = PARAMS[param.name];
+	if (typeof(info) == 'undefined') { return -1; }
+	var nums = [info.param];
+	if (info.axes) {
+		var axis = AXES.indexOf(param.axis);
+		if (axis == -1) { return -1; }
+		nums[0] += axis;
+	}
+	if (typeof(param.value) != 'undefined') {
+		var value = Math.round(info.fixed ? param.value * FIXED_ONE : param.value);
+		// Signed settings go as the uint32 of an int32
+		nums.push(info.signed ? value >>> 0 : value);
+	}
+	return nums;
+}
+
+// Movements at a time of ours (ms, as Date.now), which the link's ClockSync
+// (see clocksync.js) converts to the firmware's clock. Can't be sent until
+// it's synced
+var TimedTransmitCommand = function(commandByte) {
+	TransmitCommand.call(this, commandByte, timedEncoder, function(position) {
+		return [position.at].concat(positionProcessor(position));
+	}, 1);
+}
+TimedTransmitCommand.prototype = Object.create(TransmitCommand.prototype);
+TimedTransmitCommand.prototype.transmit = function(link, data) {
+	if (!link.clock || !link.clock.synced()) { return -1; }
+	var position = {at: link.clock.toDevice(data.at), x: data.x, y: data.y, theta: data.theta, phi: data.phi};
+	return TransmitCommand.prototype.transmit.call(this, link, position);
+}
+
+// Batched movements are split up into as many commands as they need
+var BatchTransmitCommand = function(commandByte) {
+	TransmitCommand.call(this, commandByte, batchEncoder, batchProcessor);
+}
+BatchTransmitCommand.prototype = Object.create(TransmitCommand.prototype);
+BatchTransmitCommand.prototype.transmit = function(link, data) {
+	for (var i=0; i<data.positions.length; i+=MOVE_BATCH_MAX) {
+		var batch = {relative: data.relative, positions: data.positions.slice(i, i+MOVE_BATCH_MAX)};
+		var command = this.formatSerialCommand(batch, link.protocol);
+		if (command == -1) { return -1; }
+		link.write(command, batch.positions.length);
+	}
+}
+
+
 // Move the platform to an absolute position
-exports.moveAbs = new TransmitCommand(0x01, threeByteEncoder, positionProcessor);
+exports.moveAbs = new TransmitCommand(0x01, positionEncoder, positionProcessor, 1);
 // Move the platform to a position relative to where it is now
-exports.moveRel = new TransmitCommand(0x02, threeByteEncoder, positionProcessor);
+exports.moveRel = new TransmitCommand(0x02, positionEncoder, positionProcessor, 1);
+// Move the platform to an absolute position, starting at a time (see
+// TimedTransmitCommand). Only one can be waiting to start at once
+exports.moveAt = new TimedTransmitCommand(0x23);
+// Move the platform through a list of positions (all absolute, unless relative
+// is set), queueing as many as we can per command
+exports.moveBatch = new BatchTransmitCommand(0x15);
 // Self-explanatory
 exports.homeX = new TransmitCommand(0x04);
 exports.homeY = new TransmitCommand(0x05);
@@ -83,3 +272,20 @@ exports.abort = new TransmitCommand(0x08);
 // Get the current position and target position
 exports.currentPosition = new TransmitCommand(0x03);
 exports.targetPosition = new TransmitCommand(0x0F);
+// Have the current position pushed to us whenever it changes, at most once
+// every period milliseconds (0 to stop)
+exports.subscribe = new TransmitCommand(0x17, wholeEncoder, function(period) { return [period]; });
+// Follow a smooth path through keyframes (see firmware/Path.c): clear them, add
+// up to 8 (each duration ms after the one before), then run it. Movements fail
+// while it's running
+exports.pathClear = new TransmitCommand(0x1D);
+exports.pathAdd = new TransmitCommand(0x1E, keyframeEncoder, keyframeProcessor);
+exports.pathRun = new TransmitCommand(0x1F);
+// Read or change a setting (frames only: see firmware/Command.c). Changes are
+// kept by the firmware across resets, and apply to movements sent afterwards
+exports.getParam = new TransmitCommand(0x1A, paramEncoder, function(param) {
+	return paramProcessor({name: param.name, axis: param.axis});
+});
+exports.setParam = new TransmitCommand(0x1B, paramEncoder, paramProcessor);
+exports.PARAMS = PARAMS;
+exports.AXES = AXES;
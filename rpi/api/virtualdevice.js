@@ -0,0 +1,373 @@
+// A stand-in for an Arduino on a serial port, so the bridge can run (and be
+// load tested: see loadtest.js) without one: a device in devices.json with
+// "virtual": true, or "replay": a capture (see capture.js). It takes the
+// SerialPort's place in-process: the bridge write()s to it, and it emits
+// 'data' with what it sends back. Bytes take as long each way as they would
+// at the baud rate, one after another as on the wire.
+//
+// Simulating, it speaks the protocol as firmware/Command.c does: lines until
+// it's asked for frames, then frames (see link.js), answering every command
+// as the firmware would. Movements run through a queue of QUEUE_SIZE, each
+// taking as long as the furthest axis takes at SPEED, so the position changes
+// and the queue frees up over time, and both are pushed to the bridge.
+//
+// Replaying, it answers each write with what the real device sent after the
+// same write in the capture, as long after it as it did.
+var util = require('util');
+var EventEmitter = require('events').EventEmitter;
+var link = require('./link.js');
+var capture = require('./capture.js');
+
+var LINE_END = 0x0D;
+var FRAME_END = 0x00;
+var FRAME_SEQUENCE = 0x80;
+
+var MOVE_ABS = 0x01;
+var MOVE_REL = 0x02;
+var GET_POS = 0x03;
+var HOME_X = 0x04;
+var HOME_Y = 0x05;
+var ABORT = 0x08;
+var POS_RETURN = 0x09;
+var TARGET_RETURN = 0x0A;
+var SUCCESS = 0x0B;
+var FAILURE = 0x0C;
+var MOVE_ABS_RETURN = 0x0E;
+var GET_TARGET = 0x0F;
+var MOVE_REL_RETURN = 0x10;
+var PROTOCOL = 0x11;
+var PROTOCOL_RETURN = 0x12;
+var FRAME_ACK = 0x13;
+var MOVE_BATCH = 0x15;
+var MOVE_BATCH_RETURN = 0x16;
+var SUBSCRIBE = 0x17;
+var POS_UPDATE = 0x18;
+var QUEUE_SPACE = 0x19;
+var GET_PARAM = 0x1A;
+var SET_PARAM = 0x1B;
+var PARAM_RETURN = 0x1C;
+var PATH_CLEAR = 0x1D;
+var PATH_ADD = 0x1E;
+var PATH_RUN = 0x1F;
+var PATH_RETURN = 0x20;
+var TIME = 0x21;
+var TIME_RETURN = 0x22;
+var MOVE_AT = 0x23;
+var HOME_RETURN = 0x24;
+
+var PROTOCOL_LINES = 0;
+var PROTOCOL_UNITS = 2;
+var FIXED_ONE = 0x10000;
+// As the firmware's (see firmware/Move.c and firmware/Path.c)
+var QUEUE_SIZE = 31;
+var PATH_KEYFRAMES = 8;
+// How fast movements go (mm or degrees, or steps on protocol 1, a second)
+var SPEED = 200;
+var BAUDRATE = 250000;
+
+function VirtualDevice(config) {
+	EventEmitter.call(this);
+	this.bitTime = 1000 / (config.baudrate || BAUDRATE);
+	// When each direction of the wire is next free (ms, as now())
+	this.toDeviceFree = 0;
+	this.fromDeviceFree = 0;
+	this.received = [];
+	this.started = now();
+
+	if (config.replay) {
+		this.records = capture.read(config.replay);
+		this.cursor = 0;
+	} else {
+		this.protocol = PROTOCOL_LINES;
+		this.sequence = null;
+		this.lastReply = null;
+		this.position = [0, 0, 0, 0];
+		// Movements waiting to run, each {from, to, start, duration}
+		this.queue = [];
+		this.running = null;
+		this.timer = null;
+		this.advertised = null;
+		this.keyframes = 0;
+		this.params = {};
+		this.period = 0;
+		this.subscription = null;
+		this.pushed = null;
+	}
+	setImmediate(this.emit.bind(this, 'open'));
+}
+util.inherits(VirtualDevice, EventEmitter);
+
+// ms, to a fraction, on a clock that never goes back
+var now = function() {
+	var time = process.hrtime();
+	return time[0] * 1000 + time[1] / 1e6;
+}
+
+// Take data from the bridge, as it arrives over the wire
+VirtualDevice.prototype.write = function(data) {
+	if (!Buffer.isBuffer(data)) { data = new Buffer(data); }
+	var arrives = this.transmitTime('toDeviceFree', data.length);
+	setTimeout(this.arrived.bind(this, data), Math.max(0, arrives - now()));
+}
+
+// Send data to the bridge, after what's already going
+VirtualDevice.prototype.send = function(data) {
+	var arrives = this.transmitTime('fromDeviceFree', data.length);
+	setTimeout(this.emit.bind(this, 'data', data), Math.max(0, arrives - now()));
+}
+
+// When length bytes sent now one way finish arriving: 10 bits each (start,
+// 8 data, and parity or stop)
+VirtualDevice.prototype.transmitTime = function(direction, length) {
+	var start = Math.max(now(), this[direction]);
+	this[direction] = start + length * 10 * this.bitTime;
+	return this[direction];
+}
+
+VirtualDevice.prototype.arrived = function(data) {
+	if (this.records) {
+		this.replay();
+		return;
+	}
+	for (var i = 0; i < data.length; i++) {
+		var delimiter = this.protocol > PROTOCOL_LINES ? FRAME_END : LINE_END;
+		if (data[i] != delimiter) {
+			this.received.push(data[i]);
+			continue;
+		}
+		var received = new Buffer(this.received);
+		this.received = [];
+		if (this.protocol > PROTOCOL_LINES) {
+			this.receiveFrame(received);
+		} else {
+			this.receiveLine(received);
+		}
+	}
+}
+
+// REPLAYING
+// Skip past the write in the capture this one stands for, then send what
+// came back after it, until the next write
+VirtualDevice.prototype.replay = function() {
+	var records = this.records;
+	while (this.cursor < records.length && records[this.cursor].direction != capture.TO_DEVICE) { this.cursor++; }
+	this.cursor++;
+	var delay = 0;
+	while (this.cursor < records.length && records[this.cursor].direction == capture.FROM_DEVICE) {
+		delay += records[this.cursor].delay;
+		setTimeout(this.emit.bind(this, 'data', records[this.cursor].data), delay);
+		this.cursor++;
+	}
+}
+
+// SIMULATING
+// Lines: only asking for frames does anything
+VirtualDevice.prototype.receiveLine = function(line) {
+	if (line.length != 2 || line[0] != PROTOCOL) { return; }
+	var version = Math.min(line[1], PROTOCOL_UNITS);
+	this.send(new Buffer([PROTOCOL_RETURN, version, LINE_END]));
+	this.setProtocol(version);
+}
+
+VirtualDevice.prototype.setProtocol = function(version) {
+	this.protocol = version;
+	this.sequence = null;
+	this.advertised = null;
+	this.pushQueueSpace();
+}
+
+VirtualDevice.prototype.receiveFrame = function(wire) {
+	var frame = link.decodeFrame(wire);
+	if (frame === null) {
+		this.sendFrame([0x14], 0);
+		return;
+	}
+	var sequence = frame[0] & FRAME_SEQUENCE;
+	// Repeated: reply again without acting on it twice
+	if (sequence === this.sequence && this.lastReply !== null) {
+		this.sendFrame(this.lastReply, sequence);
+		return;
+	}
+	var reply = this.command(frame[0] & ~FRAME_SEQUENCE, frame.slice(1));
+	this.sequence = sequence;
+	this.lastReply = reply;
+	this.sendFrame(reply, sequence);
+	// Asked for a different protocol: the reply's in the old one
+	if (reply[0] == PROTOCOL_RETURN) { this.setProtocol(reply[1]); }
+}
+
+VirtualDevice.prototype.sendFrame = function(bytes, sequence) {
+	this.send(link.encodeFrame(new Buffer(bytes), sequence));
+}
+
+// Act on a command, returning the bytes of the reply (see firmware/Command.c)
+VirtualDevice.prototype.command = function(opcode, data) {
+	switch (opcode) {
+		case MOVE_ABS:
+		case MOVE_REL:
+			var relative = (opcode == MOVE_REL);
+			var ok = this.addMovement(this.readPositions(data, 0), relative);
+			return [relative ? MOVE_REL_RETURN : MOVE_ABS_RETURN, ok ? SUCCESS : FAILURE, this.space()];
+		case MOVE_AT:
+			var ok = this.addMovement(this.readPositions(data, 4), false);
+			return [MOVE_ABS_RETURN, ok ? SUCCESS : FAILURE, this.space()];
+		case MOVE_BATCH:
+			var count = data[0] >> 4;
+			var size = this.positionSize() * 4;
+			var accepted = 0;
+			while (accepted < count && this.addMovement(this.readPositions(data, 1 + accepted * size), data[0] & 0x01)) {
+				accepted++;
+			}
+			return [MOVE_BATCH_RETURN, accepted << 4, this.space()];
+		case GET_POS:
+			return [POS_RETURN].concat(this.writePositions(this.currentPosition()));
+		case GET_TARGET:
+			return [TARGET_RETURN].concat(this.writePositions(this.target()));
+		case HOME_X:
+		case HOME_Y:
+			var axis = (opcode == HOME_X) ? 0 : 1;
+			this.position[axis] = 0;
+			return [HOME_RETURN, axis, SUCCESS];
+		case ABORT:
+			this.position = this.currentPosition();
+			this.queue = [];
+			this.running = null;
+			this.pushQueueSpace();
+			return [FRAME_ACK];
+		case SUBSCRIBE:
+			this.subscribe(data.readInt16BE(0));
+			return [FRAME_ACK];
+		case TIME:
+			return [TIME_RETURN, SUCCESS].concat(uint32(Math.floor(now() - this.started)));
+		case GET_PARAM:
+		case SET_PARAM:
+			if (opcode == SET_PARAM) { this.params[data[0]] = data.readUInt32BE(1); }
+			return [PARAM_RETURN, data[0], SUCCESS].concat(uint32(this.params[data[0]] || 0));
+		case PATH_CLEAR:
+		case PATH_ADD:
+		case PATH_RUN:
+			var ok = true;
+			if (opcode == PATH_CLEAR) { this.keyframes = 0; }
+			if (opcode == PATH_ADD) {
+				ok = this.keyframes < PATH_KEYFRAMES;
+				if (ok) { this.keyframes++; }
+			}
+			// Following the path isn't simulated: it's done as soon as it's run
+			if (opcode == PATH_RUN) { ok = this.keyframes > 1; }
+			return [PATH_RETURN, ok ? SUCCESS : FAILURE, this.keyframes];
+		case PROTOCOL:
+			return [PROTOCOL_RETURN, Math.min(data[0], PROTOCOL_UNITS)];
+		default:
+			return [FRAME_ACK];
+	}
+}
+
+// Positions: Q16.16 on protocol 2, int16s before
+VirtualDevice.prototype.positionSize = function() {
+	return this.protocol >= PROTOCOL_UNITS ? 4 : 2;
+}
+
+VirtualDevice.prototype.readPositions = function(data, offset) {
+	var positions = [];
+	for (var axis = 0; axis < 4; axis++) {
+		var at = offset + axis * this.positionSize();
+		if (at + this.positionSize() > data.length) { return null; }
+		positions.push(this.protocol >= PROTOCOL_UNITS ? data.readInt32BE(at) / FIXED_ONE : data.readInt16BE(at));
+	}
+	return positions;
+}
+
+VirtualDevice.prototype.writePositions = function(positions) {
+	var buf = new Buffer(4 * this.positionSize());
+	positions.forEach(function(position, axis) {
+		if (this.protocol >= PROTOCOL_UNITS) {
+			buf.writeInt32BE(Math.round(position * FIXED_ONE), axis * 4);
+		} else {
+			buf.writeInt16BE(Math.round(position), axis * 2);
+		}
+	}.bind(this));
+	return Array.prototype.slice.call(buf);
+}
+
+// MOVEMENTS
+VirtualDevice.prototype.space = function() {
+	return QUEUE_SIZE - this.queue.length;
+}
+
+// Where it'll end up once the queue's done
+VirtualDevice.prototype.target = function() {
+	if (this.queue.length > 0) { return this.queue[this.queue.length - 1].to.slice(); }
+	return this.position.slice();
+}
+
+VirtualDevice.prototype.addMovement = function(positions, relative) {
+	if (positions === null || this.space() == 0) { return false; }
+	var from = this.target();
+	var to = positions.map(function(position, axis) {
+		return relative ? from[axis] + position : position;
+	});
+	var distance = Math.max.apply(null, to.map(function(position, axis) {
+		return Math.abs(position - from[axis]);
+	}));
+	this.queue.push({from: from, to: to, duration: distance / SPEED * 1000});
+	this.runNext();
+	return true;
+}
+
+VirtualDevice.prototype.runNext = function() {
+	if (this.running !== null || this.queue.length == 0) { return; }
+	this.running = this.queue[0];
+	this.running.start = now();
+	setTimeout(this.finished.bind(this, this.running), this.running.duration);
+}
+
+VirtualDevice.prototype.finished = function(movement) {
+	// Aborted since
+	if (this.running !== movement) { return; }
+	this.position = movement.to;
+	this.queue.shift();
+	this.running = null;
+	this.pushQueueSpace();
+	this.runNext();
+}
+
+// Where it is now, part way through the movement that's running
+VirtualDevice.prototype.currentPosition = function() {
+	var movement = this.running;
+	if (movement === null) { return this.position.slice(); }
+	var done = movement.duration > 0 ? Math.min(1, (now() - movement.start) / movement.duration) : 1;
+	return movement.from.map(function(from, axis) {
+		return from + (movement.to[axis] - from) * done;
+	});
+}
+
+// PUSHES
+VirtualDevice.prototype.pushQueueSpace = function() {
+	if (this.protocol == PROTOCOL_LINES || this.space() === this.advertised) { return; }
+	this.advertised = this.space();
+	this.sendFrame([QUEUE_SPACE, this.advertised], 0);
+}
+
+// Push the position every period ms while it's changing (0 to stop)
+VirtualDevice.prototype.subscribe = function(period) {
+	clearInterval(this.subscription);
+	this.subscription = null;
+	this.pushed = null;
+	if (period <= 0) { return; }
+	var push = function() {
+		var position = this.currentPosition();
+		if (this.pushed !== null && position.every(function(p, axis) { return p == this.pushed[axis]; }.bind(this))) { return; }
+		this.pushed = position;
+		this.sendFrame([POS_UPDATE].concat(this.writePositions(position)), 0);
+	}.bind(this);
+	push();
+	this.subscription = setInterval(push, period);
+}
+
+var uint32 = function(value) {
+	var buf = new Buffer(4);
+	buf.writeUInt32BE(value >>> 0, 0);
+	return Array.prototype.slice.call(buf);
+}
+
+exports.VirtualDevice = VirtualDevice;
@@ -1,8 +1,14 @@
-// Repeatedly poll the queue. We're storing everything efficiently
-// enough that doesn't cause a problem, and it lets us update the ETA
-// as quickly as we want, which a pub sub mechanism wouldn't let us do
-// (unless an event was fired every second, in which case the pub sub
-// would be pointless)
+// The queue is pushed to us as it changes (see TimeslotsController#events):
+// we take a snapshot of it from /queue.json, then follow each change to it
+// from there. Changes are numbered, so if we miss any we take a new snapshot.
+// ETAs count down here, from when the user at the head of the queue came on,
+// so nothing needs to be sent just because time's passing. Browsers (and
+// servers) that can't do server-sent events poll /queue.json instead.
+
+// The last snapshot, with the changes since applied to it
+var queue_state = null;
+// Server time minus ours (ms)
+var queue_clock_offset = 0;
 
 // Take a hash of queue data and output it on the page
 function output_queue_data(data) {
@@ -22,24 +28,78 @@ function signed_in() {
 	return $('meta[name=signed_in]').attr("content") === "true";
 }
 
-// Update the queue view every .5s based on the newest data from Rails
+// A new snapshot of the queue
+function set_queue_state(data) {
+	queue_clock_offset = data.time - Date.now();
+	queue_state = data;
+	output_queue_state();
+}
+
+// Output the queue with ETAs (s) counted down to now: everyone waits for
+// what's left of the current session, then a whole one for each user between
+function output_queue_state() {
+	if (queue_state === null) { return; }
+	var data = $.extend({}, queue_state);
+	var now = Date.now() + queue_clock_offset;
+	var left = Math.max(0, data.time_period - (now - data.head_since) / 1000);
+	var wait = function(position) {
+		return position == 0 ? 0 : Math.ceil(left + (position - 1) * data.time_period);
+	}
+	if (!data.queue_empty) { data.queue_eta = wait(data.queue_length); }
+	if (data.in_queue) { data.eta = wait(data.position); }
+	output_queue_data(data);
+}
+
+// Apply a change to the queue (see UserQueue) to our snapshot
+function apply_queue_change(change) {
+	// Changes from before our snapshot, or while we're taking one
+	if (queue_state === null || change.version <= queue_state.version) { return; }
+	// We've missed some
+	if (change.version != queue_state.version + 1) {
+		update_queue();
+		return;
+	}
+
+	queue_state.version = change.version;
+	queue_state.queue_length = change.queue_length;
+	queue_state.queue_empty = (change.queue_length == 0);
+	queue_state.head_since = change.head_since;
+	// Whoever left or joined, anyone behind them moves
+	if (queue_state.in_queue && typeof(change.left) != 'undefined') {
+		if (change.left == queue_state.position) {
+			queue_state.in_queue = false;
+			delete queue_state.position;
+		} else if (change.left < queue_state.position) {
+			queue_state.position--;
+		}
+	}
+	if (signed_in()) {
+		queue_state.current_user = queue_state.in_queue && queue_state.position == 0;
+	}
+	output_queue_state();
+}
+
+// Show a flash alert message to the user
+// It'll be removed in output_queue_data when we next successfully get data
+function show_queue_network_error() {
+	$('.queue_network_error').remove() // Remove any previous flash error
+	var flash = $("<p>");
+	flash.attr('class', 'flash_error queue_network_error');
+	flash.text(I18n.t('error.queue_network_error'));
+	$("#container").prepend(flash);
+}
+
+// Take a new snapshot of the queue from Rails
 function update_queue(callback) {
 	$.ajax({
 		type: "GET",
 		url: "/queue.json",
-		success: output_queue_data,
-		error: function(data) {
-			// Show a flash alert message to the user
-			// It'll be removed in output_queue_data when we next successfully get data
-			$('.queue_network_error').remove() // Remove any previous flash error
-			var flash = $("<p>");
-			flash.attr('class', 'flash_error queue_network_error');
-			flash.text(I18n.t('error.queue_network_error'));
-			$("#container").prepend(flash);
-		},
+		success: set_queue_state,
+		error: show_queue_network_error,
 		complete: callback
 	});
 }
+// Poll every .5s, if we can't have changes pushed to us
 function update_queue_repeatedly() {
 	update_queue(function() {
 		// Call ourselves again in .5s
@@ -47,6 +107,32 @@ function update_queue_repeatedly() {
 	});
 }
 
+// Follow changes to the queue, taking a snapshot once we're following them
+// (and again each time we reconnect, as we'll have missed some)
+function follow_queue() {
+	if (typeof(window.EventSource) == 'undefined') {
+		update_queue_repeatedly();
+		return;
+	}
+	var source = new EventSource("/queue/events");
+	source.onopen = function() {
+		update_queue();
+	};
+	source.onmessage = function(event) {
+		apply_queue_change(JSON.parse(event.data));
+	};
+	source.onerror = function() {
+		// It reconnects by itself, unless the server can't push changes to us
+		if (source.readyState != EventSource.CLOSED) {
+			show_queue_network_error();
+			return;
+		}
+		update_queue_repeatedly();
+	};
+	// Count ETAs down
+	setInterval(output_queue_state, 1000);
+}
+
 // Add current user to queue by redirecting to POST to /queue
 function add_to_queue() {
 	// Best (only?) way to do this is by creating a form and submitting it
@@ -89,6 +175,6 @@ function bind_queue_buttons() {
 }
 
 $("#queue").ready(function() {
-	update_queue_repeatedly();
+	follow_queue();
 	bind_queue_buttons();
 });
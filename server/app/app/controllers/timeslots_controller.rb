@@ -1,26 +1,36 @@
 class TimeslotsController < ApplicationController
 	# GET /queue.json
   def index
-		# Build up a JSON response
-		# For documentation, see functional tests in timeslots_controller_spec
-		@data = {}
-		@data[:queue_length] = queue_manager.queue_length
-		@data[:queue_empty] = queue_manager.queue_empty?
-		@data[:queue_eta] = queue_manager.queue_eta unless @data[:queue_empty]
-		if signed_in?
-			if queue_manager.in_queue?(current_user)
-				@data[:in_queue] = true
-				@data[:position] = queue_manager.position current_user
-				@data[:eta] = queue_manager.eta current_user
-				@data[:current_user] = queue_manager.current_user? current_user
-			else
-				@data[:in_queue] = false
-				@data[:current_user] = false
-			end
+		# Mostly kept ready serialized: see QueueManager#status_json
+		render json: queue_manager.status_json(signed_in? ? current_user : nil)
+  end
+
+	# GET /queue/events
+	# Server-sent events, one for each change to the queue: see QueueEvents.
+	# Web servers that can't hand over the connection get a 501, and browsers
+	# fall back to polling GET /queue.json
+	def events
+		if queue_manager.events.supported?(request.env)
+			queue_manager.events.attach(request.env)
+			# The web server ignores this: the connection's ours now
+			head :ok
+		else
+			head :not_implemented
 		end
+	end
 
-		render json: @data
-  end
+	# GET /queue/control.json
+	# A token for the rig's bridge saying the user can drive it, if it's their
+	# timeslot: see QueueManager#control_token. Browsers ask again before it
+	# runs out, for as long as they're given one
+	def control
+		token = signed_in? ? queue_manager.control_token(current_user) : nil
+		if token.nil?
+			render json: {ok: false}, status: :forbidden
+		else
+			render json: {ok: true, token: token}
+		end
+	end
 
 	# POST /queue
   def create
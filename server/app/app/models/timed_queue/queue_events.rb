@@ -0,0 +1,97 @@
+# Pushes changes to a UserQueue to browsers as server-sent events, as they
+# happen, so browsers don't have to poll for them
+#
+# The queue's scripts publish each change on a redis channel (see UserQueue).
+# Each app process subscribes to it once, on a thread of its own, and writes
+# every change out to each browser connected to that process. Browsers'
+# connections are taken over from the web server (rack hijacking), so holding
+# them open ties up no worker: they cost a socket each, and a write per change.
+module TimedQueue
+	class QueueEvents
+		# Sent when nothing's changed for this long, so proxies keep the
+		# connections open and we notice ones that have gone
+		KEEPALIVE = 15.seconds
+		# How long browsers wait before reconnecting (ms)
+		RETRY = 2000
+
+		HEADERS = [
+			"HTTP/1.1 200 OK",
+			"Content-Type: text/event-stream",
+			"Cache-Control: no-cache",
+			"Connection: keep-alive",
+			# Tell nginx not to buffer the stream
+			"X-Accel-Buffering: no",
+			"", "retry: #{RETRY}", "", ""
+		].join("\r\n")
+
+		def initialize(channel)
+			@channel = channel
+			@clients = []
+			@lock = Mutex.new
+			@threads = []
+		end
+
+		# Can this web server hand over the connection?
+		def supported?(env)
+			env['rack.hijack?'] == true
+		end
+
+		# Take over a browser's connection, and send it every change from now on
+		def attach(env)
+			env['rack.hijack'].call
+			io = env['rack.hijack_io']
+			io.write HEADERS
+			@lock.synchronize do
+				@clients << io
+				start
+			end
+		end
+
+		private
+		# Threads are started on the first connection, so in each worker process
+		# rather than in one that's later forked
+		def start
+			return if @threads.any?(&:alive?)
+			@threads = [Thread.new { listen }, Thread.new { keep_alive }]
+		end
+
+		# Subscribing ties up a redis connection, so it gets one of its own
+		def listen
+			redis = Redis.new(host: $redis.client.host, port: $redis.client.port)
+			redis.subscribe(@channel) do |on|
+				on.message { |channel, message| broadcast "data: #{message}\n\n" }
+			end
+		rescue Redis::BaseConnectionError
+			# Browsers notice changes they missed meanwhile from the versions, and
+			# fetch a new snapshot
+			sleep 1
+			retry
+		end
+
+		def keep_alive
+			loop do
+				sleep KEEPALIVE
+				broadcast ":\n\n"
+			end
+		end
+
+		# Write to every browser, without waiting on any: ones that can't take
+		# it all at once have gone, or are too slow to keep up, so are dropped
+		# (they'll reconnect if they're still there)
+		def broadcast(text)
+			@lock.synchronize do
+				@clients.reject! do |io|
+					dropped = begin
+						io.write_nonblock(text) < text.bytesize
+					rescue IO::WaitWritable, IOError, SystemCallError
+						true
+					end
+					if dropped
+						io.close rescue nil
+					end
+					dropped
+				end
+			end
+		end
+	end
+end
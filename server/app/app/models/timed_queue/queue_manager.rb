@@ -1,4 +1,5 @@
 require 'singleton'
+require 'openssl'
 
 # Singleton managing a UserQueue instance
 module TimedQueue
@@ -7,9 +8,19 @@ module TimedQueue
 		# Length of each session
 		# TODO: Dynamic?
 		TIME_PERIOD = 2.minutes
+		# How long a control token lasts
+		CONTROL_PERIOD = 30.seconds
+
+		# Browsers following changes to the queue (see QueueEvents)
+		attr_reader :events
 
 		def initialize
 			@queue = UserQueue.new 'timeslots'
+			@events = QueueEvents.new @queue.channel
+			# See status_json
+			@shared_json = nil
+			@shared_of = nil
+			@shared_lock = Mutex.new
 		end
 
 		# Add a user to the queue
@@ -55,6 +66,46 @@ module TimedQueue
 			@queue.position(user)
 		end
 
+		# GET /queue.json for a user, or for someone not signed in (nil), as JSON
+		# For documentation, see functional tests in timeslots_controller_spec
+		#
+		# All but the user's own fields are the same for everyone until the queue
+		# changes, so they're kept serialized, and only rebuilt from a snapshot of
+		# a newer version. A request costs one call to redis (the snapshot), and
+		# serializing the few fields that are the user's own
+		def status_json(user)
+			snapshot = @queue.snapshot(user)
+			personal = {}
+			unless user.nil?
+				position = snapshot[:position]
+				personal[:in_queue] = (not position.nil?)
+				personal[:current_user] = (position == 0)
+				unless position.nil?
+					personal[:position] = position
+					personal[:eta] = position * TIME_PERIOD
+				end
+			end
+			# For counting down ETAs: the time now (ms since the epoch)
+			personal[:time] = milliseconds(Time.now)
+
+			# Splice the user's fields into the shared ones
+			shared_json(snapshot)[0...-1] + ',' + personal.to_json[1..-1]
+		end
+
+		# A token the rig's bridge (rpi/api/control.js) takes as proof that a user
+		# can drive it, if they're at the head of the queue (nil if not, or if no
+		# secret's shared with the bridge): "<user id>.<issued>.<until>.<signature>",
+		# times in ms since the epoch, signed with HOLOCAM_CONTROL_SECRET. It only
+		# lasts CONTROL_PERIOD, so control ends soon after their timeslot does
+		def control_token(user)
+			secret = ENV['HOLOCAM_CONTROL_SECRET']
+			return nil if secret.blank? or user.nil?
+			return nil unless @queue.snapshot(user)[:position] == 0
+			issued = Time.now
+			payload = [user.id, milliseconds(issued), milliseconds(issued + CONTROL_PERIOD)].join('.')
+			"#{payload}.#{OpenSSL::HMAC.hexdigest('sha256', secret, payload)}"
+		end
+
 		# Return the estimated time for all of the queue to run
 		def queue_eta
 			TIME_PERIOD * queue_length
@@ -65,5 +116,34 @@ module TimedQueue
 			return nil if pos.nil?
 			pos * TIME_PERIOD
 		end
+
+		private
+		# The fields of status_json that are the same for everyone, serialized,
+		# rebuilt whenever the snapshot they're from isn't the one they were built
+		# from. Its version alone would do, but for redis being emptied (between
+		# specs, say), which starts versions over
+		def shared_json(snapshot)
+			of = snapshot.values_at(:version, :length, :head_since)
+			@shared_lock.synchronize do
+				if of != @shared_of
+					length = snapshot[:length]
+					shared = {queue_length: length, queue_empty: length.zero?}
+					shared[:queue_eta] = TIME_PERIOD * length unless length.zero?
+					# For following changes from GET /queue/events, and counting down
+					# ETAs: which change this is as of, when the user at the head got
+					# there (ms since the epoch), and how long each gets (s)
+					shared[:version] = snapshot[:version]
+					shared[:head_since] = milliseconds(snapshot[:head_since])
+					shared[:time_period] = TIME_PERIOD.to_i
+					@shared_json = shared.to_json
+					@shared_of = of
+				end
+				@shared_json
+			end
+		end
+
+		def milliseconds(time)
+			(time.to_f * 1000).round
+		end
 	end
 end
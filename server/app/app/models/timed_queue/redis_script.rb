@@ -0,0 +1,24 @@
+require 'digest/sha1'
+
+# A Lua script run by redis, which runs it atomically: nothing else touches
+# the keys it's passed while it's running
+# See UserQueue for documentation
+module TimedQueue
+	class RedisScript
+		def initialize(source)
+			@source = source
+			@sha = Digest::SHA1.hexdigest(source)
+		end
+
+		# Run with the given keys and arguments, returning what the script does
+		# Redis keeps scripts it's seen by their SHA1, so only the first call
+		# (or the first after redis restarts) sends the whole script
+		# EVALSHA (EVAL) O(1) plus whatever the script does
+		def call(keys, argv = [])
+			$redis.evalsha(@sha, keys: keys, argv: argv)
+		rescue Redis::CommandError => e
+			raise unless e.message.start_with? 'NOSCRIPT'
+			$redis.eval(@source, keys: keys, argv: argv)
+		end
+	end
+end
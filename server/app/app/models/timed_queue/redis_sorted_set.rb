@@ -0,0 +1,36 @@
+# Transparent class representing a redis sorted set
+# See UserQueue for documentation
+module TimedQueue
+	class RedisSortedSet
+		attr_reader :redis_id
+
+		def initialize(redis_id)
+			@redis_id = redis_id
+		end
+
+		# Return number of members
+		# ZCARD O(1)
+		def length
+			$redis.zcard(@redis_id)
+		end
+
+		# Return the index of a member, lowest score first, or nil if it's not
+		# a member
+		# ZRANK O(log n)
+		def rank(el)
+			$redis.zrank(@redis_id, el)
+		end
+
+		# Does the set contain a certain member?
+		# ZSCORE O(1)
+		def include?(el)
+			not $redis.zscore(@redis_id, el).nil?
+		end
+
+		# Get the member at index i, lowest score first
+		# ZRANGE O(log n) (for getting 1 member)
+		def get(index)
+			$redis.zrange(@redis_id, index, index).first
+		end
+	end
+end
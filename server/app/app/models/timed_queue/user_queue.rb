@@ -3,117 +3,180 @@
 #
 # The requirement that makes this more complicated than just a linked list is:
 # we need to poll for a user's current position in the queue *much* more frequently
-# than updating the queue.
+# than updating the queue, and when it's busy thousands of users are waiting in it.
 #
-# Base level is a linked list containing user IDs, however this alone is inefficient.
-# We can push and pop from this list with O(1), however finding an element in the list
-# is O(n^2) (O(m) just to access the element at position m).
+# Base level is a sorted set of user IDs, each scored by a ticket: a counter that goes
+# up by one for each user that joins. Tickets are never reused, so the set is always in
+# the order users joined, and a user's position in the queue is just their rank in the
+# set, which redis finds in O(log n). Nobody's position has to be updated when users
+# ahead of them leave: their rank simply goes down.
 #
-# Instead, we use a hash to keep track of each user's position in the queue (user ID as
-# key, and index in our linked list as value). We can access this hash, and hence find out
-# the position of a user, with O(1). It then becomes the updating of the queue that is slow.
+# Pushing takes a ticket and adds to the set, popping takes the lowest ticket off it, and
+# removing finds the user's position and takes them off. Each needs more than one
+# command, so each runs as a Lua script, which redis runs atomically: concurrent changes
+# can't see the queue half updated.
 #
-# Pushing is still quick: it's O(1) to push to the linked list, and O(1) to update the one
-# relevant hash entry. Popping and removing are slower, though. The actual popping itself
-# requires O(1), and the removing O(n). But then we have to decrement (a large part of) the
-# hash, which requires O(n) (we can access the keys in O(n), and each decrement is O(1)).
+# Every change also publishes what changed (who joined or left at which position) on
+# a channel, from the same script, so the changes go out in the order they happened and
+# each is numbered with the queue's version. Browsers follow along from these (see
+# QueueEvents) rather than polling, starting from a snapshot with the version it's of.
 #
-# In summary, we can poll the position of a user in the queue in O(1), can push to the
-# queue with O(1), but to pop or remove requires O(n).
+# In summary, we can poll the position of a user in the queue, push to the queue, and
+# pop or remove from it, all in O(log n), each in one round trip to redis.
 module TimedQueue
 	class UserQueue
+		# All scripts take the same KEYS: the set, its ticket counter, its version, and
+		# when the user at the head of the queue got there (ms since the epoch). And the
+		# same ARGV: a user ID (if any), the time now (ms), and the channel changes are
+		# published on
+
+		# After a user's joined or left (change) at position, bump the version,
+		# note when the head changed, and publish the change
+		CHANGED = <<-LUA
+			local function changed(change, position)
+				if position == 0 then
+					redis.call('SET', KEYS[4], ARGV[2])
+				end
+				local event = {
+					version = redis.call('INCR', KEYS[3]),
+					time = tonumber(ARGV[2]),
+					queue_length = redis.call('ZCARD', KEYS[1]),
+					head_since = tonumber(redis.call('GET', KEYS[4]))
+				}
+				event[change] = position
+				redis.call('PUBLISH', ARGV[3], cjson.encode(event))
+			end
+		LUA
+
+		# Returns the user's position, or false if they're already in the queue
+		PUSH = RedisScript.new CHANGED + <<-LUA
+			if redis.call('ZSCORE', KEYS[1], ARGV[1]) then
+				return false
+			end
+			local ticket = redis.call('INCR', KEYS[2])
+			redis.call('ZADD', KEYS[1], ticket, ARGV[1])
+			local position = redis.call('ZCARD', KEYS[1]) - 1
+			changed('joined', position)
+			return position
+		LUA
+
+		# Returns the user ID at the head of the queue, or false if it's empty
+		POP = RedisScript.new CHANGED + <<-LUA
+			local head = redis.call('ZRANGE', KEYS[1], 0, 0)
+			if #head == 0 then
+				return false
+			end
+			redis.call('ZREM', KEYS[1], head[1])
+			changed('left', 0)
+			return head[1]
+		LUA
+
+		# Returns the position the user was at, or false if they weren't in the queue
+		REMOVE = RedisScript.new CHANGED + <<-LUA
+			local position = redis.call('ZRANK', KEYS[1], ARGV[1])
+			if not position then
+				return false
+			end
+			redis.call('ZREM', KEYS[1], ARGV[1])
+			changed('left', position)
+			return position
+		LUA
+
+		# Returns the version, length, the user's position (-1 if they're not in the
+		# queue), and when the head got there, all as of the same moment
+		SNAPSHOT = RedisScript.new <<-LUA
+			return {
+				tonumber(redis.call('GET', KEYS[3]) or 0),
+				redis.call('ZCARD', KEYS[1]),
+				redis.call('ZRANK', KEYS[1], ARGV[1]) or -1,
+				tonumber(redis.call('GET', KEYS[4]) or 0)
+			}
+		LUA
+
+		# Channel changes to the queue are published on
+		attr_reader :channel
+
 		def initialize(queue_name)
 			# Slug used for Redis key names
 			queue_slug = queue_name.parameterize
 
-			# Initialize new Redis-backed linked lists and hashes
-			@list = RedisList.new "queue_#{queue_slug}_list"
-			@hash = RedisHash.new "queue_#{queue_slug}_hash"
+			# Initialize new Redis-backed sorted set, and the counter its tickets
+			# come from
+			@set = RedisSortedSet.new "queue_#{queue_slug}_set"
+			@keys = [@set.redis_id, "queue_#{queue_slug}_ticket",
+				"queue_#{queue_slug}_version", "queue_#{queue_slug}_head_since"]
+			@channel = "queue_#{queue_slug}_events"
 		end
 
 		# Length of queue
 		def length
-			@list.length
+			@set.length
 		end
 		def empty?
 			length.zero?
 		end
 
 		# Add to end of queue
+		# Note that we only push if the user's not already in the queue
 		def push(user)
-			# Note that we only push if the user's not already in the queue
-			return false if user.nil? or user.id.nil? or in_queue?(user)
-
-			list_length = @list.push(user.id)
-			# Always returns true as user.id always a new key
-			@hash.set(user.id, list_length-1)
+			return false if user.nil? or user.id.nil?
+			not run(PUSH, user.id).nil?
 		end
 
 		# Remove from start of queue
 		def pop
-			user_id = @list.pop
+			user_id = run(POP)
 			return nil if user_id.nil?
 
-			# Remove user from position hash
-			@hash.delete user_id
-
-			# Update hash entries for all elements
-			decrement_position_values @list.values
-
 			# Return user from their id
 			User.find user_id
 		end
 
 		# Given a user, check if they're in the queue
-		# i.e. if they're in the hash
+		# i.e. if they're in the set
 		def in_queue?(user)
-			not (user.nil? or user.id.nil?) and @hash.include?(user.id)
+			not (user.nil? or user.id.nil?) and @set.include?(user.id)
 		end
 
 		# Return the position of a user in the queue
-		# i.e. the value they have in the hash
+		# i.e. their rank in the set
 		def position(user)
 			return nil if user.nil? or user.id.nil?
-			pos = @hash.get(user.id)
-			pos.nil? ? nil : pos.to_i  # convert to integer ignoring nils
+			@set.rank(user.id)
 		end
 
 		# Get the user at a given position in the queue
 		def get(index)
-			return nil if index.nil? or index < 0 or index >= @list.length
-			user_id = @list.get(@list.length-1 - index)
+			return nil if index.nil? or index < 0
+			user_id = @set.get(index)
 			return nil if user_id.nil?
 			User.find user_id
 		end
 
 		# Remove a user from the queue
-		# i.e. remove them from the list and hash
-		# and update everyone after them's hash entry
-		# Comparatively slow compared to all other methods
 		# Return whether we removed them successfully
 		def remove(user)
-			return false if user.nil? or user.id.nil? or not in_queue?(user)
-
-			# Even though we delete from the list by value, we need the index
-			# of the user for updating position values
-			user_index = @hash.get(user.id).to_i
-
-			# Remove from hash and list
-			@hash.delete user.id
-			@list.remove user.id
-
-			# Update new hash entries for everything after the user in the queue
-			decrement_position_values @list.values_after(user_index)
+			return false if user.nil? or user.id.nil?
+			not run(REMOVE, user.id).nil?
+		end
 
-			true
+		# The queue's version and length, a user's position (nil if they're not in it,
+		# or no user's given), and when the user at its head got there (a Time), all
+		# as of the same moment
+		def snapshot(user = nil)
+			user_id = (user.nil? or user.id.nil?) ? '' : user.id
+			version, length, position, head_since = run(SNAPSHOT, user_id)
+			{
+				version: version,
+				length: length,
+				position: position < 0 ? nil : position,
+				head_since: Time.at(head_since / 1000.0)
+			}
 		end
 
 		private
-		# For each id in the passed list, decrement it's position
-		def decrement_position_values(ids)
-			ids.each do |id|
-				@hash.decrement id
-			end
+		def run(script, user_id = '')
+			script.call(@keys, [user_id, (Time.now.to_f * 1000).round, @channel])
 		end
 	end
 end
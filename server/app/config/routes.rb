@@ -8,6 +8,8 @@ Rails.application.routes.draw do
 
 	# Timeslots controllers
 	get '/queue' => 'timeslots#index'
+	get '/queue/events' => 'timeslots#events'
+	get '/queue/control' => 'timeslots#control'
 	post '/queue' => 'timeslots#create'
 	delete '/queue' => 'timeslots#destroy'
 
@@ -103,6 +103,64 @@ RSpec.describe TimeslotsController, type: :controller do
 				end
 			end
 		end
+
+		context "when the queue changes" do
+			it "returns the next version" do
+				get_index
+				version = @data["version"]
+				populate_queue
+				get_index
+
+				expect(@data["version"]).to eq(version + 1)
+				expect(@data["time"]).to be >= @data["head_since"]
+				expect(@data["time_period"]).to be > 0
+			end
+		end
+	end
+
+  describe "GET #events" do
+		it "tells servers that can't hand over the connection to poll instead" do
+			get :events
+			expect(response.status).to eq(501)
+		end
+	end
+
+  describe "GET #control" do
+		around(:each) do |example|
+			ENV['HOLOCAM_CONTROL_SECRET'] = 'secret'
+			example.run
+			ENV.delete 'HOLOCAM_CONTROL_SECRET'
+		end
+
+		def get_control
+			get :control
+			@data = JSON.parse response.body
+		end
+
+		it "gives the user at the head of the queue a token" do
+			sign_in
+			controller.queue_manager.add controller.current_user
+			get_control
+
+			expect(@data["ok"]).to eq(true)
+			expect(@data["token"]).to start_with("#{controller.current_user.id}.")
+			expect(@data["token"].split('.').length).to eq(4)
+		end
+
+		it "refuses users waiting behind someone else" do
+			sign_in
+			controller.queue_manager.add FactoryGirl.create(:testuser)
+			controller.queue_manager.add controller.current_user
+			get_control
+
+			expect(response.status).to eq(403)
+			expect(@data["ok"]).to eq(false)
+		end
+
+		it "refuses users not signed in" do
+			get_control
+			expect(response.status).to eq(403)
+		end
 	end
 
   describe "POST #create" do
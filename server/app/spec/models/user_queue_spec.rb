@@ -244,6 +244,11 @@ RSpec.describe TimedQueue::UserQueue, type: :model do
 			it "should return our queue position correctly" do
 				expect(queue.position(user)).to eq(@expected_position)
 			end
+			it "moves everyone behind the user up one when they're removed" do
+				behind = FactoryGirl.create(:testuser)
+				queue.push(behind)
+				expect { queue.remove(user) }.to change { queue.position(behind) }.by(-1)
+			end
 		end
 
 		context "when queue empty" do
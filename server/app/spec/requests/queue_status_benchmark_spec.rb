@@ -0,0 +1,52 @@
+require 'rails_helper'
+require 'benchmark'
+
+# GET /queue.json is what every browser asks for (see queue.js), so it should
+# cost as little as we can make it: see QueueManager#status_json
+RSpec.describe "GET /queue.json", type: :request do
+	let(:qm) { TimedQueue::QueueManager.instance }
+	let(:requests) { 200 }
+	# Slowest each request can be on average (s). Far above what it takes, as
+	# machines vary: it's to catch it doing a query per user again
+	let(:ceiling) { 0.02 }
+
+	before(:each) do
+		20.times { qm.add FactoryGirl.create(:testuser) }
+	end
+
+	# Number of database queries run in the block
+	def count_queries
+		queries = 0
+		counter = lambda { |*args| queries += 1 }
+		ActiveSupport::Notifications.subscribed(counter, "sql.active_record") { yield }
+		queries
+	end
+
+	it "makes one call to redis and no database queries" do
+		# Redis has to be sent the script the first time (see RedisScript)
+		get '/queue.json'
+		allow($redis.client).to receive(:call).and_call_original
+		queries = count_queries { get '/queue.json' }
+
+		expect(response).to have_http_status(:ok)
+		expect($redis.client).to have_received(:call).once
+		expect(queries).to eq(0)
+	end
+
+	it "is rebuilt when the queue changes" do
+		get '/queue.json'
+		qm.step
+		get '/queue.json'
+		expect(JSON.parse(response.body)["queue_length"]).to eq(19)
+	end
+
+	# Only run on demand (see spec_helper)
+	it "answers requests quickly", :benchmark do
+		time = Benchmark.realtime do
+			requests.times { get '/queue.json' }
+		end
+		puts "\n#{requests} requests: #{(time * 1000 / requests).round(2)}ms each"
+		expect(JSON.parse(response.body)["queue_length"]).to eq(20)
+		expect(time / requests).to be < ceiling
+	end
+end
@@ -41,6 +41,10 @@ RSpec.configure do |config|
     mocks.verify_partial_doubles = true
   end
 
+  # Benchmarks (tagged :benchmark) are slow, and their timings depend on the
+  # machine, so they only run when asked for: BENCHMARK=1 rspec
+  config.filter_run_excluding :benchmark unless ENV['BENCHMARK']
+
 # The settings below are suggested to provide a good initial experience
 # with RSpec, but feel free to customize to your heart's content.
 =begin